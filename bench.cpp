@@ -0,0 +1,259 @@
+// bench.cpp
+// Micro-benchmarks of the terrain hot paths of planet.c and test.cpp, so that
+// regressions can be measured. Every benchmark uses the same seeds and the same
+// sequence of points in every run, is warmed up, and is then timed over a number
+// of repetitions, of which the median and percentiles are reported. Benchmarks
+// whose work depends on the terrain are run once for each of benchSeeds.
+//
+// Build (with libs/Planet as for test.cpp):
+//   cc -O2 -DPLANET_LIBRARY -DPLANET_BENCH -fvisibility=hidden -c planet.c
+//   objcopy --localize-hidden planet.o
+//   c++ -O2 -o bench bench.cpp planet.o <libs/Planet objects> -lm -lpthread
+//
+// Usage: bench [-r repetitions] [-w warmups] [-t ms] [-f filter] [-j file.json]
+//   -r  timed repetitions of each benchmark (default 15)
+//   -w  untimed repetitions first (default 3)
+//   -t  the number of operations of a repetition is doubled until it takes
+//       this many milliseconds (default 50)
+//   -f  only run the benchmarks whose names contain filter
+//   -j  also write the results as JSON to file (- for standard output)
+
+#define TEST_NO_MAIN
+#include "test.cpp"
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <functional>
+
+// workloads of planet.c, compiled with -DPLANET_BENCH
+extern "C" {
+  void planet_bench_seed(double seed);
+  double planet_bench_planet(int depth, long n);
+  double planet_bench_planet1(int hot, long n);
+  double planet_bench_rand2(long n);
+  int planet_bench_map(const char *format, int width, int height);
+  void planet_bench_write(long n);
+}
+
+const double benchSeeds[] = { 0.21, 0.5, 0.83 }; // seeds of the planets, as rseed of test.cpp
+int repetitions = 15;
+int warmups = 3;
+double minMillis = 50.0;
+string filter;
+
+struct struct_Result {
+  string name;
+  string seed; // empty if the benchmark does not depend on the seed
+  long ops; // operations per repetition
+  vector<double> nsPerOp; // of each repetition, sorted
+  double checksum; // of the last repetition
+};
+
+vector<struct_Result> results;
+
+double nowNanos() {
+  return chrono::duration<double, nano>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// seed as it appears in benchmark names and the JSON
+string seedName(double seed) {
+  ostringstream out;
+  out << seed;
+  return out.str();
+}
+
+// value at fraction q of sorted v (nearest rank)
+double percentile(const vector<double> &v, double q) {
+  size_t k = static_cast<size_t>(q * (v.size() - 1) + 0.5);
+  return v[k];
+}
+
+// Times run(n), which does n operations and returns a checksum of them. setup, if given, is
+// called before each repetition outside the timing. With fixedOps, n is fixedOps instead of
+// being doubled until a repetition takes minMillis.
+// With seed, the name gets "/seed=" and the seed.
+void measure(const string &name, function<double(long)> run, function<void()> setup = nullptr, long fixedOps = 0,
+             const string &seed = "") {
+  string fullName = seed.empty() ? name : name + "/seed=" + seed;
+  if (!filter.empty() && fullName.find(filter) == string::npos) return;
+  struct_Result result;
+  result.name = fullName;
+  result.seed = seed;
+  long n = fixedOps > 0 ? fixedOps : 1;
+  double t;
+  for (;;) { // calibrate (this also warms up)
+    if (setup) setup();
+    t = nowNanos();
+    result.checksum = run(n);
+    t = nowNanos() - t;
+    if (fixedOps > 0 || t >= minMillis * 1e6 || n >= (1L << 40)) break;
+    n *= 2;
+  }
+  for (int w = 0; w < warmups; w++) {
+    if (setup) setup();
+    result.checksum = run(n);
+  }
+  for (int r = 0; r < repetitions; r++) {
+    if (setup) setup();
+    t = nowNanos();
+    result.checksum = run(n);
+    result.nsPerOp.push_back((nowNanos() - t) / n);
+  }
+  result.ops = n;
+  sort(result.nsPerOp.begin(), result.nsPerOp.end());
+  cout << left << setw(40) << fullName << right << setw(12) << n
+       << fixed << setprecision(1)
+       << setw(14) << percentile(result.nsPerOp, 0.5)
+       << setw(14) << percentile(result.nsPerOp, 0.1)
+       << setw(14) << percentile(result.nsPerOp, 0.9)
+       << setprecision(0) << setw(14) << 1e9 / percentile(result.nsPerOp, 0.5) << endl;
+  results.push_back(result);
+}
+
+void writeJSON(ostream &out) {
+  out.unsetf(ios_base::floatfield);
+  out << setprecision(6) << "{\n  \"seeds\": [";
+  for (size_t k = 0; k < sizeof(benchSeeds) / sizeof(benchSeeds[0]); k++)
+    out << (k > 0 ? ", " : "") << seedName(benchSeeds[k]);
+  out << "],\n  \"repetitions\": " << repetitions
+      << ",\n  \"warmups\": " << warmups << ",\n  \"benchmarks\": [\n";
+  for (size_t k = 0; k < results.size(); k++) {
+    const struct_Result &r = results[k];
+    double mean = 0.0;
+    for (double v : r.nsPerOp) mean += v;
+    mean /= r.nsPerOp.size();
+    out << "    {\"name\": \"" << r.name << "\"";
+    if (!r.seed.empty()) out << ", \"seed\": " << r.seed;
+    out << ", \"ops\": " << r.ops
+        << ", \"ns_per_op\": {\"min\": " << r.nsPerOp.front()
+        << ", \"p10\": " << percentile(r.nsPerOp, 0.1)
+        << ", \"median\": " << percentile(r.nsPerOp, 0.5)
+        << ", \"p90\": " << percentile(r.nsPerOp, 0.9)
+        << ", \"p99\": " << percentile(r.nsPerOp, 0.99)
+        << ", \"max\": " << r.nsPerOp.back()
+        << ", \"mean\": " << mean << "}"
+        << ", \"ops_per_second\": " << 1e9 / percentile(r.nsPerOp, 0.5)
+        << ", \"checksum\": " << setprecision(17) << r.checksum << setprecision(6) << "}"
+        << (k + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+// the icosahedron of test.cpp, tessellated to level
+void makeMesh(int level, vector<struct_VertexArray> &VertexArray, vector<struct_FaceArray> &FaceArray_current) {
+  VertexArray = generate_initial_icosahedron_vertices();
+  FaceArray_current = associate_initial_faces();
+  for (int l = level; l > 0; l--) tessellateLevel(VertexArray, FaceArray_current, l);
+}
+
+int main(int argc, char **argv) {
+  string jsonFile;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && strcmp(argv[i], "-r") == 0) repetitions = max(1, atoi(argv[++i]));
+    else if (i + 1 < argc && strcmp(argv[i], "-w") == 0) warmups = max(0, atoi(argv[++i]));
+    else if (i + 1 < argc && strcmp(argv[i], "-t") == 0) minMillis = atof(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-f") == 0) filter = argv[++i];
+    else if (i + 1 < argc && strcmp(argv[i], "-j") == 0) jsonFile = argv[++i];
+    else {
+      cerr << "Usage: bench [-r repetitions] [-w warmups] [-t ms] [-f filter] [-j file.json]\n";
+      return 1;
+    }
+  }
+
+  cout << left << setw(40) << "benchmark" << right << setw(12) << "ops"
+       << setw(14) << "median ns/op" << setw(14) << "p10" << setw(14) << "p90"
+       << setw(14) << "ops/s" << endl;
+
+  // ******************** planet.c ********************
+  const int depths[] = { 12, 24, 36, 48 };
+  const char *formats[] = { "bmp", "ppm", "xpm", "heights", "int16", "float32" };
+  for (double seed : benchSeeds) {
+    string s = seedName(seed);
+    for (int depth : depths)
+      measure("planet/depth=" + to_string(depth), [depth](long n) { return planet_bench_planet(depth, n); },
+              [seed] { planet_bench_seed(seed); }, 0, s);
+    measure("planet1/hot", [](long n) { return planet_bench_planet1(1, n); }, [seed] { planet_bench_seed(seed); }, 0, s);
+    measure("planet1/cold", [](long n) { return planet_bench_planet1(0, n); }, [seed] { planet_bench_seed(seed); }, 0, s);
+    for (const char *format : formats) {
+      string name = "write/" + string(format) + "/1024x512";
+      if (!filter.empty() && (name + "/seed=" + s).find(filter) == string::npos) continue;
+      planet_bench_seed(seed);
+      if (planet_bench_map(format, 1024, 512) != 0) continue;
+      measure(name, [](long n) { planet_bench_write(n); return 0.0; }, nullptr, 0, s);
+    }
+  }
+  measure("rand2", [](long n) { return planet_bench_rand2(n); });
+
+  // ******************** test.cpp ********************
+  showProgress = false;
+
+  vector<double> lats(1024), longs(1024);
+  for (int k = 0; k < 1024; k++) { // fixed points, spread over the sphere
+    lats[k] = asin(2.0 * ((k * 0.6180339887498949) - floor(k * 0.6180339887498949)) - 1.0);
+    longs[k] = (k * 2.399963229728653) - 2.0 * pi * floor(k * 2.399963229728653 / (2.0 * pi)) - pi;
+  }
+  measure("ll_to_xyz", [&](long n) {
+    double sum = 0.0;
+    for (long k = 0; k < n; k++) { llxyz c = ll_to_xyz(lats[k & 1023], longs[k & 1023]); sum += c.x + c.y + c.z; }
+    return sum;
+  });
+  measure("midpointCalc", [&](long n) {
+    double sum = 0.0;
+    for (long k = 0; k < n; k++) {
+      vector<double> m = midpointCalc(lats[k & 1023], longs[k & 1023], lats[(k + 1) & 1023], longs[(k + 1) & 1023]);
+      sum += m[0] + m[1];
+    }
+    return sum;
+  });
+  const int edgeCounts[] = { 100, 1000, 10000, 100000 };
+  for (int edges : edgeCounts) {
+    vector<struct_EdgeArray> EdgeArray;
+    for (int e = 0; e < edges; e++) EdgeArray.push_back({ 2 * e, 2 * e + 1, e }); // as tessellateLevel() stores them
+    measure("checkEdgeDivide/edges=" + to_string(edges), [EdgeArray](long n) mutable {
+      double sum = 0.0;
+      for (long k = 0; k < n; k++) { // half found (at any place), half not
+        int e = static_cast<int>((k * 2654435761UL) % EdgeArray.size());
+        sum += (k & 1) ? checkEdgeDivide(EdgeArray, 2 * e + 1, 2 * e) : checkEdgeDivide(EdgeArray, 2 * e, 2 * e + 2);
+      }
+      return sum;
+    });
+  }
+
+  // one level of tessellation, from level 4 (2562 vertices) to 5, and the .OBJ of level 5
+  for (double seed : benchSeeds) {
+    string s = seedName(seed);
+    if (!filter.empty() && ("tessellate/level=5/seed=" + s).find(filter) == string::npos
+        && ("writeOBJ/level=5/seed=" + s).find(filter) == string::npos)
+      continue;
+    rseed = seed;
+    initialize_vertices();
+    for (int t = 0; t < 4; t++) tetra[t].h = 0.0; // as test.cpp's main
+    vector<struct_VertexArray> meshVertices, VertexArray;
+    vector<struct_FaceArray> meshFaces, FaceArray_current;
+    makeMesh(4, meshVertices, meshFaces);
+    measure("tessellate/level=5", [&](long) {
+      tessellateLevel(VertexArray, FaceArray_current, 1);
+      return VertexArray.back().v_Height;
+    }, [&] { VertexArray = meshVertices; FaceArray_current = meshFaces; }, 1, s);
+    VertexArray = meshVertices; FaceArray_current = meshFaces;
+    tessellateLevel(VertexArray, FaceArray_current, 1);
+    measure("writeOBJ/level=5", [&](long n) {
+      for (long k = 0; k < n; k++) {
+        ofstream outFile("/dev/null");
+        writeOBJ(outFile, VertexArray, FaceArray_current);
+      }
+      return static_cast<double>(VertexArray.size());
+    }, nullptr, 0, s);
+  }
+
+  if (jsonFile == "-") writeJSON(cout);
+  else if (!jsonFile.empty()) {
+    ofstream out(jsonFile);
+    if (!out.is_open()) {
+      cerr << "Unable to open " << jsonFile << " for writing.\n";
+      return 1;
+    }
+    writeJSON(out);
+  }
+  return 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+# check_recolour.sh
+# Checks that a map recoloured from a sea-level cache (-k) with a new -i
+# has the same pixels as a full render at that -i, for each projection and
+# shading mode, and that -k refuses the maps that need rain shadow.
+#
+# Usage: check_recolour.sh [planet program] [colour file]
+#   (default ./planet and Olsson.col; build planet with
+#    cc -O2 -o planet planet.c -lm -lpthread)
+# Exits non-zero if any map differs.
+
+PLANET=${1:-./planet}
+COLOURS=${2:-Olsson.col}
+case $PLANET in /*) ;; *) PLANET=$(pwd)/$PLANET ;; esac
+case $COLOURS in /*) ;; *) COLOURS=$(pwd)/$COLOURS ;; esac
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/recolour.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+W=200; H=100
+BYTES=$((W*H*3)) # pixels of a PPM, after its header (which holds the command line)
+COMMON="-s 0.314 -w $W -h $H -P -C $COLOURS"
+failed=0; checked=0
+
+run() { # planet, quietly, stopping the check if it fails
+  $PLANET "$@" >/dev/null 2>&1 || { echo "planet $* failed"; exit 1; }
+}
+
+for p in m p q M S s o g i a c; do
+  for shading in "" -B -b -d; do
+    for M in -0.01 0.015; do
+      run $COMMON -p$p $shading -o cached.ppm -K sea.bin
+      run $COMMON -p$p $shading -o recoloured.ppm -k sea.bin -i $M
+      run $COMMON -p$p $shading -o full.ppm -i $M
+      tail -c $BYTES recoloured.ppm > a; tail -c $BYTES full.ppm > b
+      checked=$((checked+1))
+      if ! cmp -s a b; then
+        echo "differs: -p$p $shading -i $M"
+        failed=$((failed+1))
+      fi
+    done
+  done
+done
+
+for option in -r -z -Z; do
+  if $PLANET $COMMON -o refused.ppm -k sea.bin -i 0.01 $option >/dev/null 2>&1; then
+    echo "not refused: -k with $option"
+    failed=$((failed+1))
+  fi
+done
+
+echo "$checked recoloured maps checked, $failed failures"
+[ $failed -eq 0 ]
@@ -46,6 +46,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef NOTHREADS /* compile with -DNOTHREADS to write without a thread */
+#include <pthread.h>
+#include <time.h>
+#endif
+#if defined(WIN32) || defined(_WIN32)
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#endif
+#include "planet.h"
 
 int BLACK = 0;
 int WHITE = 1;
@@ -85,6 +99,19 @@ typedef enum ftype
 
 ftype file_type = bmp;
 
+/* Heightfields are text, or raw little-endian samples after a 64 byte */
+/* header (see printbinheights()), so they can be mmap'ed as an array. */
+typedef enum hformat
+    {
+        htext,
+        hint16,
+        hint32,
+        hfloat32
+    }
+    hformat;
+
+hformat height_format = htext;
+
 char* file_ext(ftype file_type)
 {
   switch (file_type)
@@ -96,7 +123,12 @@ char* file_ext(ftype file_type)
     case xpm:
       return (".xpm");
     case heightfield:
-      return (".heightfield");
+      switch (height_format) {
+        case hint16:   return (".h16");
+        case hint32:   return (".h32");
+        case hfloat32: return (".f32");
+        default:       return (".heightfield");
+      }
     default:
       return ("");
   }
@@ -169,15 +201,26 @@ char biomes[45][45] = {
 #define PI 3.14159265358979323846 // macro, replaces text with the number.
 #define DEG2RAD 0.01745329251994329576923 /* pi/180 */
 
+/* Each thread has its own copy of the globals planet_chunk() sets, so */
+/* the chunk workers of planet_stream() can make chunks side by side. */
+#if defined(NOTHREADS)
+#define THREADLOCAL
+#elif defined(_MSC_VER)
+#define THREADLOCAL __declspec(thread)
+#else
+#define THREADLOCAL __thread
+#endif
+
 /* these three values can be changed to change world characteristica */
 
-double M  = -.02;   /* initial altitude (slightly below sea level) */
-double dd1 = 0.45;  /* weight for altitude difference */
+THREADLOCAL double M = -.02; /* initial altitude (slightly below sea level) */
+THREADLOCAL double dd1 = 0.45;  /* weight for altitude difference */
 double POWA = 1.0; /* power for altitude difference */
-double dd2 = 0.035; /* weight for distance */
+THREADLOCAL double dd2 = 0.035; /* weight for distance */
 double POW = 0.47;  /* power for distance function */
 
 int Depth; /* depth of subdivisions */
+int adaptDepth = 0; /* if 1, Depth follows the surface covered by pixels */
 double r1,r2,r3,r4; /* seeds */
 double longi,lat,scale;
 double vgrid, hgrid;
@@ -186,24 +229,79 @@ int latic = 0; /* flag for latitude based colour */
 
 int Width = 800, Height = 600; /* default map size */
 
-unsigned short **col;  /* colour array */
-int **heights;         /* heightfield array */
-double **xxx, **yyy, **zzz; /* x,y,z arrays  (used for gridlines */
+/* Maps are kept as one contiguous row-major array per channel, so the */
+/* projections and writers, which work row by row, read memory in order. */
+/* Compile with -DSMALLCOL to keep colours in bytes (at most 256 colours). */
+typedef planet_colour colno; /* colour number */
+#ifdef SMALLCOL
+#define MAXCOLS 256
+#else
+#define MAXCOLS 65536
+#endif
+
+colno *col;            /* colour array */
+int *heights;          /* heightfield array */
+float *fheights;       /* heightfield array for -Hf (raw altitudes) */
+float *altitudes;      /* altitude array (only for planet_render()) */
+double *xxx, *yyy, *zzz; /* x,y,z arrays  (used for gridlines */
 int cl0[60][30]; /* search map */
 
 int do_outline = 0;  /* if 1, draw coastal outline */
 int do_bw = 0;       /* if 1, reduce map to black outline on white */
 int contourLines = 0; /* if >0, # of contour lines */
 int coastContourLines = 0; /* if >0, # of coastal contour lines */
-int *outx, *outy;
 
 int doshade = 0;
 int shade;
-unsigned short **shades; /* shade array */
+unsigned short *shades; /* shade array */
 double shade_angle = 150.0; /* angle of "light" on bumpmap */
 double shade_angle2 = 20.0; /* with daylight shading, these two are
                                longitude/latitude */
 
+/* When streaming (-Q), rows are outlined, gridded, smoothed and written */
+/* as soon as their neighbours are rendered, so col, shades and the grid */
+/* arrays only keep a ring of RINGROWS rows instead of the whole map. */
+int streaming = 0;  /* if 1, write rows while the map is rendered */
+int rowmask = -1;   /* row j is kept in row j & rowmask (-1: all rows) */
+#define RINGROWS 8  /* rows kept when streaming (a power of 2) */
+#define ROWS ((rowmask < 0) ? Height : rowmask+1)
+
+#define PIXEL(i,j) ((long)((j)&rowmask)*Width+(i)) /* index of pixel (i,j) */
+#define COL(i,j) col[PIXEL(i,j)]
+#define SHADES(i,j) shades[PIXEL(i,j)]
+#define XXX(i,j) xxx[PIXEL(i,j)]
+#define YYY(i,j) yyy[PIXEL(i,j)]
+#define ZZZ(i,j) zzz[PIXEL(i,j)]
+
+/* With -e n, pixels on or next to coasts and contour lines (as found by */
+/* outlinepoint()) get n x n subsamples, which are blended into one */
+/* colour. Other pixels keep their single sample. For odd n, that sample */
+/* is the middle one of the n x n; for even n no subsample is at the */
+/* pixel centre, so all n x n are new. */
+int superSamples = 0;        /* n, if > 1 */
+unsigned int *blend = NULL;  /* 0, or BLENDED + RGB of subsamples */
+#define BLENDED 0x1000000
+#define BLEND(i,j) blend[PIXEL(i,j)]
+
+/* A map tile is a Width x Height window at (mapX0,mapY0) of a */
+/* mapWidth x mapHeight map. Tile zoom level z is a square projection */
+/* of 2^(z+1) x 2^z tiles of tileSize x tileSize pixels. */
+int mapWidth, mapHeight;   /* size of whole map */
+int mapX0 = 0, mapY0 = 0;  /* position of rendered window in whole map */
+char *tileDir = NULL;      /* if set, render tiles as tileDir/z/x/y */
+int tileSize = 256;        /* width and height of tiles */
+int tileZ0 = 0, tileZ1 = 0; /* zoom levels to render */
+int tileX = -1, tileY = -1; /* if set, render only this tile of tileZ0 */
+int workers = 1;           /* processes rendering tiles */
+
+/* Finished rows are formatted into blocks of BANDROWS rows, which a */
+/* writer thread writes while the next rows are computed. */
+#define NBLOCK 4     /* blocks in writer queue */
+#define BANDROWS 16  /* rows per block */
+colno *rowcol;           /* row made by finishrow() */
+unsigned short *rowshade;
+char *grid0, *grid1; /* grid points of a row and the row below */
+
 double cla, sla, clo, slo, rseed;
 
 int temperature = 0; /* if 1, show temperatures based on latitude
@@ -218,15 +316,121 @@ double rainShadow = 0.0; /* approximate rain shadow */
 
 int makeBiomes = 0; /* if 1, make biome map */
 
+int allChannels = 0; /* if 1, make height, shade, temperature, rainfall
+                        and biome maps in one pass */
+colno *colT, *colR, *colB; /* temperature, rainfall, biome */
+
+THREADLOCAL int doRainShadow = 0; /* if 1, calculate rain shadow in planet() */
+
 int matchMap = 0;
 double matchSize = 0.1;
 
+/* Compile with -DPLANET_STATS to count how points are found, for */
+/* tuning Depth and the cache of planet1(): cache hits and misses, the */
+/* levels each point descends, the re-entries of planet() that make ab */
+/* the longest edge, and the cuts taking their height from the -M map. */
+/* They are kept for STATBANDS bands of rows of the map and written to */
+/* stderr after it. Without PLANET_STATS, STAT() leaves out the counting. */
+/* The counts are not locked, so only renders of one thread are exact. */
+#ifdef PLANET_STATS
+#define STATBANDS 16
+#define STATLEVELS 64
+#define STAT(s) s
+int statBand = 0;              /* band of the row of planet0() */
+long statPoints[STATBANDS];    /* calls of planet1() */
+long statHits[STATBANDS];      /* started from the cached tetrahedron */
+long statStale[STATBANDS];     /* not tried, as Depth dropped below it */
+long statTraced[STATBANDS];    /* started from the top to be recorded */
+long statReorders[STATBANDS];  /* re-entries to make ab the longest edge */
+long statCuts[STATBANDS];      /* calls of newvertex() */
+long statMapped[STATBANDS];    /* cuts with their height from the -M map */
+long statLevels[STATBANDS][STATLEVELS]; /* points by levels descended */
+#else
+#define STAT(s)
+#endif
+
+/* Heights are kept relative to sea level (M) and M is only added when */
+/* a point is coloured, so a sea-level cache of the rendered points can */
+/* be recoloured for a new M without repeating the subdivision. */
+char *cacheOut = NULL; /* if set, save sea-level cache to this file */
+char *cacheIn = NULL;  /* if set, recolour from this sea-level cache */
+double *hcache = NULL; /* per point: altitude - M, x, y, z, rain shadow, shade */
+#define HCACHE 6       /* doubles per point in hcache */
+#define NOPOINT 1.0e30 /* hcache altitude of points planet0() never saw */
+
+/* With -F, the planet is evaluated once on the six faces of a cube, */
+/* and maps are resampled from that. As heights are relative to M, */
+/* only views (-l, -L, -m, -p, -w, -h), M and colouring can change. */
+float *cube = NULL;     /* cube map: altitude - M, rain shadow, shade */
+#define CUBE 3          /* floats per texel in cube */
+int cubeN = 0;          /* texels along an edge of a face */
+double cubeError = 0.0; /* if > 0, size of a texel in map pixels */
+char *cubeFile = NULL;  /* if set, cube map is read from or saved here */
+int frames = 0;         /* if > 0, number of frames of a spinning planet */
+
+/* With -W s, the map is rendered in passes that evaluate every s'th */
+/* pixel of every s'th row, then every s/2'th and so on, and after each */
+/* pass the output file is rewritten with a preview. Each pass only */
+/* evaluates pixels that earlier passes have not. */
+int firstStride = 0; /* s, if > 1 */
+int passStride = 0;  /* stride of current pass, 0 if not progressive */
+
+/* With -u n d, no map is made. Instead, seeds s, s+d, ..., s+(n-1)d */
+/* are screened: each planet is evaluated at SCREENPOINTS points spread */
+/* evenly over the sphere, at the Depth of a map of that many pixels, */
+/* and the seeds are listed by how close their land fraction is to */
+/* landTarget (-q). The -N workers share the seeds. */
+int screenSeeds = 0;        /* n */
+double screenStep = 0.001;  /* d */
+double landTarget = 0.3;
+#define SCREENPOINTS 4096
+#define HYPSO 10            /* altitude bins of 0.02 from -0.1 to 0.1 */
+#define NBIOMES 11
+char biomeLetters[NBIOMES+1] = "TGBDSFRWEOI";
+
+typedef struct screening {
+  double seed, land;       /* seed and fraction of land */
+  double mean, spread;     /* mean and standard deviation of altitude */
+  double tMin, tMax;       /* as tempMin and tempMax */
+  int hypso[HYPSO];        /* points in each altitude bin */
+  int biome[NBIOMES];      /* land points of each biome */
+} screening;
+
+/* A recorded traversal keeps, for each point, which edges its descent */
+/* cut. Seeds and cut positions do not depend on altitudes, so replaying */
+/* the cuts from the recorded tetrahedron with new dd1, dd2, POW, POWA */
+/* (or M) gives the same result as a new descent without any of the */
+/* point-in-tetrahedron tests. */
+typedef struct Step
+{
+  unsigned char a, b;  /* vertex numbers of the cut edge */
+} step;
+
+#define TMAXV 256 /* max vertices (4 + Depth) per recorded point */
+
+typedef struct Trace
+{
+  long first;            /* first step in tsteps */
+  int n;                 /* number of steps */
+  unsigned char last[4]; /* vertex numbers of final tetrahedron */
+  int i, j;              /* pixel */
+  double x,y,z;          /* point */
+} trace;
+
+char *traceOut = NULL; /* if set, record traversals to this file */
+char *traceIn = NULL;  /* if set, replay traversals from this file */
+THREADLOCAL int tracing = 0; /* if 1, planet() records steps */
+trace *traces;         /* recorded points */
+step *tsteps;          /* recorded steps */
+long ntraces, maxtraces, ntsteps, maxtsteps;
+
 typedef struct Vertex
 {
   double h; /* altitude */
   double s; /* seed */
   double x,y,z; /* coordinates */
   double shadow; /* approximate rain shadow */
+  int id; /* vertex number in a recorded traversal */
 } vertex;
 
 /* distance squared between vertices */
@@ -261,40 +465,30 @@ double fmax(x,y)
 double x,y;
 { return(x<y ? y : x); }
 
+#ifndef PLANET_LIBRARY /* compile with -DPLANET_LIBRARY to leave out main() */
 int main(ac,av)
 int ac;
 char **av;
 {
-  void printppm(), printppmBW(), printbmp(), printbmpBW(),
-       printxpm(), printxpmBW(), printheights(), print_error();
+  void printhead(), printtail(), printheights(), print_error();
+  void startwriter(), stopwriter(), maketiles(), makeframes(), supersample();
+  void render(), makecube(), progressive(), printfile();
+  void seedtetra(), screenseeds(), setview(), finishmap();
+  STAT(void writestats();)
   void mercator(), peter(), squarep(), mollweide(), sinusoid(), stereo(),
     orthographic(), gnomonic(), icosahedral(), azimuth(), conical();
   int i;
   double rand2(), log_2(), planet1();
   void readcolors();
   void readmap(), makeoutline(), smoothshades();
+  void readcache(), writecache(), recolour();
+  void drawgrid(), printpicture(), printchannels();
+  void *rasterarray();
+  void readtrace(), writetrace(), replaytrace();
   FILE *outfile, *colfile = NULL;
   char filename[256] = "planet-map";
   char colorsname[256] = "Olsson.col";
   int do_file = 0, tmp = 0;
-  double tx, ty, tz;
-
-  /* initialize vertices to slightly irregular tetrahedron */
-  tetra[0].x = -sqrt(3.0)-0.20;
-  tetra[0].y = -sqrt(3.0)-0.22;
-  tetra[0].z = -sqrt(3.0)-0.23;
-
-  tetra[1].x = -sqrt(3.0)-0.19;
-  tetra[1].y = sqrt(3.0)+0.18;
-  tetra[1].z = sqrt(3.0)+0.17;
-
-  tetra[2].x = sqrt(3.0)+0.21;
-  tetra[2].y = -sqrt(3.0)-0.24;
-  tetra[2].z = sqrt(3.0)+0.15;
-
-  tetra[3].x = sqrt(3.0)+0.24;
-  tetra[3].y = sqrt(3.0)+0.22;
-  tetra[3].z = -sqrt(3.0)-0.25;
 
 
 #ifdef macintosh
@@ -392,6 +586,13 @@ char **av;
         case 'P' : file_type = ppm;
                    break;
         case 'H' : file_type = heightfield;
+                   if (strcmp(av[i],"-H16") == 0) height_format = hint16;
+                   else if (strcmp(av[i],"-H32") == 0) height_format = hint32;
+                   else if (strcmp(av[i],"-Hf") == 0) height_format = hfloat32;
+                   else if (strlen(av[i])>2) {
+                     fprintf(stderr,"Unknown heightfield format: %s\n",av[i]);
+                     exit(1);
+                   }
                    break;
         case 'M' : matchMap = 1;
                    sscanf(av[++i],"%lf",&matchSize);
@@ -402,6 +603,14 @@ char **av;
                    break;
         case 'i' : sscanf(av[++i],"%lf",&M);
                    break;
+        case 'K' : cacheOut = av[++i];
+                   break;
+        case 'k' : cacheIn = av[++i];
+                   break;
+        case 'Y' : traceOut = av[++i];
+                   break;
+        case 'y' : traceIn = av[++i];
+                   break;
         case 'T' : sscanf(av[++i]," %lf",&rotate2);
                    sscanf(av[++i]," %lf",&rotate1);
                    while (rotate1<-180) rotate1 += 360;
@@ -412,6 +621,40 @@ char **av;
         case 't' : temperature = 1; break;
         case 'r' : rainfall = 1; break;
         case 'z' : makeBiomes = 1; break;
+        case 'Z' : allChannels = 1; break;
+        case 'Q' : streaming = 1; break;
+        case 'R' : tileDir = av[++i]; break;
+        case 'U' : sscanf(av[++i],"%d",&tileSize);
+                   if (tileSize < 16) tileSize = 16;
+                   break;
+        case 'J' : sscanf(av[++i],"%d",&tileZ0);
+                   sscanf(av[++i],"%d",&tileZ1);
+                   break;
+        case 'j' : sscanf(av[++i],"%d",&tileZ0);
+                   sscanf(av[++i],"%d",&tileX);
+                   sscanf(av[++i],"%d",&tileY);
+                   tileZ1 = tileZ0;
+                   break;
+        case 'F' : sscanf(av[++i],"%lf",&cubeError);
+                   break;
+        case 'f' : cubeFile = av[++i];
+                   break;
+        case 'I' : sscanf(av[++i],"%d",&frames);
+                   break;
+        case 'e' : sscanf(av[++i],"%d",&superSamples);
+                   break;
+        case 'D' : adaptDepth = 1;
+                   break;
+        case 'W' : sscanf(av[++i],"%d",&firstStride);
+                   break;
+        case 'u' : sscanf(av[++i],"%d",&screenSeeds);
+                   sscanf(av[++i],"%lf",&screenStep);
+                   break;
+        case 'q' : sscanf(av[++i],"%lf",&landTarget);
+                   break;
+        case 'N' : sscanf(av[++i],"%d",&workers);
+                   if (workers < 1) workers = 1;
+                   break;
         case 'p' : if (strlen(av[i])>2) view = av[i][2];
                    else view = av[++i][0];
                    switch (view) {
@@ -445,9 +688,109 @@ char **av;
     }
   }
 
+  if (allChannels) {
+    if (file_type == heightfield) {
+      fprintf(stderr,"-Z makes images, not heightfields\n");
+      exit(1);
+    }
+    temperature = rainfall = makeBiomes = 0;
+    if (doshade == 0) doshade = 1; /* shade map uses bump map */
+  }
+  doRainShadow = rainfall || makeBiomes || allChannels;
+  if (cacheIn != NULL && doRainShadow) {
+    /* rain shadow depends on which subdivision vertices were above the */
+    /* sea, which the cache does not keep */
+    fprintf(stderr,"-k can not be used with -r, -z and -Z\n");
+    exit(1);
+  }
+
+  if (streaming && (allChannels || file_type == heightfield
+                    || cacheOut != NULL || cacheIn != NULL
+                    || traceOut != NULL || traceIn != NULL)) {
+    /* these need the whole map */
+    fprintf(stderr,"-Q ignored with -Z, -H, -K, -k, -Y and -y\n");
+    streaming = 0;
+  }
+  if (superSamples > 1) {
+    if (allChannels || tileDir != NULL || file_type == heightfield
+        || file_type == xpm || do_bw || cacheOut != NULL || cacheIn != NULL
+        || traceOut != NULL || traceIn != NULL) {
+      fprintf(stderr,"-e needs a BMP or PPM colour map and can not be used "
+              "with -Z, -R, -K, -k, -Y and -y\n");
+      exit(1);
+    }
+    streaming = 0; /* subsamples are placed from neighbouring pixels */
+  }
+  if (screenSeeds > 0) {
+    if (tileDir != NULL || frames > 0 || firstStride > 1
+        || cubeError > 0.0 || cubeFile != NULL
+        || cacheOut != NULL || cacheIn != NULL
+        || traceOut != NULL || traceIn != NULL) {
+      fprintf(stderr,"-u can not be used with -R, -I, -W, -F, -f, "
+              "-K, -k, -Y and -y\n");
+      exit(1);
+    }
+    streaming = 0;
+    doRainShadow = 1; /* for biomes */
+  }
+  if (firstStride > 1) {
+    if (allChannels || tileDir != NULL || frames > 0 || !do_file
+        || cacheOut != NULL || cacheIn != NULL
+        || traceOut != NULL || traceIn != NULL) {
+      fprintf(stderr,"-W needs -o and can not be used with -Z, -R, -I, "
+              "-K, -k, -Y and -y\n");
+      exit(1);
+    }
+    streaming = 0;
+  }
+  if ((cubeError > 0.0 || cubeFile != NULL)
+      && (tileDir != NULL || cacheOut != NULL || cacheIn != NULL
+          || traceOut != NULL || traceIn != NULL)) {
+    fprintf(stderr,"-F and -f can not be used with -R, -K, -k, -Y and -y\n");
+    exit(1);
+  }
+  if (frames > 0) {
+    if (allChannels || tileDir != NULL || cacheOut != NULL || cacheIn != NULL
+        || traceOut != NULL || traceIn != NULL) {
+      fprintf(stderr,"-I can not be used with -Z, -R, -K, -k, -Y and -y\n");
+      exit(1);
+    }
+    streaming = 0;
+  }
+
+  if (tileDir != NULL) {
+    if (allChannels || cacheOut != NULL || cacheIn != NULL
+        || traceOut != NULL || traceIn != NULL) {
+      fprintf(stderr,"-R can not be used with -Z, -K, -k, -Y and -y\n");
+      exit(1);
+    }
+    if (tileZ0 < 0 || tileZ1 < tileZ0 || tileZ1 > 20) {
+      fprintf(stderr,"Tile zoom levels must be 0 <= z0 <= z1 <= 20\n");
+      exit(1);
+    }
+    if (tileX >= 0 && (tileX >= 2<<tileZ0 || tileY < 0 || tileY >= 1<<tileZ0)) {
+      fprintf(stderr,"No tile %d/%d/%d\n",tileZ0,tileX,tileY);
+      exit(1);
+    }
+    view = 'q'; /* tiles are square projection at scale 1 */
+    scale = 1.0;
+    lat = longi = 0.0;
+    streaming = 0;
+    Width = Height = tileSize;
+  }
+  if (streaming) rowmask = RINGROWS-1;
+
   readcolors(colfile, colorsname);
 
-  if (do_file &&'\0' != filename[0]) {
+  if (cacheIn != NULL) readcache(cacheIn); /* sets Width and Height */
+  if (traceIn != NULL) readtrace(traceIn); /* sets Width and Height */
+  tracing = (traceOut != NULL && traceIn == NULL);
+
+  mapWidth = Width; mapHeight = Height;
+
+  if (allChannels || tileDir != NULL || frames > 0 || firstStride > 1)
+    ; /* files are made later */
+  else if (do_file &&'\0' != filename[0]) {
     if (strchr (filename, '.') == 0)
       strcpy(&(filename[strlen(filename)]), file_ext(file_type));
 
@@ -491,6 +834,119 @@ char **av;
 #endif
   }
 
+  setview();
+
+  if (matchMap) readmap();
+
+  if (file_type == heightfield && height_format == hfloat32)
+    fheights = rasterarray(sizeof(float), "heights");
+  else if (file_type == heightfield)
+    heights = rasterarray(sizeof(int), "heights");
+
+  col = rasterarray(sizeof(colno), "cols");
+  if (doshade>0) shades = rasterarray(sizeof(unsigned short), "shades");
+  if (allChannels) {
+    colT = rasterarray(sizeof(colno), "temperatures");
+    colR = rasterarray(sizeof(colno), "rainfalls");
+    colB = rasterarray(sizeof(colno), "biomes");
+  }
+
+  if (cacheOut != NULL && cacheIn == NULL) {
+    hcache = (double*)malloc((size_t)Width*Height*HCACHE*sizeof(double));
+    if (hcache == 0) {
+      fprintf(stderr, "Memory allocation failed hcache.");
+      exit(1);
+    }
+    for (i=0; i<Width*Height; i++) hcache[i*HCACHE] = NOPOINT;
+  }
+
+  /* grid arrays are only needed for the grid and for supersampling */
+  if (vgrid != 0.0 || superSamples > 1) {
+    xxx = rasterarray(sizeof(double), "xxx");
+    zzz = rasterarray(sizeof(double), "zzz");
+  }
+  if (hgrid != 0.0 || vgrid != 0.0 || superSamples > 1)
+    yyy = rasterarray(sizeof(double), "yyy");
+  if (superSamples > 1) blend = rasterarray(sizeof(unsigned int), "blend");
+
+  seedtetra();
+
+  if (screenSeeds > 0) {
+    screenseeds(outfile);
+    return(0);
+  }
+
+  if (debug && (view != 'f'))
+    fprintf(stderr, "+----+----+----+----+----+\n");
+
+  if (cubeError > 0.0 || cubeFile != NULL) makecube();
+
+  if (tileDir != NULL) {
+    maketiles();
+    STAT(writestats();)
+    return(0);
+  }
+  if (frames > 0) {
+    makeframes(filename);
+    STAT(writestats();)
+    return(0);
+  }
+
+  if (streaming) { /* rows are written while they are rendered */
+    printhead(outfile);
+    startwriter(outfile);
+  }
+
+  if (firstStride > 1) progressive(filename);
+  else render();
+
+  if (cacheOut != NULL) writecache(cacheOut);
+  if (tracing) writetrace(traceOut);
+
+  if (allChannels) printchannels(filename);
+  else if (streaming) {
+    stopwriter();
+    if (debug)
+      fprintf(stderr, "\n");
+    printtail(outfile);
+  }
+  else {
+    finishmap();
+
+    if (debug)
+      fprintf(stderr, "\n");
+
+    if (firstStride > 1) printfile(filename);
+    else printpicture(outfile);
+  }
+  STAT(writestats();)
+
+  return(0);
+}
+#endif
+
+void setview() /* sets up the tetrahedron, view and Depth from */
+{              /* longi, lat, rotate1 and rotate2 in degrees */
+  int i;
+  double tx, ty, tz, log_2();
+
+  /* initialize vertices to slightly irregular tetrahedron */
+  tetra[0].x = -sqrt(3.0)-0.20;
+  tetra[0].y = -sqrt(3.0)-0.22;
+  tetra[0].z = -sqrt(3.0)-0.23;
+
+  tetra[1].x = -sqrt(3.0)-0.19;
+  tetra[1].y = sqrt(3.0)+0.18;
+  tetra[1].z = sqrt(3.0)+0.17;
+
+  tetra[2].x = sqrt(3.0)+0.21;
+  tetra[2].y = -sqrt(3.0)-0.24;
+  tetra[2].z = sqrt(3.0)+0.15;
+
+  tetra[3].x = sqrt(3.0)+0.24;
+  tetra[3].y = sqrt(3.0)+0.22;
+  tetra[3].z = -sqrt(3.0)-0.25;
+
   longi = longi*DEG2RAD;
   lat = lat*DEG2RAD;
 
@@ -521,106 +977,6 @@ char **av;
     tetra[i].z = sR1*ty + cR1*tz;
     }
 
-  if (matchMap) readmap();
-
-  if (file_type == heightfield) {
-    heights = (int**)calloc(Width,sizeof(int*));
-    if (heights == 0) {
-      fprintf(stderr, "Memory allocation failed.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      heights[i] = (int*)calloc(Height,sizeof(int));
-      if (heights[i] == 0) {
-        fprintf(stderr,
-                "Memory allocation failed at %d out of %d heights\n",
-                i+1,Width);
-        exit(1);
-      }
-    }
-  }
-
-  col = (unsigned short**)calloc(Width,sizeof(unsigned short*));
-  if (col == 0) {
-    fprintf(stderr, "Memory allocation failed.");
-    exit(1);
-  }
-  for (i=0; i<Width; i++) {
-    col[i] = (unsigned short*)calloc(Height,sizeof(unsigned short));
-    if (col[i] == 0) {
-      fprintf(stderr,
-              "Memory allocation failed at %d out of %d cols\n",
-              i+1,Width);
-      exit(1);
-    }
-  }
-
-  if (doshade>0) {
-    shades = (unsigned short**)calloc(Width,sizeof(unsigned short*));
-    if (shades == 0) {
-      fprintf(stderr, "Memory allocation failed.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      shades[i] = (unsigned short*)calloc(Height,sizeof(unsigned short));
-      if (shades[i] == 0) {
-        fprintf(stderr,
-                "Memory allocation failed at %d out of %d shades\n",
-                i,Width);
-        exit(1);
-      }
-    }
-  }
-
-  if (vgrid != 0.0) {
-    xxx = (double**)calloc(Width,sizeof(double*));
-    if (xxx == 0) {
-      fprintf(stderr, "Memory allocation failed xxx.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      xxx[i] = (double*)calloc(Height,sizeof(double));
-      if (xxx[i] == 0) {
-        fprintf(stderr,
-                "Memory allocation failed at %d out of %d xxx\n",
-                i+1,Width);
-        exit(1);
-      }
-    }
-
-    zzz = (double**)calloc(Width,sizeof(double*));
-    if (zzz == 0) {
-      fprintf(stderr, "Memory allocation failed zzz.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      zzz[i] = (double*)calloc(Height,sizeof(double));
-      if (zzz[i] == 0) {
-        fprintf(stderr,
-                "Memory allocation failed at %d out of %d zzz\n",
-                i+1,Width);
-        exit(1);
-      }
-    }
-  }
-
-  if (hgrid != 0.0 || vgrid != 0.0) {
-    yyy = (double**)calloc(Width,sizeof(double*));
-    if (yyy == 0) {
-      fprintf(stderr, "Memory allocation failed yyy.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      yyy[i] = (double*)calloc(Height,sizeof(double));
-      if (yyy[i] == 0) {
-        fprintf(stderr,
-                "Memory allocation failed at %d out of %d yyy\n",
-                i+1,Width);
-        exit(1);
-      }
-    }
-  }
-
   if (view == 'c') {
     if (lat == 0) view = 'm';
         /* Conical approaches mercator when lat -> 0 */
@@ -629,33 +985,17 @@ char **av;
   }
 
   Depth = 3*((int)(log_2(scale*Height)))+6;
+}
 
-  r1 = rseed;
-
-  r1 = rand2(r1,r1);
-  r2 = rand2(r1,r1);
-  r3 = rand2(r1,r2);
-  r4 = rand2(r2,r3);
-
-  tetra[0].s = r1;
-  tetra[1].s = r2;
-  tetra[2].s = r3;
-  tetra[3].s = r4;
-
-  tetra[0].h = M;
-  tetra[1].h = M;
-  tetra[2].h = M;
-  tetra[3].h = M;
-
-  tetra[0].shadow = 0.0;
-  tetra[1].shadow = 0.0;
-  tetra[2].shadow = 0.0;
-  tetra[3].shadow = 0.0;
-
-  if (debug && (view != 'f'))
-    fprintf(stderr, "+----+----+----+----+----+\n");
+void render() /* renders the map in the chosen projection */
+{
+  void mercator(), peter(), squarep(), mollweide(), sinusoid(), stereo(),
+    orthographic(), gnomonic(), icosahedral(), azimuth(), conical();
+  void replaytrace(), recolour();
 
-  switch (view) {
+  if (traceIn != NULL) replaytrace(); /* only heights can change */
+  else if (cacheIn != NULL) recolour(); /* only M and colouring can change */
+  else switch (view) {
 
     case 'm': /* Mercator projection */
       mercator();
@@ -705,82 +1045,567 @@ char **av;
       orthographic();
       break;
   }
+}
 
-  if (do_outline) makeoutline(do_bw);
+/* planet_defaults() and planet_render() are the map interface of */
+/* planet.h (the point queries follow planet1()). planet_render() sets */
+/* the globals main() sets from the command line, with the caller's */
+/* buffers as col, shades and the other maps, and then makes the map */
+/* with setview(), render() and finishmap() like main(). */
 
-  if (vgrid != 0.0) { /* draw longitudes */
-    int i,j;
-    for (i=0; i<Width-1; i++)
-      for (j=0; j<Height-1; j++) {
-        double t;
-        int g = 0;
-        if (fabs(yyy[i][j])==1.0) g=1;
-        else {
-          t = floor((atan2(xxx[i][j],zzz[i][j])*180/PI+360)/vgrid);
-          if (t != floor((atan2(xxx[i+1][j],zzz[i+1][j])*180/PI+360)/vgrid))
-            g=1;
-          if (t != floor((atan2(xxx[i][j+1],zzz[i][j+1])*180/PI+360)/vgrid))
-            g=1;
-        }
-        if (g) {
-          if (do_bw) col[i][j] = 0; else col[i][j] = GRID;
-          if (doshade>0) shades[i][j] = 255;
-        }
-      }
-  }
+void planet_defaults(planet_params *params)
+{
+  params->seed = 0.123;
+  params->projection = 'm';
+  params->width = 800;
+  params->height = 600;
+  params->longitude = params->latitude = 0.0;
+  params->scale = 1.0;
+  params->altitude = -.02;
+  params->altitudeWeight = 0.45;
+  params->distanceWeight = 0.035;
+  params->vgrid = params->hgrid = 0.0;
+  params->shading = 0;
+  params->shadeAngle = 150.0;
+  params->shadeAngle2 = 20.0;
+  params->latitudeColours = 0;
+  params->nonLinear = 0;
+  params->outline = 0;
+  params->contourLines = 0;
+  params->colouring = 0;
+  params->adaptiveDepth = 0;
+  params->supersamples = 0;
+  params->colours = NULL;
+}
 
-  if (hgrid != 0.0) { /* draw latitudes */
-    int i,j;
-    for (i=0; i<Width-1; i++)
-      for (j=0; j<Height-1; j++) {
-        double t;
-        int g = 0;
-        t = floor((asin(yyy[i][j])*180/PI+360)/hgrid);
-        if (t != floor((asin(yyy[i+1][j])*180/PI+360)/hgrid))
-          g=1;
-        if (t != floor((asin(yyy[i][j+1])*180/PI+360)/hgrid))
-          g=1;
-        if (g) {
-          if (do_bw) col[i][j] = 0; else col[i][j] = GRID;
-          if (doshade>0) shades[i][j] = 255;
-        }
-      }
+int setparams(params) /* sets the globals of the options in params */
+const planet_params *params;
+{
+  if (params->width < 1 || params->height < 1
+      || params->projection == '\0'
+      || strchr("mpqMSsogiac", params->projection) == NULL
+      || (params->colouring != 0 && strchr("trz", params->colouring) == NULL)
+      || params->shading < 0 || params->shading > 3
+      || params->outline < 0 || params->outline > 2)
+    return(PLANET_EPARAMS);
+
+  rseed = params->seed;
+  view = params->projection;
+  Width = mapWidth = params->width;
+  Height = mapHeight = params->height;
+  mapX0 = mapY0 = 0;
+  longi = params->longitude;
+  while (longi<-180) longi += 360;
+  while (longi>180) longi -= 360;
+  lat = params->latitude;
+  if (lat<-90) lat = -90;
+  if (lat>90) lat = 90;
+  scale = params->scale;
+  M = params->altitude;
+  dd1 = params->altitudeWeight;
+  dd2 = params->distanceWeight;
+  vgrid = params->vgrid;
+  hgrid = params->hgrid;
+  doshade = params->shading;
+  shade_angle = params->shadeAngle;
+  shade_angle2 = params->shadeAngle2;
+  latic = params->latitudeColours;
+  nonLinear = params->nonLinear;
+  do_outline = (params->outline > 0);
+  do_bw = (params->outline == 2);
+  contourLines = coastContourLines = 0;
+  if (params->contourLines < 0) coastContourLines = -params->contourLines;
+  else contourLines = params->contourLines;
+  temperature = (params->colouring == 't');
+  rainfall = (params->colouring == 'r');
+  makeBiomes = (params->colouring == 'z');
+  allChannels = 0;
+  doRainShadow = rainfall || makeBiomes;
+  adaptDepth = params->adaptiveDepth;
+  superSamples = params->supersamples;
+  file_type = ppm; /* formatrow() makes RGB rows */
+  streaming = 0;
+  rowmask = -1;
+  tempMin = rainMin = 1000.0;
+  tempMax = rainMax = -1000.0;
+
+  return(PLANET_OK);
+}
+
+int planet_render(const planet_params *params, planet_buffers *channels)
+{
+  FILE *colfile = NULL;
+  int j;
+  long formatrow();
+  void *rasterarray();
+  void freeraster(), readcolors(), defaultcolours(), clearmaps();
+  int setparams();
+  void setview(), seedtetra(), render(), finishmap(), finishchannels();
+
+  if (setparams(params) != PLANET_OK) return(PLANET_EPARAMS);
+  if (params->supersamples > 1
+      && (params->outline == 2 || channels->temperature != NULL
+          || channels->rainfall != NULL || channels->biome != NULL))
+    return(PLANET_EPARAMS); /* as -e with -O or -Z */
+
+  if (params->colours != NULL) {
+    if ((colfile = fopen(params->colours, "r")) == NULL)
+      return(PLANET_ECOLOURS);
   }
+#ifdef SMALLCOL
+  else return(PLANET_ECOLOURS); /* Olsson.col has more than 256 colours */
+#endif
 
-  if (doshade>0) smoothshades();
+  allChannels = (channels->temperature != NULL || channels->rainfall != NULL
+                 || channels->biome != NULL);
+  doRainShadow = rainfall || makeBiomes || allChannels;
+
+  if (colfile != NULL) readcolors(colfile, (char *)params->colours);
+  else defaultcolours();
+
+  /* caller's buffers, or arrays of our own for channels that are needed */
+  col = (channels->colour != NULL) ? channels->colour
+        : rasterarray(sizeof(colno), "cols");
+  shades = NULL;
+  if (doshade>0)
+    shades = (channels->shade != NULL) ? channels->shade
+             : rasterarray(sizeof(unsigned short), "shades");
+  altitudes = channels->altitude;
+  colT = colR = colB = NULL;
+  if (allChannels) {
+    colT = (channels->temperature != NULL) ? channels->temperature
+           : rasterarray(sizeof(colno), "temperatures");
+    colR = (channels->rainfall != NULL) ? channels->rainfall
+           : rasterarray(sizeof(colno), "rainfalls");
+    colB = (channels->biome != NULL) ? channels->biome
+           : rasterarray(sizeof(colno), "biomes");
+  }
+  xxx = yyy = zzz = NULL;
+  blend = NULL;
+  if (vgrid != 0.0 || superSamples > 1) {
+    xxx = rasterarray(sizeof(double), "xxx");
+    zzz = rasterarray(sizeof(double), "zzz");
+  }
+  if (hgrid != 0.0 || vgrid != 0.0 || superSamples > 1)
+    yyy = rasterarray(sizeof(double), "yyy");
+  if (superSamples > 1) blend = rasterarray(sizeof(unsigned int), "blend");
+  clearmaps();
+
+  setview();
+  seedtetra();
+  render();
+  if (allChannels) finishchannels();
+  else finishmap();
+
+  do_bw = 0; /* (colours are already black and white) */
+  if (channels->rgb != NULL)
+    for (j=0; j<Height; j++)
+      formatrow(&COL(0,j), (doshade>0) ? &SHADES(0,j) : NULL,
+                (blend != NULL) ? &BLEND(0,j) : NULL,
+                (char *)channels->rgb+(long)j*Width*3);
+
+  if (col != channels->colour) freeraster(col);
+  if (shades != NULL && shades != channels->shade) freeraster(shades);
+  if (colT != NULL && colT != channels->temperature) freeraster(colT);
+  if (colR != NULL && colR != channels->rainfall) freeraster(colR);
+  if (colB != NULL && colB != channels->biome) freeraster(colB);
+  if (xxx != NULL) freeraster(xxx);
+  if (yyy != NULL) freeraster(yyy);
+  if (zzz != NULL) freeraster(zzz);
+  if (blend != NULL) freeraster(blend);
+  col = colT = colR = colB = NULL;
+  shades = NULL;
+  altitudes = NULL;
+  xxx = yyy = zzz = NULL;
+  blend = NULL;
+  allChannels = 0;
+
+  return(PLANET_OK);
+}
 
-  if (debug)
-    fprintf(stderr, "\n");
+void *rasterarray(size, what) /* zeroed Width x ROWS array, */
+int size;                     /* aligned to a cache line */
+char *what;
+{
+  void *a;
+  size_t n = (size_t)Width*ROWS*size;
 
-  /* plot picture */
-  switch (file_type)
-  {
-    case ppm:
-      if (do_bw) printppmBW(outfile);
-      else printppm(outfile);
-      break;
-    case xpm:
-      if (do_bw) printxpmBW(outfile);
-      else printxpm(outfile);
-      break;
-    case bmp:
-      if (do_bw) printbmpBW(outfile);
-      else printbmp(outfile);
-      break;
-    case heightfield:
-      printheights(outfile);
-      break;
+#if defined(WIN32) || defined(_WIN32)
+  a = _aligned_malloc(n, 64);
+#else
+  if (posix_memalign(&a, 64, n) != 0) a = NULL;
+#endif
+  if (a == NULL) {
+    fprintf(stderr, "Memory allocation failed %s.\n", what);
+    exit(1);
   }
+  memset(a, 0, n);
+  return(a);
+}
 
-  return(0);
+void freeraster(a) /* frees an array made by rasterarray() */
+void *a;
+{
+#if defined(WIN32) || defined(_WIN32)
+  _aligned_free(a);
+#else
+  free(a);
+#endif
 }
 
-void readcolors(FILE *colfile, char* colorsname)
+int gridpoint(i,j) /* 1 if pixel (i,j) is on a latitude/longitude line */
+int i,j;
 {
-  int crow, cNum = 0, oldcNum, i;
+  double t;
 
-  if (NULL == (colfile = fopen(colorsname, "r")))
-    {
+  if (i >= Width-1 || j >= Height-1) return(0);
+
+  if (vgrid != 0.0) { /* longitudes */
+    if (fabs(YYY(i,j))==1.0) return(1);
+    t = floor((atan2(XXX(i,j),ZZZ(i,j))*180/PI+360)/vgrid);
+    if (t != floor((atan2(XXX(i+1,j),ZZZ(i+1,j))*180/PI+360)/vgrid))
+      return(1);
+    if (t != floor((atan2(XXX(i,j+1),ZZZ(i,j+1))*180/PI+360)/vgrid))
+      return(1);
+  }
+
+  if (hgrid != 0.0) { /* latitudes */
+    t = floor((asin(YYY(i,j))*180/PI+360)/hgrid);
+    if (t != floor((asin(YYY(i+1,j))*180/PI+360)/hgrid))
+      return(1);
+    if (t != floor((asin(YYY(i,j+1))*180/PI+360)/hgrid))
+      return(1);
+  }
+  return(0);
+}
+
+void drawgrid() /* draws latitude/longitude grid on col */
+{
+  int i,j;
+
+  if (vgrid == 0.0 && hgrid == 0.0) return;
+
+  for (j=0; j<Height-1; j++)
+    for (i=0; i<Width-1; i++)
+      if (gridpoint(i,j)) {
+        if (do_bw) COL(i,j) = 0; else COL(i,j) = GRID;
+        if (doshade>0) SHADES(i,j) = 255;
+      }
+}
+
+void printpicture(outfile) /* prints the whole map */
+FILE *outfile;
+{
+  int j, n;
+  void printhead(), printtail(), printheights();
+  void startwriter(), putrow(), stopwriter();
+
+  if (file_type == heightfield) {
+    printheights(outfile);
+    return;
+  }
+
+  printhead(outfile);
+  startwriter(outfile);
+  for (n=0; n<Height; n++) {
+    j = (file_type == bmp) ? Height-1-n : n; /* BMP is written bottom-up */
+    putrow(&COL(0,j), (doshade>0) ? &SHADES(0,j) : NULL,
+           (blend != NULL) ? &BLEND(0,j) : NULL);
+  }
+  stopwriter();
+  printtail(outfile);
+}
+
+void printfile(name) /* prints the map to file name */
+char *name;
+{
+  char tmp[310];
+  FILE *outfile;
+
+  /* write to a temporary name, so the file is always a whole picture */
+  sprintf(tmp, "%.300s.tmp", name);
+  outfile = fopen(tmp,"wb");
+  if (outfile == NULL) {
+    fprintf(stderr, "Could not open output file %s, error code = %d\n",
+            tmp, errno);
+    exit(1);
+  }
+  printpicture(outfile);
+  remove(name); /* (rename does not replace files on Windows) */
+  rename(tmp, name);
+}
+
+void preview(name) /* prints the map after a pass of -W, with pixels */
+char *name;        /* that are not evaluated yet copied from the pixel */
+{                  /* at the corner of their passStride square */
+  colno *c0 = col;
+  unsigned short *s0 = shades;
+  int *h0 = heights, i, j;
+  float *f0 = fheights;
+  long k, k0;
+  void makeoutline(), smoothshades(), printfile(), freeraster();
+  void *rasterarray();
+
+  col = rasterarray(sizeof(colno), "preview");
+  if (doshade>0) shades = rasterarray(sizeof(unsigned short), "preview");
+  if (h0 != NULL) heights = rasterarray(sizeof(int), "preview");
+  if (f0 != NULL) fheights = rasterarray(sizeof(float), "preview");
+  for (j=0; j<Height; j++)
+    for (i=0; i<Width; i++) {
+      k = PIXEL(i,j);
+      k0 = PIXEL(i-i%passStride, j-j%passStride);
+      col[k] = c0[k0];
+      if (doshade>0) shades[k] = s0[k0];
+      if (h0 != NULL) heights[k] = h0[k0];
+      if (f0 != NULL) fheights[k] = f0[k0];
+    }
+  if (do_outline) makeoutline(do_bw);
+  if (doshade>0) smoothshades();
+  printfile(name);
+  freeraster(col); col = c0;
+  if (doshade>0) { freeraster(shades); shades = s0; }
+  if (h0 != NULL) { freeraster(heights); heights = h0; }
+  if (f0 != NULL) { freeraster(fheights); fheights = f0; }
+}
+
+void progressive(name) /* renders with -W, writing previews to file name */
+char *name;
+{
+  void render(), preview();
+
+  for (passStride = firstStride; passStride > 1; passStride /= 2) {
+    render();
+    preview(name);
+    if (debug) fprintf(stderr, "\npass %d written\n", passStride);
+  }
+  passStride = 1;
+  render();
+  passStride = 0;
+}
+
+void printchannels(filename) /* writes the maps made in one pass by -Z */
+char *filename;
+{
+  colno *height = col, *maps[5];
+  char *names[5], name[300], *dot;
+  FILE *outfile;
+  int k, shading = doshade;
+  void finishchannels(), biomecolours();
+
+  maps[0] = height; names[0] = "-height";
+  maps[1] = height; names[1] = "-shade";
+  maps[2] = colT;   names[2] = "-temperature";
+  maps[3] = colR;   names[3] = "-rainfall";
+  maps[4] = colB;   names[4] = "-biome";
+
+  finishchannels();
+
+  strncpy(name, filename, 256);
+  name[256] = '\0';
+  dot = strrchr(name, '.');
+  if (dot != NULL && strchr(dot, '/') == NULL) *dot = '\0';
+  dot = name+strlen(name);
+
+  for (k=0; k<5; k++) {
+    sprintf(dot, "%s%s", names[k], file_ext(file_type));
+    outfile = fopen(name,"wb");
+    if (outfile == NULL) {
+      fprintf(stderr,
+              "Could not open output file %s, error code = %d\n",
+              name, errno);
+      exit(0);
+    }
+    if (k == 4) biomecolours();
+    col = maps[k];
+    doshade = (k == 1) ? shading : 0; /* only the shade map is shaded */
+    printpicture(outfile);
+  }
+  col = height;
+  doshade = shading;
+}
+
+void finishchannels() /* outlines, grids and smooths the maps of -Z */
+{
+  colno *height = col, *maps[4];
+  long i;
+  int k;
+  void makeoutline(), smoothshades();
+
+  maps[0] = height; maps[1] = colT; maps[2] = colR; maps[3] = colB;
+
+  for (i=0; i<Width*Height; i++) /* background is only drawn on col */
+    if (height[i] < LOWEST)
+      colT[i] = colR[i] = colB[i] = height[i];
+
+  for (k=0; k<4; k++) { /* outlines and grid on every map */
+    col = maps[k];
+    if (do_outline) makeoutline(do_bw);
+    drawgrid();
+  }
+  col = height;
+  if (doshade>0) smoothshades();
+}
+
+void finishmap() /* supersamples, outlines, grids and smooths the map */
+{
+  void supersample(), makeoutline(), smoothshades();
+
+  if (superSamples > 1) supersample();
+  if (do_outline) makeoutline(do_bw);
+  drawgrid();
+  if (doshade>0) smoothshades();
+}
+
+void clearmaps() /* clears the maps before another one is rendered */
+{
+  memset(col, 0, (size_t)Width*Height*sizeof(colno));
+  if (doshade>0) memset(shades, 0, (size_t)Width*Height*sizeof(unsigned short));
+  if (heights != NULL) memset(heights, 0, (size_t)Width*Height*sizeof(int));
+  if (fheights != NULL)
+    memset(fheights, 0, (size_t)Width*Height*sizeof(float));
+  if (altitudes != NULL)
+    memset(altitudes, 0, (size_t)Width*Height*sizeof(float));
+  if (colT != NULL) memset(colT, 0, (size_t)Width*Height*sizeof(colno));
+  if (colR != NULL) memset(colR, 0, (size_t)Width*Height*sizeof(colno));
+  if (colB != NULL) memset(colB, 0, (size_t)Width*Height*sizeof(colno));
+  if (xxx != NULL) memset(xxx, 0, (size_t)Width*Height*sizeof(double));
+  if (yyy != NULL) memset(yyy, 0, (size_t)Width*Height*sizeof(double));
+  if (zzz != NULL) memset(zzz, 0, (size_t)Width*Height*sizeof(double));
+  if (blend != NULL) memset(blend, 0, (size_t)Width*Height*sizeof(int));
+}
+
+void makeframes(filename) /* renders -I frames of a spinning planet */
+char *filename;
+{
+  char name[300], *dot;
+  FILE *outfile;
+  int f;
+  double longi0 = longi;
+  void render(), finishmap();
+
+  strncpy(name, filename, 256);
+  name[256] = '\0';
+  dot = strrchr(name, '.');
+  if (dot != NULL && strchr(dot, '/') == NULL) *dot = '\0';
+  dot = name+strlen(name);
+
+  for (f=0; f<frames; f++) {
+    longi = longi0+2.0*PI*f/frames;
+    if (longi>PI) longi -= 2.0*PI;
+    slo = sin(longi); clo = cos(longi);
+    if (f > 0) clearmaps();
+    render();
+    finishmap();
+
+    sprintf(dot, "-%04d%s", f, file_ext(file_type));
+    outfile = fopen(name,"wb");
+    if (outfile == NULL) {
+      fprintf(stderr,
+              "Could not open output file %s, error code = %d\n",
+              name, errno);
+      exit(0);
+    }
+    printpicture(outfile); /* (closes outfile) */
+    if (debug) fprintf(stderr, "\n%s\n", name);
+  }
+}
+
+void makedir(name) /* creates directory unless it exists */
+char *name;
+{
+#if defined(WIN32) || defined(_WIN32)
+  _mkdir(name);
+#else
+  mkdir(name, 0777);
+#endif
+}
+
+int rendertile(z, x, y) /* renders tile z/x/y unless it exists; */
+int z, x, y;            /* returns 1 if rendered */
+{
+  char name[300], tmp[310];
+  FILE *outfile;
+  void squarep(), makeoutline(), drawgrid(), smoothshades(), printpicture();
+  void clearmaps();
+
+  sprintf(name, "%s/%d/%d/%d%s", tileDir, z, x, y, file_ext(file_type));
+  if ((outfile = fopen(name,"rb")) != NULL) { /* already in the cache */
+    fclose(outfile);
+    return(0);
+  }
+  sprintf(name, "%s/%d", tileDir, z);
+  makedir(name);
+  sprintf(name, "%s/%d/%d", tileDir, z, x);
+  makedir(name);
+  sprintf(name, "%s/%d/%d/%d%s", tileDir, z, x, y, file_ext(file_type));
+
+  mapWidth = tileSize<<(z+1);
+  mapHeight = tileSize<<z;
+  mapX0 = x*tileSize;
+  mapY0 = y*tileSize;
+
+  clearmaps();
+  squarep();
+
+  if (do_outline) makeoutline(do_bw);
+  drawgrid();
+  if (doshade>0) smoothshades();
+
+  /* write to a temporary name, so a half-written tile is never cached */
+  sprintf(tmp, "%s.tmp", name);
+  outfile = fopen(tmp,"wb");
+  if (outfile == NULL) {
+    fprintf(stderr, "Could not open output file %s, error code = %d\n",
+            tmp, errno);
+    exit(1);
+  }
+  printpicture(outfile);
+  rename(tmp, name);
+  return(1);
+}
+
+void maketiles() /* renders the tiles asked for with -R, -J and -j */
+{
+  int z, x, y, w, made = 0, skipped = 0;
+  long t, n;
+
+  makedir(tileDir);
+
+#if !defined(WIN32) && !defined(_WIN32)
+  for (w=1; w<workers; w++) /* each process takes every workers'th tile */
+    if (fork() == 0) break;
+  if (w == workers) w = 0; /* the parent is worker 0 */
+#else
+  w = 0; workers = 1;
+#endif
+
+  n = 0;
+  for (z = tileZ0; z <= tileZ1; z++)
+    for (y = 0; y < 1<<z; y++)
+      for (x = 0; x < 2<<z; x++) {
+        if (tileX >= 0 && (x != tileX || y != tileY)) continue;
+        t = n++;
+        if (t % workers != w) continue;
+        if (rendertile(z, x, y)) made++; else skipped++;
+      }
+
+  if (debug)
+    fprintf(stderr, "\nworker %d: %d tiles rendered, %d already made\n",
+            w, made, skipped);
+
+#if !defined(WIN32) && !defined(_WIN32)
+  if (w != 0) exit(0);
+  while (wait(NULL) > 0) ; /* wait for the other workers */
+#endif
+}
+
+void readcolors(FILE *colfile, char* colorsname)
+{
+  int crow, cNum = 0, oldcNum;
+  void setcolour(), endcolours();
+
+  if (colfile == NULL && NULL == (colfile = fopen(colorsname, "r")))
+    {
       fprintf(stderr,
               "Cannot open %s\n",
               colorsname);
@@ -820,24 +1645,67 @@ void readcolors(FILE *colfile, char* colorsname)
       if (result > 0)
         {
           if (cNum < oldcNum) cNum = oldcNum;
-          if (cNum > 65535) cNum = 65535;
-          rtable[cNum] = rValue;
-          gtable[cNum] = gValue;
-          btable[cNum] = bValue;
-          /* interpolate colours between oldcNum and cNum */
-          for (i = oldcNum+1; i<cNum; i++) {
-            rtable[i] = (rtable[oldcNum]*(cNum-i)+rtable[cNum]*(i-oldcNum))
-                        / (cNum-oldcNum+1);
-            gtable[i] = (gtable[oldcNum]*(cNum-i)+gtable[cNum]*(i-oldcNum))
-                        / (cNum-oldcNum+1);
-            btable[i] = (btable[oldcNum]*(cNum-i)+btable[cNum]*(i-oldcNum))
-                        / (cNum-oldcNum+1);
+#ifdef SMALLCOL
+          if (cNum >= MAXCOLS) {
+            fprintf(stderr,
+                    "Colour number %d in %s is above %d (SMALLCOL)\n",
+                    cNum, colorsname, MAXCOLS-1);
+            exit(1);
           }
+#endif
+          if (cNum > 65535) cNum = 65535;
+          setcolour(cNum, rValue, gValue, bValue, oldcNum);
         }
     }
 
   fclose(colfile);
 
+  endcolours(cNum);
+}
+
+/* Olsson.col, for planet_render() without a colour file */
+int olssonColours[][4] = {
+  {0, 0, 0, 0}, {1, 255, 255, 255}, {2, 255, 255, 255}, {3, 0, 0, 0},
+  {4, 0, 0, 0}, {5, 0, 0, 0}, {6, 0, 0, 64}, {32770, 60, 110, 200},
+  {32771, 40, 140, 40}, {50000, 160, 140, 80}, {65535, 255, 255, 255}
+};
+
+void defaultcolours() /* sets the colour table to Olsson.col */
+{
+  int k, n = sizeof(olssonColours)/sizeof(olssonColours[0]);
+  void setcolour(), endcolours();
+
+  for (k=0; k<n; k++)
+    setcolour(olssonColours[k][0], olssonColours[k][1], olssonColours[k][2],
+              olssonColours[k][3], (k > 0) ? olssonColours[k-1][0] : 0);
+  endcolours(olssonColours[n-1][0]);
+}
+
+void setcolour(cNum, r, g, b, oldcNum) /* sets colour cNum and */
+int cNum, r, g, b, oldcNum;            /* those after oldcNum */
+{
+  int i;
+
+  rtable[cNum] = r;
+  gtable[cNum] = g;
+  btable[cNum] = b;
+  /* interpolate colours between oldcNum and cNum */
+  for (i = oldcNum+1; i<cNum; i++) {
+    rtable[i] = (rtable[oldcNum]*(cNum-i)+rtable[cNum]*(i-oldcNum))
+                / (cNum-oldcNum+1);
+    gtable[i] = (gtable[oldcNum]*(cNum-i)+gtable[cNum]*(i-oldcNum))
+                / (cNum-oldcNum+1);
+    btable[i] = (btable[oldcNum]*(cNum-i)+btable[cNum]*(i-oldcNum))
+                / (cNum-oldcNum+1);
+  }
+}
+
+void endcolours(cNum) /* sets colour numbers from the last colour cNum */
+int cNum;
+{
+  int i;
+  void biomecolours();
+
   nocols = cNum+1;
   if (nocols < 10) nocols = 10;
 
@@ -852,8 +1720,11 @@ void readcolors(FILE *colfile, char* colorsname)
     btable[i] = btable[cNum];
   }
 
-  if (makeBiomes) {
-  /* make biome colours */
+  if (makeBiomes) biomecolours();
+}
+
+void biomecolours() /* make biome colours */
+{
   rtable['T'-64+LAND] = 210;
   gtable['T'-64+LAND] = 210;
   btable['T'-64+LAND] = 210;
@@ -887,83 +1758,202 @@ void readcolors(FILE *colfile, char* colorsname)
   rtable['I'-64+LAND] = 255;
   gtable['I'-64+LAND] = 255;
   btable['I'-64+LAND] = 255;
-  }
 }
 
-void makeoutline(int do_bw)
+int outlinepoint(i,j) /* 1 if pixel (i,j) is on coast or contour line */
+int i,j;
 {
-  int i,j,k,t;
-
-  outx = (int*)calloc(Width*Height,sizeof(int));
-  outy = (int*)calloc(Width*Height,sizeof(int));
-  k=0;
-  for (i=1; i<Width-1; i++)
-    for (j=1; j<Height-1; j++)
-      if ((col[i][j] >= LOWEST && col[i][j] <= SEA) &&
-          (col[i-1][j] >= LAND || col[i+1][j] >= LAND ||
-           col[i][j-1] >= LAND || col[i][j+1] >= LAND ||
-           col[i-1][j-1] >= LAND || col[i-1][j+1] >= LAND ||
-           col[i+1][j-1] >= LAND || col[i+1][j+1] >= LAND)) {
-        /* if point is sea and any neighbour is not, add to outline */
-        outx[k] = i; outy[k++] = j;
-      }
+  int t, contourstep;
+  colno *u, *c, *d; /* rows j-1, j and j+1 */
 
-  int contourstep = 0;
+  if (i < 1 || i >= Width-1 || j < 1 || j >= Height-1) return(0);
+  u = &COL(0,j-1); c = &COL(0,j); d = &COL(0,j+1);
+
+  if ((c[i] >= LOWEST && c[i] <= SEA) &&
+      (c[i-1] >= LAND || c[i+1] >= LAND ||
+       u[i] >= LAND || d[i] >= LAND ||
+       u[i-1] >= LAND || d[i-1] >= LAND ||
+       u[i+1] >= LAND || d[i+1] >= LAND))
+    /* if point is sea and any neighbour is not, add to outline */
+    return(1);
 
   if (contourLines > 0) {
     contourstep = (HIGHEST-LAND)/(contourLines+1);
-    for (i=1; i<Width-1; i++)
-      for (j=1; j<Height-1; j++) {
-	t = (col[i][j] - LAND) / contourstep;
-	if (col[i][j] >= LAND &&
-	    ((col[i-1][j]-LAND) / contourstep > t ||
-	     (col[i+1][j]-LAND) / contourstep > t ||
-	     (col[i][j-1]-LAND) / contourstep > t ||
-	     (col[i][j+1]-LAND) / contourstep > t)) {
-	  /* if point is at contour line and any neighbour is higher */
-	  outx[k] = i; outy[k++] = j;
-	}
-      }
+    t = (c[i] - LAND) / contourstep;
+    if (c[i] >= LAND &&
+        ((c[i-1]-LAND) / contourstep > t ||
+         (c[i+1]-LAND) / contourstep > t ||
+         (u[i]-LAND) / contourstep > t ||
+         (d[i]-LAND) / contourstep > t))
+      /* if point is at contour line and any neighbour is higher */
+      return(1);
   }
   if (coastContourLines > 0) {
     contourstep = (LAND-LOWEST)/20;
-    for (i=1; i<Width-1; i++)
-      for (j=1; j<Height-1; j++) {
-	t = (col[i][j] - LAND) / contourstep;
-	if (col[i][j] <= SEA && t >= -coastContourLines &&
-	    ((col[i-1][j]-LAND) / contourstep > t ||
-	     (col[i+1][j]-LAND) / contourstep > t ||
-	     (col[i][j-1]-LAND) / contourstep > t ||
-	     (col[i][j+1]-LAND) / contourstep > t)) {
-	  /* if point is at contour line and any neighbour is higher */
-	  outx[k] = i; outy[k++] = j;
-	}
-      }
+    t = (c[i] - LAND) / contourstep;
+    if (c[i] <= SEA && t >= -coastContourLines &&
+        ((c[i-1]-LAND) / contourstep > t ||
+         (c[i+1]-LAND) / contourstep > t ||
+         (u[i]-LAND) / contourstep > t ||
+         (d[i]-LAND) / contourstep > t))
+      /* if point is at contour line and any neighbour is higher */
+      return(1);
+  }
+  return(0);
+}
+
+int outlinecolour(t) /* colour of outline point of colour t */
+int t;
+{
+  int contourstep;
+
+  if (do_bw) return(BLACK);
+  contourstep = (HIGHEST-LAND)/(contourLines+1);
+  if (t != OUTLINE1 && t != OUTLINE2) {
+    if (contourLines > 0 && t >= LAND)
+      if (((t-LAND)/contourstep)%2 == 1)
+        t = OUTLINE1;
+      else t = OUTLINE2;
+    else if (t <= SEA)
+      t = OUTLINE1;
+  }
+  return(t);
+}
+
+void makeoutline(int do_bw)
+{
+  int i,j;
+  long k, n, *out; /* outline points, found before any are drawn */
+
+  out = (long*)malloc((size_t)Width*Height*sizeof(long));
+  if (out == 0) {
+    fprintf(stderr, "Memory allocation failed outline.");
+    exit(1);
   }
+  n=0;
+  for (j=1; j<Height-1; j++)
+    for (i=1; i<Width-1; i++)
+      if (outlinepoint(i,j)) out[n++] = PIXEL(i,j);
+
   if (do_bw) /* if outline only, clear colours */
-    for (i=0; i<Width; i++)
-      for (j=0; j<Height; j++) {
-        if (col[i][j] >= LOWEST)
-          col[i][j] = WHITE;
-        else col[i][j] = BLACK;
-      }
+    for (k=0; k<(long)Width*Height; k++)
+      col[k] = (col[k] >= LOWEST) ? WHITE : BLACK;
   /* draw outline (in black if outline only) */
-  contourstep = (HIGHEST-LAND)/(contourLines+1);
-  for (j = 0; j < k; j++) {
-    if (do_bw) t = BLACK;
-    else {
-      t = col[outx[j]][outy[j]];
-      if (t != OUTLINE1 && t != OUTLINE2) {
-	if (contourLines > 0 && t >= LAND)
-	  if (((t-LAND)/contourstep)%2 == 1)
-	    t = OUTLINE1;
-	  else t = OUTLINE2;
-	else if (t <= SEA)
-	  t = OUTLINE1;
-      }
-    }
-    col[outx[j]][outy[j]] = t;
+  for (k=0; k<n; k++)
+    col[out[k]] = outlinecolour(col[out[k]]);
+  free(out);
+}
+
+int pixelstep(i,j, di,dj, g) /* sets g to change of (x,y,z) per pixel */
+int i,j, di,dj; /* from pixel (i,j) towards (i+di,j+dj); 0 if none */
+double g[3];
+{
+  int k, n = 0;
+  double d[2][3], l[2];
+
+  /* one-sided differences to the pixels on either side */
+  for (k=0; k<2; k++, di = -di, dj = -dj) {
+    l[k] = -1.0;
+    if (i+di < 0 || i+di >= Width || j+dj < 0 || j+dj >= Height
+        || COL(i+di,j+dj) < LOWEST) continue;
+    d[k][0] = (XXX(i+di,j+dj)-XXX(i,j))*(1-2*k);
+    d[k][1] = (YYY(i+di,j+dj)-YYY(i,j))*(1-2*k);
+    d[k][2] = (ZZZ(i+di,j+dj)-ZZZ(i,j))*(1-2*k);
+    l[k] = d[k][0]*d[k][0]+d[k][1]*d[k][1]+d[k][2]*d[k][2];
+    n++;
+  }
+  if (n == 0) return(0);
+  /* across a seam of the projection (or with a neighbour off the map) */
+  /* only the shorter difference is used, otherwise the average */
+  if (l[1] < 0.0 || (l[0] >= 0.0 && l[0]*4.0 < l[1])) k = 0;
+  else if (l[0] < 0.0 || l[1]*4.0 < l[0]) k = 1;
+  else {
+    for (k=0; k<3; k++) g[k] = 0.5*(d[0][k]+d[1][k]);
+    return(1);
+  }
+  for (n=0; n<3; n++) g[n] = d[k][n];
+  return(1);
+}
+
+void supersample() /* blends n x n subsamples at coasts and contours */
+{
+  int i, j, a, b, k, c, v, s, rgb[3], n = superSamples;
+  int di, dj, outlinepoint();
+  long pixels = 0;
+  char *edge;
+  double x, y, z, l, u, w, gi[3], gj[3], alt;
+  double planet1(), cubepoint(), log_2();
+  void colourpoint();
+  colno c0;
+  unsigned short s0 = 0;
+
+  /* pixels on a coast or contour line, and their neighbours */
+  edge = (char*)calloc((size_t)Width*Height, sizeof(char));
+  if (edge == 0) {
+    fprintf(stderr, "Memory allocation failed edge.");
+    exit(1);
   }
+  for (j=1; j<Height-1; j++)
+    for (i=1; i<Width-1; i++)
+      if (outlinepoint(i,j))
+        for (dj=-1; dj<=1; dj++)
+          for (di=-1; di<=1; di++)
+            edge[PIXEL(i+di,j+dj)] = 1;
+
+  /* subsamples are as detailed as pixels of the map */
+  Depth = 3*((int)(log_2(scale*Height)))+6;
+
+  for (j=0; j<Height; j++)
+    for (i=0; i<Width; i++) {
+      if (!edge[PIXEL(i,j)] || COL(i,j) < LOWEST
+          || !pixelstep(i,j, 1,0, gi) || !pixelstep(i,j, 0,1, gj))
+        continue;
+      c0 = COL(i,j);
+      if (doshade>0) s0 = SHADES(i,j);
+      x = XXX(i,j); y = YYY(i,j); z = ZZZ(i,j);
+      rgb[0] = rgb[1] = rgb[2] = 0;
+      for (b=0; b<n; b++)
+        for (a=0; a<n; a++) {
+          if (n%2 == 1 && a == n/2 && b == n/2) {
+            c = c0; s = s0; /* the pixel's own sample */
+          } else {
+            /* subsample at offset (u,w) from the pixel centre */
+            u = (a+0.5)/n-0.5;
+            w = (b+0.5)/n-0.5;
+            XXX(i,j) = x+u*gi[0]+w*gj[0];
+            YYY(i,j) = y+u*gi[1]+w*gj[1];
+            ZZZ(i,j) = z+u*gi[2]+w*gj[2];
+            l = sqrt(XXX(i,j)*XXX(i,j)+YYY(i,j)*YYY(i,j)+ZZZ(i,j)*ZZZ(i,j));
+            XXX(i,j) /= l; YYY(i,j) /= l; ZZZ(i,j) /= l;
+            if (cube != NULL) alt = cubepoint(XXX(i,j),YYY(i,j),ZZZ(i,j));
+            else alt = planet1(XXX(i,j),YYY(i,j),ZZZ(i,j));
+            colourpoint(alt+M, XXX(i,j),YYY(i,j),ZZZ(i,j), i,j);
+            c = COL(i,j);
+            s = (doshade>0) ? SHADES(i,j) : 0;
+          }
+          for (k=0; k<3; k++) {
+            v = (k==0) ? rtable[c] : (k==1) ? gtable[c] : btable[c];
+            if (doshade>0) {
+              v = s*v/150;
+              if (v>255) v = 255;
+            }
+            rgb[k] += v;
+          }
+        }
+      COL(i,j) = c0;
+      if (doshade>0) SHADES(i,j) = s0;
+      XXX(i,j) = x; YYY(i,j) = y; ZZZ(i,j) = z;
+      BLEND(i,j) = BLENDED + (((rgb[0]+n*n/2)/(n*n))<<16)
+                   + (((rgb[1]+n*n/2)/(n*n))<<8) + (rgb[2]+n*n/2)/(n*n);
+      pixels++;
+    }
+  free(edge);
+
+  k = n*n - n%2; /* new samples per pixel */
+  fprintf(stderr, "supersampling: %ld of %ld pixels, %ld samples"
+          " instead of %ld (%.1f%%)\n", pixels, (long)Width*Height,
+          (long)Width*Height+pixels*k, (long)Width*Height*n*n,
+          100.0*((double)Width*Height+pixels*k)/((double)Width*Height*n*n));
 }
 
 void readmap()  /* reads in a map for matching */
@@ -1015,23 +2005,177 @@ void smoothshades()
 {
   int i,j;
 
-  for (i=0; i<Width-2; i++)
-    for (j=0; j<Height-2; j++)
-      shades[i][j] = (4*shades[i][j]+2*shades[i][j+1]
-                      +2*shades[i+1][j]+shades[i+1][j+1]+4)/9;
+  /* each shade is smoothed with unsmoothed neighbours right and below */
+  for (j=0; j<Height-2; j++)
+    for (i=0; i<Width-2; i++)
+      SHADES(i,j) = (4*SHADES(i,j)+2*SHADES(i,j+1)
+                      +2*SHADES(i+1,j)+SHADES(i+1,j+1)+4)/9;
 }
 
-void mercator()
+int startrow(n) /* row number of the n'th row a projection renders */
+int n;
 {
-  double y,scale1,cos2,theta1, log_2();
-  int i,j,k;
+  int i,j;
+
+  if (!streaming) return(n);
+
+  j = (file_type == bmp) ? Height-1-n : n; /* BMP is written bottom-up */
+  for (i=0; i<Width; i++) { /* clear the ring row for reuse */
+    COL(i,j) = 0;
+    if (doshade>0) SHADES(i,j) = 0;
+    if (vgrid != 0.0) XXX(i,j) = ZZZ(i,j) = 0.0;
+    if (hgrid != 0.0 || vgrid != 0.0) YYY(i,j) = 0.0;
+  }
+  return(j);
+}
+
+void rowdone(j) /* writes the rows that are complete once row j is */
+int j;
+{
+  void finishrow();
+
+  if (!streaming) return;
+
+  /* outlines look one row up and down, the grid and smoothing one down */
+  if (file_type == bmp) {
+    if (j+1 < Height) finishrow(j+1);
+    if (j == 0) finishrow(0);
+  } else {
+    if (j >= 2) finishrow(j-2);
+    if (j == Height-1) {
+      if (j >= 1) finishrow(j-1);
+      finishrow(j);
+    }
+  }
+}
+
+void finishrow(j) /* does makeoutline(), drawgrid() and smoothshades() */
+int j;            /* for row j and writes it */
+{
+  int i, s00, s01, s10, s11, grid = (vgrid != 0.0 || hgrid != 0.0);
+  int outlinepoint(), outlinecolour(), gridpoint();
+  void putrow();
+
+  if (grid)
+    for (i=0; i<Width; i++) {
+      grid0[i] = gridpoint(i,j);
+      grid1[i] = gridpoint(i,j+1);
+    }
+
+  for (i=0; i<Width; i++) {
+    rowcol[i] = COL(i,j);
+    if (do_outline) {
+      if (outlinepoint(i,j)) rowcol[i] = outlinecolour(rowcol[i]);
+      else if (do_bw) rowcol[i] = (rowcol[i] >= LOWEST) ? WHITE : BLACK;
+    }
+    if (grid && grid0[i]) rowcol[i] = do_bw ? 0 : GRID;
+  }
+
+  if (doshade>0)
+    for (i=0; i<Width; i++) {
+      s00 = (grid && grid0[i]) ? 255 : SHADES(i,j);
+      if (i < Width-2 && j < Height-2) {
+        s01 = (grid && grid1[i]) ? 255 : SHADES(i,j+1);
+        s10 = (grid && grid0[i+1]) ? 255 : SHADES(i+1,j);
+        s11 = (grid && grid1[i+1]) ? 255 : SHADES(i+1,j+1);
+        rowshade[i] = (4*s00+2*s01+2*s10+s11+4)/9;
+      }
+      else rowshade[i] = s00;
+    }
+
+  putrow(rowcol, rowshade, NULL);
+}
+
+int pixeldepth(d, stretch) /* with -D, Depth for a pixel that is stretch */
+int d;                     /* times as wide (in radians of surface) as */
+double stretch;            /* the pixels d is meant for */
+{
+  double log_2();
+
+  /* three levels halve the size of the tetrahedra */
+  if (!adaptDepth || stretch < 2.0) return(d);
+  if (!(stretch < 1.0e6)) stretch = 1.0e6; /* (infinite at the limb) */
+  d -= 3*((int)(log_2(stretch)));
+  return((d < 0) ? 0 : d);
+}
+
+/* The cylindrical projections (mercator, peter, squarep and sinusoid) */
+/* make their points in two steps: what depends only on the column is */
+/* put in tables once, and each row is then a few multiplications per */
+/* pixel (simple loops that the compiler can vectorize) giving a batch */
+/* of unit vectors, which planetrow() evaluates. */
+double *colcos, *colsin; /* per column: cos and sin of longitude */
+double *bx, *by, *bz;    /* batch of points of a row */
+
+void startbatch() /* allocates column tables and batch */
+{
+  colcos = (double*)malloc(5*(size_t)Width*sizeof(double));
+  if (colcos == 0) {
+    fprintf(stderr, "Memory allocation failed batch.");
+    exit(1);
+  }
+  colsin = colcos+Width;
+  bx = colsin+Width; by = bx+Width; bz = by+Width;
+}
+
+void stopbatch()
+{
+  free(colcos);
+}
+
+void longitudes(x0, w) /* sets colcos and colsin for columns x0 to */
+int x0, w;             /* x0+Width-1 of a map w pixels wide */
+{
+  int i;
+  double theta1;
+
+  for (i = 0; i < Width ; i++) {
+    theta1 = longi-0.5*PI+PI*(2.0*(i+x0)-w)/w/scale;
+    colcos[i] = cos(theta1);
+    colsin[i] = sin(theta1);
+  }
+}
+
+void cylinderrow(y, cos2) /* batch of points at height y of a row */
+double y, cos2;           /* of radius cos2 with longitudes in tables */
+{
+  int i;
+
+  for (i = 0; i < Width ; i++) {
+    bx[i] = colcos[i]*cos2;
+    by[i] = y;
+    bz[i] = -colsin[i]*cos2;
+  }
+}
+
+void planetrow(j) /* evaluates the batch as row j */
+int j;            /* ((0,0,0) marks pixels that are off the map) */
+{
+  int i;
   void planet0();
 
+  for (i = 0; i < Width ; i++)
+    if (bx[i] != 0.0 || by[i] != 0.0 || bz[i] != 0.0)
+      planet0(bx[i],by[i],bz[i], i,j);
+}
+
+void mercator()
+{
+  double y,scale1,cos2, log_2();
+  int j,n,k;
+  void rowdone(), startbatch(), stopbatch(), longitudes();
+  void cylinderrow(), planetrow();
+  int startrow();
+
+  startbatch();
+  longitudes(0, Width);
+
   y = sin(lat);
   y = (1.0+y)/(1.0-y);
   y = 0.5*log(y);
   k = (int)(0.5*y*Width*scale/PI+0.5);
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     y = PI*(2.0*(j-k)-Height)/Width/scale;
@@ -1040,91 +2184,113 @@ void mercator()
     scale1 = scale*Width/Height/sqrt(1.0-y*y)/PI;
     cos2 = sqrt(1.0-y*y);
     Depth = 3*((int)(log_2(scale1*Height)))+3;
-    for (i = 0; i < Width ; i++) {
-      theta1 = longi-0.5*PI+PI*(2.0*i-Width)/Width/scale;
-      planet0(cos(theta1)*cos2,y,-sin(theta1)*cos2, i,j);
-    }
+    cylinderrow(y, cos2);
+    planetrow(j);
+    rowdone(j);
   }
+  stopbatch();
 }
 
 void peter()
 {
-  double y,cos2,theta1,scale1, log_2();
-  int k,i,j,water,land;
-  void planet0();
-
+  double y,cos2,scale1, log_2();
+  int k,i,j,n,water,land;
+  void rowdone(), startbatch(), stopbatch(), longitudes();
+  void cylinderrow(), planetrow();
+  int startrow(), pixeldepth();
+
+  startbatch();
+  longitudes(0, Width);
   y = 2.0*sin(lat);
   k = (int)(0.5*y*Width*scale/PI+0.5);
   water = land = 0;
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     y = 0.5*PI*(2.0*(j-k)-Height)/Width/scale;
     if (fabs(y)>1.0)
       for (i = 0; i < Width ; i++) {
-        col[i][j] = BACK;
-        if (doshade>0) shades[i][j] = 255;
+        COL(i,j) = BACK;
+        if (doshade>0) SHADES(i,j) = 255;
       }
     else {
       cos2 = sqrt(1.0-y*y);
       if (cos2>0.0) {
         scale1 = scale*Width/Height/cos2/PI;
         Depth = 3*((int)(log_2(scale1*Height)))+3;
-        for (i = 0; i < Width ; i++) {
-          theta1 = longi-0.5*PI+PI*(2.0*i-Width)/Width/scale;
-          planet0(cos(theta1)*cos2,y,-sin(theta1)*cos2, i,j);
-          if (col[i][j] < LAND) water++; else land++;
-        }
+        /* equal-area: pixels are 1/(sqrt(2)*cos2) times wider than */
+        /* across, for which Depth is chosen */
+        Depth = pixeldepth(Depth, 1.0/sqrt(2.0)/cos2);
+        cylinderrow(y, cos2);
+        planetrow(j);
+        for (i = 0; i < Width ; i++)
+          if (COL(i,j) < LAND) water++; else land++;
       }
     }
+    rowdone(j);
   }
+  stopbatch();
   if (debug)
     fprintf(stderr,"\n");
-  fprintf(stderr,"water percentage: %d\n",100*water/(water+land));
+  if (passStride <= 1) /* (once, if progressive) */
+    fprintf(stderr,"water percentage: %d\n",100*water/(water+land));
 }
 
 void squarep()
 {
-  double y,scale1,theta1,cos2, log_2();
-  int k,i,j;
-  void planet0();
-
-  k = (int)(0.5*lat*Width*scale/PI+0.5);
-  for (j = 0; j < Height; j++) {
+  double y,scale1,cos2, log_2();
+  int k,i,j,n;
+  void rowdone(), startbatch(), stopbatch(), longitudes();
+  void cylinderrow(), planetrow();
+  int startrow(), pixeldepth();
+
+  /* (for a tile, row j and column i are row j+mapY0 and column */
+  /* i+mapX0 of the whole map) */
+  k = (int)(0.5*lat*mapWidth*scale/PI+0.5);
+  startbatch();
+  longitudes(mapX0, mapWidth);
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
-    y = (2.0*(j-k)-Height)/Width/scale*PI;
+    y = (2.0*(j+mapY0-k)-mapHeight)/mapWidth/scale*PI;
     if (fabs(y+y)>PI)
       for (i = 0; i < Width ; i++) {
-        col[i][j] = BACK;
-      if (doshade>0) shades[i][j] = 255;
+        COL(i,j) = BACK;
+      if (doshade>0) SHADES(i,j) = 255;
     } else {
       cos2 = cos(y);
       if (cos2>0.0) {
-        scale1 = scale*Width/Height/cos2/PI;
-        Depth = 3*((int)(log_2(scale1*Height)))+3;
-        for (i = 0; i < Width ; i++) {
-          theta1 = longi-0.5*PI+PI*(2.0*i-Width)/Width/scale;
-          planet0(cos(theta1)*cos2,sin(y),-sin(theta1)*cos2, i,j);
-        }
+        scale1 = scale*mapWidth/mapHeight/cos2/PI;
+        Depth = 3*((int)(log_2(scale1*mapHeight)))+3;
+        /* pixels are cos2 times narrower than high, and Depth is */
+        /* chosen for their width */
+        Depth = pixeldepth(Depth, 1.0/sqrt(cos2));
+        cylinderrow(sin(y), cos2);
+        planetrow(j);
       }
     }
+    rowdone(j);
   }
+  stopbatch();
 }
 
 void mollweide()
 {
   double y,y1,zz,scale1,cos2,theta1,theta2, log_2();
-  int i,j,i1=1,k;
-  void planet0();
+  int i,j,n,i1=1,k;
+  void planet0(), rowdone();
+  int startrow(), pixeldepth();
 
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     y1 = 2*(2.0*j-Height)/Width/scale;
     if (fabs(y1)>=1.0) for (i = 0; i < Width ; i++) {
-      col[i][j] = BACK;
-      if (doshade>0) shades[i][j] = 255;
+      COL(i,j) = BACK;
+      if (doshade>0) SHADES(i,j) = 255;
     } else {
       zz = sqrt(1.0-y1*y1);
       y = 2.0/PI*(y1*zz+asin(y1));
@@ -1132,11 +2298,14 @@ void mollweide()
       if (cos2>0.0) {
         scale1 = scale*Width/Height/cos2/PI;
         Depth = 3*((int)(log_2(scale1*Height)))+3;
+        /* equal-area: pixels are sqrt(8)/PI/cos2 times wider than */
+        /* the width Depth is chosen for */
+        Depth = pixeldepth(Depth, sqrt(8.0)/PI/cos2);
         for (i = 0; i < Width ; i++) {
           theta1 = PI/zz*(2.0*i-Width)/Width/scale;
           if (fabs(theta1)>PI) {
-            col[i][j] = BACK;
-            if (doshade>0) shades[i][j] = 255;
+            COL(i,j) = BACK;
+            if (doshade>0) SHADES(i,j) = 255;
           } else {
             double x2,y2,z2, x3,y3,z3;
             theta1 += -0.5*PI;
@@ -1152,56 +2321,77 @@ void mollweide()
         }
       }
     }
+    rowdone(j);
   }
 }
 
 void sinusoid()
 {
-  double y,theta1,theta2,cos2,l1,i1,scale1, log_2();
-  int k,i,j,l,c;
-  void planet0();
-
+  double y,y1,theta1,theta2,cos2,l1,i1,scale1, log_2();
+  double *lobe, *across; /* per column: longitude of lobe, and angle */
+  int k,i,j,n,l;         /* from it at the equator */
+  void rowdone(), startbatch(), stopbatch(), planetrow();
+  int startrow(), pixeldepth();
+
+  startbatch();
+  lobe = colcos; across = colsin;
+  for (i = 0; i<Width; i++) {
+    l = i*12/Width/scale;
+    l1 = l*Width*scale/12.0;
+    i1 = i-l1;
+    lobe[i] = longi-0.5*PI+PI*(2.0*l1-Width)/Width/scale;
+    across[i] = PI*(2.0*i1-Width*scale/12.0)/Width/scale;
+  }
   k = (int)(lat*Width*scale/PI+0.5);
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     y = (2.0*(j-k)-Height)/Width/scale*PI;
     if (fabs(y+y)>PI) for (i = 0; i < Width ; i++) {
-      col[i][j] = BACK;
-      if (doshade>0) shades[i][j] = 255;
+      COL(i,j) = BACK;
+      if (doshade>0) SHADES(i,j) = 255;
     } else {
       cos2 = cos(y);
       if (cos2>0.0) {
         scale1 = scale*Width/Height/cos2/PI;
         Depth = 3*((int)(log_2(scale1*Height)))+3;
+        /* equal-area: pixels are 1/cos2 times wider than the */
+        /* width Depth is chosen for */
+        Depth = pixeldepth(Depth, 1.0/cos2);
+        y1 = sin(y);
         for (i = 0; i<Width; i++) {
-          l = i*12/Width/scale;
-          l1 = l*Width*scale/12.0;
-          i1 = i-l1;
-          theta2 = longi-0.5*PI+PI*(2.0*l1-Width)/Width/scale;
-          theta1 = (PI*(2.0*i1-Width*scale/12.0)/Width/scale)/cos2;
+          theta2 = lobe[i];
+          theta1 = across[i]/cos2;
           if (fabs(theta1)>PI/12.0) {
-            col[i][j] = BACK;
-            if (doshade>0) shades[i][j] = 255;
+            COL(i,j) = BACK;
+            if (doshade>0) SHADES(i,j) = 255;
+            bx[i] = by[i] = bz[i] = 0.0;
           } else {
-            planet0(cos(theta1+theta2)*cos2,sin(y),-sin(theta1+theta2)*cos2,
-                    i,j);
+            bx[i] = cos(theta1+theta2)*cos2;
+            by[i] = y1;
+            bz[i] = -sin(theta1+theta2)*cos2;
           }
         }
+        planetrow(j);
       }
     }
+    rowdone(j);
   }
+  stopbatch();
 }
 
 void stereo()
 {
   double x,y,ymin,ymax,z,zz,x1,y1,z1,theta1,theta2;
-  int i,j;
-  void planet0();
+  int i,j,n;
+  void planet0(), rowdone();
+  int startrow();
 
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     for (i = 0; i < Width ; i++) {
@@ -1223,28 +2413,33 @@ void stereo()
 
       planet0(x1,y1,z1, i,j);
     }
+    rowdone(j);
   }
 }
 
 void orthographic()
 {
   double x,y,z,x1,y1,z1,ymin,ymax,theta1,theta2,zz;
-  int i,j;
-  void planet0();
+  int i,j,n,depth0 = Depth;
+  void planet0(), rowdone();
+  int startrow(), pixeldepth();
 
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     for (i = 0; i < Width ; i++) {
       x = (2.0*i-Width)/Height/scale;
       y = (2.0*j-Height)/Height/scale;
       if (x*x+y*y>1.0) {
-        col[i][j] = BACK;
-        if (doshade>0) shades[i][j] = 255;
+        COL(i,j) = BACK;
+        if (doshade>0) SHADES(i,j) = 255;
       } else {
         z = sqrt(1.0-x*x-y*y);
+        /* pixels are 1/z times longer towards the limb than across */
+        Depth = pixeldepth(depth0, 1.0/sqrt(z));
         x1 = clo*x+slo*sla*y+slo*cla*z;
         y1 = cla*y-sla*z;
         z1 = -slo*x+clo*sla*y+clo*cla*z;
@@ -1253,14 +2448,16 @@ void orthographic()
         planet0(x1,y1,z1, i,j);
       }
     }
+    rowdone(j);
   }
 }
 
 void icosahedral() /* modified version of gnomonic */
 {
   double x,y,z,x1,y1,z1,zz,theta1,theta2,ymin,ymax;
-  int i,j;
-  void planet0();
+  int i,j,n;
+  void planet0(), rowdone();
+  int startrow();
   double lat1, longi1, sla, cla, slo, clo, x0, y0, sq3_4, sq3;
   double L1, L2, S;
 
@@ -1270,7 +2467,8 @@ void icosahedral() /* modified version of gnomonic */
   L1 =  10.812317; /* theoretically 10.9715145571469; */
   L2 = -52.622632; /* theoretically -48.3100310579607; */
   S = 55.6; /* found by experimentation */
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     for (i = 0; i < Width ; i++) {
@@ -1372,8 +2570,8 @@ void icosahedral() /* modified version of gnomonic */
       }
 
       if (lat1 > 400.0) {
-        col[i][j] = BACK;
-        if (doshade>0) shades[i][j] = 255;
+        COL(i,j) = BACK;
+        if (doshade>0) SHADES(i,j) = 255;
       } else {
         x = (x0 - longi1)/S;
         y = (y0 + lat1)/S;
@@ -1397,18 +2595,21 @@ void icosahedral() /* modified version of gnomonic */
         planet0(x1,y1,z1, i,j);
       }
     }
+    rowdone(j);
   }
 }
 
 void gnomonic()
 {
   double x,y,z,x1,y1,z1,zz,theta1,theta2,ymin,ymax;
-  int i,j;
-  void planet0();
+  int i,j,n;
+  void planet0(), rowdone();
+  int startrow();
 
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     for (i = 0; i < Width ; i++) {
@@ -1425,18 +2626,21 @@ void gnomonic()
       if (y1 > ymax) ymax = y1;
       planet0(x1,y1,z1, i,j);
     }
+    rowdone(j);
   }
 }
 
 void azimuth()
 {
   double x,y,z,x1,y1,z1,zz,theta1,theta2,ymin,ymax;
-  int i,j;
-  void planet0();
+  int i,j,n;
+  void planet0(), rowdone();
+  int startrow();
 
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
+  for (n = 0; n < Height; n++) {
+    j = startrow(n);
     if (debug && ((j % (Height/25)) == 0))
       {fprintf (stderr, "%c", view); fflush(stderr);}
     for (i = 0; i < Width ; i++) {
@@ -1445,8 +2649,8 @@ void azimuth()
       zz = x*x+y*y;
       z = 1.0-0.5*zz;
       if (z<-1.0) {
-        col[i][j] = BACK;
-        if (doshade>0) shades[i][j] = 255;
+        COL(i,j) = BACK;
+        if (doshade>0) SHADES(i,j) = 255;
       } else {
         zz = sqrt(1.0-0.25*zz);
         x = x*zz;
@@ -1459,14 +2663,16 @@ void azimuth()
         planet0(x1,y1,z1, i,j);
       }
     }
+    rowdone(j);
   }
 }
 
 void conical()
 {
   double k1,c,y2,x,y,zz,x1,y1,z1,theta1,theta2,ymin,ymax,cos2;
-  int i,j;
-  void planet0();
+  int i,j,n,depth0 = Depth;
+  void planet0(), rowdone();
+  int startrow(), pixeldepth();
 
   ymin = 2.0;
   ymax = -2.0;
@@ -1474,7 +2680,8 @@ void conical()
     k1 = 1.0/sin(lat);
     c = k1*k1;
     y2 = sqrt(c*(1.0-sin(lat/k1))/(1.0+sin(lat/k1)));
-    for (j = 0; j < Height; j++) {
+    for (n = 0; n < Height; n++) {
+      j = startrow(n);
       if (debug && ((j % (Height/25)) == 0))
         {fprintf (stderr, "%c", view); fflush(stderr);}
       for (i = 0; i < Width ; i++) {
@@ -1483,15 +2690,17 @@ void conical()
         zz = x*x+y*y;
         if (zz==0.0) theta1 = 0.0; else theta1 = k1*atan2(x,y);
         if (theta1<-PI || theta1>PI) {
-          col[i][j] = BACK;
-          if (doshade>0) shades[i][j] = 255;
+          COL(i,j) = BACK;
+          if (doshade>0) SHADES(i,j) = 255;
         } else {
           theta1 += longi-0.5*PI; /* theta1 is longitude */
           theta2 = k1*asin((zz-c)/(zz+c));
           /* theta2 is latitude */
+          /* (conformal, with 2c/(zz+c) radians per unit of map) */
+          Depth = pixeldepth(depth0, 2.0*c/(zz+c));
           if (theta2 > 0.5*PI || theta2 < -0.5*PI) {
-            col[i][j] = BACK;
-            if (doshade>0) shades[i][j] = 255;
+            COL(i,j) = BACK;
+            if (doshade>0) SHADES(i,j) = 255;
           } else {
             cos2 = cos(theta2);
             y = sin(theta2);
@@ -1501,13 +2710,15 @@ void conical()
           }
         }
       }
+      rowdone(j);
     }
   }
   else {
     k1 = 1.0/sin(lat);
     c = k1*k1;
     y2 = sqrt(c*(1.0-sin(lat/k1))/(1.0+sin(lat/k1)));
-    for (j = 0; j < Height; j++) {
+    for (n = 0; n < Height; n++) {
+      j = startrow(n);
       if (debug && ((j % (Height/25)) == 0))
         {fprintf (stderr, "%c", view); fflush(stderr);}
       for (i = 0; i < Width ; i++) {
@@ -1516,15 +2727,17 @@ void conical()
         zz = x*x+y*y;
         if (zz==0.0) theta1 = 0.0; else theta1 = -k1*atan2(x,-y);
         if (theta1<-PI || theta1>PI) {
-          col[i][j] = BACK;
-          if (doshade>0) shades[i][j] = 255;
+          COL(i,j) = BACK;
+          if (doshade>0) SHADES(i,j) = 255;
         } else {
           theta1 += longi-0.5*PI; /* theta1 is longitude */
           theta2 = k1*asin((zz-c)/(zz+c));
           /* theta2 is latitude */
+          /* (conformal, with 2c/(zz+c) radians per unit of map) */
+          Depth = pixeldepth(depth0, 2.0*c/(zz+c));
           if (theta2 > 0.5*PI || theta2 < -0.5*PI) {
-            col[i][j] = BACK;
-            if (doshade>0) shades[i][j] = 255;
+            COL(i,j) = BACK;
+            if (doshade>0) SHADES(i,j) = 255;
           } else {
             cos2 = cos(theta2);
             y = sin(theta2);
@@ -1534,6 +2747,7 @@ void conical()
           }
         }
       }
+      rowdone(j);
     }
   }
 }
@@ -1550,48 +2764,43 @@ void planet0(x,y,z, i, j)
 double x,y,z;
 int i, j;
 {
-  double alt, planet1(), y2, sun, temp, rain;
-  int colour;
-
-  alt = planet1(x,y,z);
-
-  /* calculate temperature based on altitude and latitude */
-  /* scale: -0.1 to 0.1 corresponds to -30 to +30 degrees Celsius */
-  sun = sqrt(1.0-y*y); /* approximate amount of sunlight at
-			     latitude ranged from 0.1 to 1.1 */
-  if (alt < 0) temp = sun/8.0 + alt*0.3; /* deep water colder */
-  else temp = sun/8.0 - alt*1.2; /* high altitudes colder */
-
-  if (temp<tempMin && alt >0) tempMin = temp;
-  if (temp>tempMax && alt >0) tempMax = temp;
-  if (temperature) alt = temp-0.05;
+  double alt, planet1(), cubepoint();
+  void colourpoint(), tracepoint();
+
+  /* in a pass of -W, only pixels not evaluated by earlier passes */
+  if (passStride > 0
+      && (i % passStride || j % passStride
+          || (passStride < firstStride
+              && i % (2*passStride) == 0 && j % (2*passStride) == 0)))
+    return;
+
+  if (tracing) tracepoint(x,y,z, i,j);
+  STAT(statBand = (int)((long)j*STATBANDS/Height);)
+
+  if (cube != NULL) alt = cubepoint(x,y,z);
+  else alt = planet1(x,y,z);
+
+  if (hcache != NULL) { /* remember point for sea-level changes */
+    double *hc = hcache+HCACHE*((long)j*Width+i);
+    hc[0] = alt; hc[1] = x; hc[2] = y; hc[3] = z;
+    hc[4] = rainShadow; hc[5] = shade;
+  }
 
-  /* calculate rainfall based on temperature and latitude */
-  /* rainfall approximately proportional to temperature but reduced
-     near horse latitudes (+/- 30 degrees, y=0.5) and reduced for
-     rain shadow */
-  y2 = fabs(y)-0.5;
-  rain = temp*0.65 + 0.1 - 0.011/(y2*y2+0.1);
-  rain += 0.03*rainShadow;
-  if (rain<0.0) rain = 0.0;
+  colourpoint(alt+M, x,y,z, i,j);
+}
 
-  if (rain<rainMin && alt >0) rainMin = rain;
-  if (rain>rainMax && alt >0) rainMax = rain;
-  
-  if (rainfall) alt = rain-0.02;
+int altcolour(alt, temp, rain, y2, biome) /* colour of altitude */
+double alt, temp, rain, y2;
+int biome;
+{
+  int colour;
 
   if (nonLinear) {
     /* non-linear scaling to make flatter near sea level */
     alt = alt*alt*alt * 300;
   }
-  /* store height for heightfield */
-  if (file_type == heightfield) heights[i][j] = 10000000*alt;
-
-  y2 = y*y; y2 = y2*y2; y2 = y2*y2;
 
-  /* calculate colour */
-
-  if (makeBiomes) { /* make biome colours */
+  if (biome) { /* make biome colours */
     int tt = min(44,max(0,(int)(rain*300.0-9)));
     int rr = min(44,max(0,(int)(temp*300.0+10)));
     char bio = biomes[tt][rr];
@@ -1618,24 +2827,164 @@ int i, j;
       if (colour>HIGHEST) colour = HIGHEST;
     }
   }
+  return(colour);
+}
+
+void climate(alt, y, temp, rain) /* temperature and rainfall at */
+double alt, y, *temp, *rain;     /* altitude alt and height y */
+{
+  double y2, sun;
+
+  /* calculate temperature based on altitude and latitude */
+  /* scale: -0.1 to 0.1 corresponds to -30 to +30 degrees Celsius */
+  sun = sqrt(1.0-y*y); /* approximate amount of sunlight at
+			     latitude ranged from 0.1 to 1.1 */
+  if (alt < 0) *temp = sun/8.0 + alt*0.3; /* deep water colder */
+  else *temp = sun/8.0 - alt*1.2; /* high altitudes colder */
+
+  /* calculate rainfall based on temperature and latitude */
+  /* rainfall approximately proportional to temperature but reduced
+     near horse latitudes (+/- 30 degrees, y=0.5) and reduced for
+     rain shadow */
+  y2 = fabs(y)-0.5;
+  *rain = *temp*0.65 + 0.1 - 0.011/(y2*y2+0.1);
+  *rain += 0.03*rainShadow;
+  if (*rain<0.0) *rain = 0.0;
+}
+
+char biomeletter(alt, temp, rain) /* biome of land as in altcolour(), */
+double alt, temp, rain;             /* or 0 for sea */
+{
+  int tt = min(44,max(0,(int)(rain*300.0-9)));
+  int rr = min(44,max(0,(int)(temp*300.0+10)));
+
+  return((alt > 0.0) ? biomes[tt][rr] : 0);
+}
+
+void colourpoint(alt, x,y,z, i, j) /* colour point from altitude */
+double alt, x,y,z;
+int i, j;
+{
+  double y2, temp, rain;
+  int sunshade(), altcolour();
+  void climate();
+
+  /* sea-dependent shading, so shade only depends on altitude - M */
+  if (doshade==2 && alt<0.0) shade = 150;
+  if (doshade==3 && alt<=0.0) shade = sunshade(x,y,z);
+
+  climate(alt, y, &temp, &rain);
+
+  if (temp<tempMin && alt >0) tempMin = temp;
+  if (temp>tempMax && alt >0) tempMax = temp;
+
+  if (rain<rainMin && alt >0) rainMin = rain;
+  if (rain>rainMax && alt >0) rainMax = rain;
+
+  y2 = y*y; y2 = y2*y2; y2 = y2*y2;
+
+  if (allChannels) { /* every map from the same point */
+    colT[PIXEL(i,j)] = altcolour(temp-0.05, temp, rain, y2, 0);
+    colR[PIXEL(i,j)] = altcolour(rain-0.02, temp, rain, y2, 0);
+    colB[PIXEL(i,j)] = altcolour(alt, temp, rain, y2, 1);
+  }
+
+  if (temperature) alt = temp-0.05;
+  if (rainfall) alt = rain-0.02;
+
+  /* store height for heightfield */
+  if (fheights != NULL)
+    fheights[PIXEL(i,j)] = nonLinear ? alt*alt*alt * 300 : alt;
+  else if (file_type == heightfield)
+    heights[PIXEL(i,j)] = 10000000*(nonLinear ? alt*alt*alt * 300 : alt);
+  if (altitudes != NULL) altitudes[PIXEL(i,j)] = alt;
 
   /* store colour */
-  col[i][j] = colour;
+  COL(i,j) = altcolour(alt, temp, rain, y2, makeBiomes);
 
   /* store (x,y,z) coordinates for grid drawing */
-  if (vgrid != 0.0) {
-    xxx[i][j] = x;
-    zzz[i][j] = z;
+  if (xxx != NULL) {
+    XXX(i,j) = x;
+    ZZZ(i,j) = z;
   }
-  if (hgrid != 0.0 || vgrid != 0.0) yyy[i][j] = y;
+  if (yyy != NULL) YYY(i,j) = y;
 
   /* store shading info */
-  if (doshade>0) shades[i][j] = shade;
+  if (doshade>0) SHADES(i,j) = shade;
 
   return;
 }
 
 vertex ssa, ssb, ssc, ssd;
+int ssDepth; /* Depth when ssa, ssb, ssc and ssd were saved */
+
+void newvertex(a, b, e, lab, x,y,z) /* sets e to the vertex that cuts */
+vertex *a, *b, *e;                  /* edge ab of squared length lab */
+double lab, x,y,z;                  /* on the way to (x,y,z) */
+{
+  double es1, es2, es3;
+  double x1,y1,z1,z2,l1,tmp;
+  int tracestep();
+
+  e->s = rand2(a->s,b->s);
+  es1 = rand2(e->s,e->s);
+  es2 = 0.5+0.1*rand2(es1,es1);  /* find cut point */
+  es3 = 1.0-es2;
+
+  if (a->s<b->s) {
+    e->x = es2*a->x+es3*b->x;
+    e->y = es2*a->y+es3*b->y;
+    e->z = es2*a->z+es3*b->z;
+  } else if (a->s>b->s) {
+    e->x = es3*a->x+es2*b->x;
+    e->y = es3*a->y+es2*b->y;
+    e->z = es3*a->z+es2*b->z;
+  } else { /* as==bs, very unlikely to ever happen */
+    e->x = 0.5*a->x+0.5*b->x;
+    e->y = 0.5*a->y+0.5*b->y;
+    e->z = 0.5*a->z+0.5*b->z;
+  }
+
+  /* new altitude is: */
+  STAT(statCuts[statBand]++;)
+  if (matchMap && lab > matchSize) { /* use map height */
+    double l, xx, yy;
+    STAT(statMapped[statBand]++;)
+    l = sqrt(e->x*e->x+e->y*e->y+e->z*e->z);
+    yy = asin(e->y/l)*23/PI+11.5;
+    xx = atan2(e->x,e->z)*23.5/PI+23.5;
+    e->h = cl0[(int)(xx+0.5)][(int)(yy+0.5)]*0.1/8.0 - M;
+  } else {
+    if (lab>1.0) lab = pow(lab,0.5);
+    /* decrease contribution for very long distances */
+    e->h = 0.5*(a->h+b->h) /* average of end points */
+      + e->s*dd1*pow(fabs(a->h-b->h),POWA)
+      /* plus contribution for altitude diff */
+      + es1*dd2*pow(lab,POW); /* plus contribution for distance */
+  }
+
+  if (tracing) e->id = tracestep(a,b);
+
+  /* calculate approximate rain shadow for new point */
+  if (e->h+M <= 0.0 || !doRainShadow) e->shadow = 0.0;
+  else {
+    x1 = 0.5*(a->x+b->x);
+    x1 = a->h*(x1-a->x)+b->h*(x1-b->x);
+    y1 = 0.5*(a->y+b->y);
+    y1 = a->h*(y1-a->y)+b->h*(y1-b->y);
+    z1 = 0.5*(a->z+b->z);
+    z1 = a->h*(z1-a->z)+b->h*(z1-b->z);
+    l1 = sqrt(x1*x1+y1*y1+z1*z1);
+    if (l1==0.0) l1 = 1.0;
+    tmp = sqrt(1.0-y*y);
+    if (tmp<0.0001) tmp = 0.0001;
+    z2 = -z/tmp*x1+x/tmp*z1;
+    if (lab > 0.04)
+      e->shadow = (a->shadow + b->shadow- cos(PI*shade_angle/180.0)*z2/l1)/3.0;
+    else
+      e->shadow = (a->shadow + b->shadow)/2.0;
+  }
+}
 
 double planet(a,b,c,d, x,y,z, level)
 vertex a,b,c,d;             /* tetrahedron vertices */
@@ -1644,10 +2993,9 @@ int level;                  /* levels to go */
 {
   vertex e;
   double lab, lac, lad, lbc, lbd, lcd, maxlength;
-  double es1, es2, es3;
   double eax,eay,eaz, epx,epy,epz;
   double ecx,ecy,ecz, edx,edy,edz;
-  double x1,y1,z1,x2,y2,z2,l1,tmp;
+  void newvertex(), shadepoint(), tracelast();
 
   if (level>0) {
 
@@ -1666,6 +3014,7 @@ int level;                  /* levels to go */
     if (lbd > maxlength) maxlength = lbd;
     if (lcd > maxlength) maxlength = lcd;
 
+    STAT(if (lab != maxlength) statReorders[statBand]++;)
     if (lac == maxlength) return(planet(a,c,b,d, x,y,z, level));
     if (lad == maxlength) return(planet(a,d,b,c, x,y,z, level));
     if (lbc == maxlength) return(planet(b,c,a,d, x,y,z, level));
@@ -1674,60 +3023,11 @@ int level;                  /* levels to go */
 
     if (level == 11) { /* save tetrahedron for caching */
       ssa = a; ssb = b; ssc = c; ssd = d;
+      ssDepth = Depth;
     }
 
     /* ab is longest, so cut ab */
-      e.s = rand2(a.s,b.s);
-      es1 = rand2(e.s,e.s);
-      es2 = 0.5+0.1*rand2(es1,es1);  /* find cut point */
-      es3 = 1.0-es2;
-
-      if (a.s<b.s) {
-        e.x = es2*a.x+es3*b.x; e.y = es2*a.y+es3*b.y; e.z = es2*a.z+es3*b.z;
-      } else if (a.s>b.s) {
-        e.x = es3*a.x+es2*b.x; e.y = es3*a.y+es2*b.y; e.z = es3*a.z+es2*b.z;
-      } else { /* as==bs, very unlikely to ever happen */
-        e.x = 0.5*a.x+0.5*b.x; e.y = 0.5*a.y+0.5*b.y; e.z = 0.5*a.z+0.5*b.z;
-      }
-
-      /* new altitude is: */
-      if (matchMap && lab > matchSize) { /* use map height */
-        double l, xx, yy;
-        l = sqrt(e.x*e.x+e.y*e.y+e.z*e.z);
-        yy = asin(e.y/l)*23/PI+11.5;
-        xx = atan2(e.x,e.z)*23.5/PI+23.5;
-        e.h = cl0[(int)(xx+0.5)][(int)(yy+0.5)]*0.1/8.0;
-      } else {
-        if (lab>1.0) lab = pow(lab,0.5);
-        /* decrease contribution for very long distances */
-        e.h = 0.5*(a.h+b.h) /* average of end points */
-          + e.s*dd1*pow(fabs(a.h-b.h),POWA)
-          /* plus contribution for altitude diff */
-          + es1*dd2*pow(lab,POW); /* plus contribution for distance */
-      }
-
-      /* calculate approximate rain shadow for new point */
-      if (e.h <= 0.0 || !(rainfall || makeBiomes)) e.shadow = 0.0;
-      else {
-      x1 = 0.5*(a.x+b.x);
-      x1 = a.h*(x1-a.x)+b.h*(x1-b.x);
-      y1 = 0.5*(a.y+b.y);
-      y1 = a.h*(y1-a.y)+b.h*(y1-b.y);
-      z1 = 0.5*(a.z+b.z);
-      z1 = a.h*(z1-a.z)+b.h*(z1-b.z);
-      l1 = sqrt(x1*x1+y1*y1+z1*z1);
-      if (l1==0.0) l1 = 1.0;
-      tmp = sqrt(1.0-y*y);
-      if (tmp<0.0001) tmp = 0.0001;
-      x2 = x*x1+y*y1+z*z1;
-      z2 = -z/tmp*x1+x/tmp*z1;
-      if (lab > 0.04)
-	e.shadow = (a.shadow + b.shadow- cos(PI*shade_angle/180.0)*z2/l1)/3.0;
-      else
-	e.shadow = (a.shadow + b.shadow)/2.0;
-      }
-      
-
+    newvertex(&a,&b,&e, lab, x,y,z);
 
       /* find out in which new tetrahedron target point is */
       eax = a.x-e.x; eay = a.y-e.y; eaz = a.z-e.z;
@@ -1746,71 +3046,102 @@ int level;                  /* levels to go */
       }
   }
   else { /* level == 0 */
-    if (doshade==1 || doshade==2) { /* bump map */
-      x1 = 0.25*(a.x+b.x+c.x+d.x);
-      x1 = a.h*(x1-a.x)+b.h*(x1-b.x)+c.h*(x1-c.x)+d.h*(x1-d.x);
-      y1 = 0.25*(a.y+b.y+c.y+d.y);
-      y1 = a.h*(y1-a.y)+b.h*(y1-b.y)+c.h*(y1-c.y)+d.h*(y1-d.y);
-      z1 = 0.25*(a.z+b.z+c.z+d.z);
-      z1 = a.h*(z1-a.z)+b.h*(z1-b.z)+c.h*(z1-c.z)+d.h*(z1-d.z);
-      l1 = sqrt(x1*x1+y1*y1+z1*z1);
-      if (l1==0.0) l1 = 1.0;
-      tmp = sqrt(1.0-y*y);
-      if (tmp<0.0001) tmp = 0.0001;
-      x2 = x*x1+y*y1+z*z1;
-      y2 = -x*y/tmp*x1+tmp*y1-z*y/tmp*z1;
-      z2 = -z/tmp*x1+x/tmp*z1;
-      shade =
-        (int)((-sin(PI*shade_angle/180.0)*y2-cos(PI*shade_angle/180.0)*z2)
-              /l1*48.0+128.0);
-      if (shade<10) shade = 10;
-      if (shade>255) shade = 255;
-      if (doshade==2 && (a.h+b.h+c.h+d.h)<0.0) shade = 150;
-    }
-    else if (doshade==3) { /* daylight shading */
-      double hh = a.h+b.h+c.h+d.h;
-      if (hh<=0.0) { /* sea */
-        x1 = x; y1 = y; z1 = z; /* (x1,y1,z1) = normal vector */
-      } else { /* add bumbmap effect */
-        x1 = 0.25*(a.x+b.x+c.x+d.x);
-        x1 = (a.h*(x1-a.x)+b.h*(x1-b.x)+c.h*(x1-c.x)+d.h*(x1-d.x));
-        y1 = 0.25*(a.y+b.y+c.y+d.y);
-        y1 = (a.h*(y1-a.y)+b.h*(y1-b.y)+c.h*(y1-c.y)+d.h*(y1-d.y));
-        z1 = 0.25*(a.z+b.z+c.z+d.z);
-        z1 = (a.h*(z1-a.z)+b.h*(z1-b.z)+c.h*(z1-c.z)+d.h*(z1-d.z));
-	l1 = 5.0*sqrt(x1*x1+y1*y1+z1*z1);
-	x1 += x*l1; y1 += y*l1; z1 += z*l1;
-      }
-      l1 = sqrt(x1*x1+y1*y1+z1*z1);
-      if (l1==0.0) l1 = 1.0;
-      x2 = cos(PI*shade_angle/180.0-0.5*PI)*cos(PI*shade_angle2/180.0);
-      y2 = -sin(PI*shade_angle2/180.0);
-      z2 = -sin(PI*shade_angle/180.0-0.5*PI)*cos(PI*shade_angle2/180.0);
-      shade = (int)((x1*x2+y1*y2+z1*z2)/l1*170.0+10);
-      if (shade<10) shade = 10;
-      if (shade>255) shade = 255;
-    }
+    if (doshade>0) shadepoint(a,b,c,d, x,y,z);
+    if (tracing) tracelast(&a,&b,&c,&d);
     rainShadow  = 0.25*(a.shadow+b.shadow+c.shadow+d.shadow);
     return 0.25*(a.h+b.h+c.h+d.h);
   }
 }
 
+void shadepoint(a,b,c,d, x,y,z) /* sets shade from final tetrahedron */
+vertex a,b,c,d;
+double x,y,z;
+{
+  double x1,y1,z1,y2,z2,l1,tmp;
+  int sunshade();
+
+  if (doshade==1 || doshade==2) { /* bump map */
+    x1 = 0.25*(a.x+b.x+c.x+d.x);
+    x1 = a.h*(x1-a.x)+b.h*(x1-b.x)+c.h*(x1-c.x)+d.h*(x1-d.x);
+    y1 = 0.25*(a.y+b.y+c.y+d.y);
+    y1 = a.h*(y1-a.y)+b.h*(y1-b.y)+c.h*(y1-c.y)+d.h*(y1-d.y);
+    z1 = 0.25*(a.z+b.z+c.z+d.z);
+    z1 = a.h*(z1-a.z)+b.h*(z1-b.z)+c.h*(z1-c.z)+d.h*(z1-d.z);
+    l1 = sqrt(x1*x1+y1*y1+z1*z1);
+    if (l1==0.0) l1 = 1.0;
+    tmp = sqrt(1.0-y*y);
+    if (tmp<0.0001) tmp = 0.0001;
+    y2 = -x*y/tmp*x1+tmp*y1-z*y/tmp*z1;
+    z2 = -z/tmp*x1+x/tmp*z1;
+    shade =
+      (int)((-sin(PI*shade_angle/180.0)*y2-cos(PI*shade_angle/180.0)*z2)
+            /l1*48.0+128.0);
+    if (shade<10) shade = 10;
+    if (shade>255) shade = 255;
+    /* sea (doshade==2) is set in colourpoint() */
+  }
+  else if (doshade==3) { /* daylight shading on land */
+    /* add bumbmap effect; sea is shaded in colourpoint() */
+    x1 = 0.25*(a.x+b.x+c.x+d.x);
+    x1 = (a.h*(x1-a.x)+b.h*(x1-b.x)+c.h*(x1-c.x)+d.h*(x1-d.x));
+    y1 = 0.25*(a.y+b.y+c.y+d.y);
+    y1 = (a.h*(y1-a.y)+b.h*(y1-b.y)+c.h*(y1-c.y)+d.h*(y1-d.y));
+    z1 = 0.25*(a.z+b.z+c.z+d.z);
+    z1 = (a.h*(z1-a.z)+b.h*(z1-b.z)+c.h*(z1-c.z)+d.h*(z1-d.z));
+    l1 = 5.0*sqrt(x1*x1+y1*y1+z1*z1);
+    shade = sunshade(x1+x*l1, y1+y*l1, z1+z*l1);
+  }
+}
+
+int sunshade(x1,y1,z1) /* daylight shade of surface normal (x1,y1,z1) */
+double x1,y1,z1;
+{
+  double l1, x2,y2,z2;
+  int s;
+
+  l1 = sqrt(x1*x1+y1*y1+z1*z1);
+  if (l1==0.0) l1 = 1.0;
+  x2 = cos(PI*shade_angle/180.0-0.5*PI)*cos(PI*shade_angle2/180.0);
+  y2 = -sin(PI*shade_angle2/180.0);
+  z2 = -sin(PI*shade_angle/180.0-0.5*PI)*cos(PI*shade_angle2/180.0);
+  s = (int)((x1*x2+y1*y2+z1*z2)/l1*170.0+10);
+  if (s<10) s = 10;
+  if (s>255) s = 255;
+  return(s);
+}
+
 double planet1(x,y,z)
 double x,y,z;
 {
   vertex a,b,c,d;
+  int level;
 
   double abx,aby,abz, acx,acy,acz, adx,ady,adz, apx,apy,apz;
   double bax,bay,baz, bcx,bcy,bcz, bdx,bdy,bdz, bpx,bpy,bpz;
   
   /* check if point is inside cached tetrahedron */
+  /* (not when recording, as traversals start from the top) */
+
+  STAT(statPoints[statBand]++;)
+  if (tracing) {
+    STAT(statTraced[statBand]++; statLevels[statBand][min(Depth,STATLEVELS-1)]++;)
+    return(planet(tetra[0], tetra[1], tetra[2], tetra[3], x,y,z, Depth));
+  }
+
+  /* with -D, Depth changes from pixel to pixel, and with -W rows are */
+  /* not visited in order, so the cached tetrahedron is entered at the */
+  /* level it has for this Depth; then the result does not depend on */
+  /* the order of pixels */
+  level = adaptDepth || firstStride > 1 ? 11+Depth-ssDepth : 11;
+  STAT(if (level < 0) statStale[statBand]++;)
 
   abx = ssb.x-ssa.x; aby = ssb.y-ssa.y; abz = ssb.z-ssa.z;
   acx = ssc.x-ssa.x; acy = ssc.y-ssa.y; acz = ssc.z-ssa.z;
   adx = ssd.x-ssa.x; ady = ssd.y-ssa.y; adz = ssd.z-ssa.z;
   apx = x-ssa.x; apy = y-ssa.y; apz = z-ssa.z;
   
-  if ((adx*aby*acz+ady*abz*acx+adz*abx*acy
+  if (level >= 0 &&
+      (adx*aby*acz+ady*abz*acx+adz*abx*acy
        -adz*aby*acx-ady*abx*acz-adx*abz*acy)*
       (apx*aby*acz+apy*abz*acx+apz*abx*acy
        -apz*aby*acx-apy*abx*acz-apx*abz*acy) > 0.0) {
@@ -1836,12 +3167,14 @@ double x,y,z;
           /* p is on same side of bcd as a */
           /* Hence, p is inside cached tetrahedron */
           /* so we start from there */
-          return(planet(ssa,ssb,ssc,ssd, x,y,z, 11));
+          STAT(statHits[statBand]++; statLevels[statBand][min(level,STATLEVELS-1)]++;)
+          return(planet(ssa,ssb,ssc,ssd, x,y,z, level));
         }
       }
     }
   }
  /* otherwise, we start from scratch */
+  STAT(statLevels[statBand][min(Depth,STATLEVELS-1)]++;)
 
   return(planet(tetra[0], tetra[1], tetra[2], tetra[3],
                          /* vertices of tetrahedron */
@@ -1850,389 +3183,1894 @@ double x,y,z;
 
 }
 
+#ifdef PLANET_STATS
+void writestats() /* writes the counts of PLANET_STATS to stderr */
+{
+  int b, l, j0, j1;
+  long points = 0, hits = 0, stale = 0, traced = 0;
+  long reorders = 0, cuts = 0, mapped = 0, levels[STATLEVELS];
+  double sum;
+
+  for (l = 0; l < STATLEVELS; l++) levels[l] = 0;
+  fprintf(stderr, "\nstatistics of projection %c, %d x %d, Depth %d\n",
+          view, Width, Height, Depth);
+  fprintf(stderr, "     rows    points  hits%%  stale traced"
+          "  levels  reorders/pt  cuts/pt  mapped%%\n");
+  for (b = 0; b < STATBANDS; b++) {
+    if (statPoints[b] == 0) continue;
+    sum = 0.0;
+    for (l = 0; l < STATLEVELS; l++) {
+      sum += (double)l*statLevels[b][l];
+      levels[l] += statLevels[b][l];
+    }
+    j0 = (b*Height+STATBANDS-1)/STATBANDS;
+    j1 = ((b+1)*Height+STATBANDS-1)/STATBANDS-1;
+    fprintf(stderr, "%4d-%-4d %9ld %6.1f %6ld %6ld %7.2f %12.3f %8.3f %8.2f\n",
+            j0, j1, statPoints[b], 100.0*statHits[b]/statPoints[b],
+            statStale[b], statTraced[b], sum/statPoints[b],
+            (double)statReorders[b]/statPoints[b],
+            (double)statCuts[b]/statPoints[b],
+            statCuts[b] ? 100.0*statMapped[b]/statCuts[b] : 0.0);
+    points += statPoints[b]; hits += statHits[b]; stale += statStale[b];
+    traced += statTraced[b];
+    reorders += statReorders[b]; cuts += statCuts[b];
+    mapped += statMapped[b];
+  }
+  if (points == 0) return;
+  sum = 0.0;
+  for (l = 0; l < STATLEVELS; l++) sum += (double)l*levels[l];
+  fprintf(stderr, "all       %9ld %6.1f %6ld %6ld %7.2f %12.3f %8.3f %8.2f\n",
+          points, 100.0*hits/points, stale, traced, sum/points,
+          (double)reorders/points, (double)cuts/points,
+          cuts ? 100.0*mapped/cuts : 0.0);
+  fprintf(stderr, "levels descended (points, %%):");
+  for (l = 0; l < STATLEVELS; l++)
+    if (levels[l] > 0)
+      fprintf(stderr, " %s%d: %ld (%.1f)", l == STATLEVELS-1 ? ">=" : "",
+              l, levels[l], 100.0*levels[l]/points);
+  fprintf(stderr, "\n");
+}
+#endif
+
+/* The point queries of planet.h keep each planet's seeded tetrahedron */
+/* and planet1() cache in a planet_state, and swap them in when the */
+/* planet is asked, so several planets can be asked in turn without */
+/* starting again from the top of the tetrahedron. */
+struct planet_state
+{
+  double M, dd1, dd2, shade_angle;
+  int Depth;
+  vertex tetra[4];           /* seeded tetrahedron */
+  vertex ssa, ssb, ssc, ssd; /* cached tetrahedron of planet1() */
+  int ssDepth;
+};
 
-void printppm(outfile) /* prints picture in PPM (portable pixel map) format */
-FILE *outfile;
+planet_state *planet_open(const planet_params *params)
 {
-  int i,j,c,s;
+  planet_state *planet;
+  int setparams();
+  void setview(), seedtetra();
+
+  if (setparams(params) != PLANET_OK) return(NULL);
+  planet = (planet_state*)malloc(sizeof(planet_state));
+  if (planet == NULL) return(NULL);
+  setview(); /* Depth as for a map of params */
+  seedtetra();
+  planet->M = M; planet->dd1 = dd1; planet->dd2 = dd2;
+  planet->shade_angle = shade_angle; /* (direction of rain shadow) */
+  planet->Depth = Depth;
+  memcpy(planet->tetra, tetra, sizeof(tetra));
+  planet->ssa = ssa; planet->ssb = ssb; planet->ssc = ssc; planet->ssd = ssd;
+  planet->ssDepth = ssDepth;
+  return(planet);
+}
 
-  fprintf(outfile,"P6\n");
-  fprintf(outfile,"#fractal planet image\n");
-  fprintf(outfile,"# Command line:\n# %s\n",cmdLine);
-  fprintf(outfile,"%d %d 255\n",Width,Height);
+void planet_close(planet_state *planet)
+{
+  free(planet);
+}
 
-  if (doshade) {
-    for (j=0; j<Height; j++) {
-      for (i=0; i<Width; i++) {
-        s =shades[i][j];
-        c = s*rtable[col[i][j]]/150;
-        if (c>255) c=255;
-        putc(c,outfile);
-        c = s*gtable[col[i][j]]/150;
-        if (c>255) c=255;
-        putc(c,outfile);
-        c = s*btable[col[i][j]]/150;
-        if (c>255) c=255;
-        putc(c,outfile);
-      }
-    }
-  } else {
-    for (j=0; j<Height; j++)
-      for (i=0; i<Width; i++) {
-        putc(rtable[col[i][j]],outfile);
-        putc(gtable[col[i][j]],outfile);
-        putc(btable[col[i][j]],outfile);
-      }
+void planet_points(planet_state *planet, int n, const double *latlong,
+                   planet_values *values)
+{
+  int k;
+  double x, y, z, la, lo, alt, temp, rain;
+  double planet1();
+  void climate();
+  char biomeletter();
+
+  M = planet->M; dd1 = planet->dd1; dd2 = planet->dd2;
+  shade_angle = planet->shade_angle;
+  Depth = planet->Depth;
+  memcpy(tetra, planet->tetra, sizeof(tetra));
+  ssa = planet->ssa; ssb = planet->ssb; ssc = planet->ssc; ssd = planet->ssd;
+  ssDepth = planet->ssDepth;
+  doRainShadow = 1;
+  tracing = 0;
+
+  for (k=0; k<n; k++) {
+    la = latlong[2*k]*DEG2RAD;
+    lo = latlong[2*k+1]*DEG2RAD;
+    x = cos(la)*sin(lo); /* as the columns of mercator() */
+    y = sin(la);
+    z = cos(la)*cos(lo);
+    alt = planet1(x,y,z)+M;
+    climate(alt, y, &temp, &rain);
+    values[k].altitude = alt;
+    values[k].temperature = temp;
+    values[k].rainfall = rain;
+    values[k].biome = biomeletter(alt, temp, rain);
   }
-  fclose(outfile);
+
+  planet->ssa = ssa; planet->ssb = ssb; planet->ssc = ssc; planet->ssd = ssd;
+  planet->ssDepth = ssDepth;
 }
 
-void printppmBW(outfile) /* prints picture in b/w PPM format */
-FILE *outfile;
+/* The columns of a chunk share the start of their descent, so */
+/* chunkdescent() makes each tetrahedron once for the whole group of */
+/* columns inside it, and splits the group where a cut separates them. */
+/* Every column still gets the height planet() would give it alone. */
+void chunkdescent(a,b,c,d, xs,ys,zs, idx, n, level, heights)
+vertex a,b,c,d;             /* tetrahedron vertices */
+double *xs, *ys, *zs;       /* columns */
+int *idx, n;                /* the n columns in the tetrahedron */
+int level;                  /* levels to go */
+double *heights;
 {
-  int i,j,c;
+  vertex e, t;
+  double lab, lac, lad, lbc, lbd, lcd, maxlength, h, side;
+  double eax,eay,eaz, epx,epy,epz;
+  double ecx,ecy,ecz, edx,edy,edz;
+  int k, m;
+  void newvertex();
 
-  fprintf(outfile,"P6\n");
-  fprintf(outfile,"#fractal planet image\n");
-  fprintf(outfile,"# Command line:\n# %s\n",cmdLine);
-  fprintf(outfile,"%d %d 1\n",Width,Height);
+  if (level == 0) {
+    h = 0.25*(a.h+b.h+c.h+d.h);
+    for (k=0; k<n; k++) heights[idx[k]] = h;
+    return;
+  }
 
-  for (j=0; j<Height; j++)
-    for (i=0; i<Width; i++) {
-      if (col[i][j] < WHITE)
-        c=0;
-      else c=1;
-      putc(c,outfile);
-      putc(c,outfile);
-      putc(c,outfile);
+  for (;;) { /* make sure ab is longest edge, as planet() does */
+    lab = dist2(a,b);
+    lac = dist2(a,c);
+    lad = dist2(a,d);
+    lbc = dist2(b,c);
+    lbd = dist2(b,d);
+    lcd = dist2(c,d);
+
+    maxlength = lab;
+    if (lac > maxlength) maxlength = lac;
+    if (lad > maxlength) maxlength = lad;
+    if (lbc > maxlength) maxlength = lbc;
+    if (lbd > maxlength) maxlength = lbd;
+    if (lcd > maxlength) maxlength = lcd;
+
+    if (lac == maxlength) { t = b; b = c; c = t; }
+    else if (lad == maxlength) { t = b; b = d; d = c; c = t; }
+    else if (lbc == maxlength) { t = a; a = b; b = c; c = t; }
+    else if (lbd == maxlength) { t = a; a = b; b = d; d = c; c = t; }
+    else if (lcd == maxlength) { t = a; a = c; c = t; t = b; b = d; d = t; }
+    else break;
+  }
+
+  newvertex(&a,&b,&e, lab, xs[idx[0]],ys[idx[0]],zs[idx[0]]);
+
+  /* columns inside acde go first, those inside bcde after them */
+  eax = a.x-e.x; eay = a.y-e.y; eaz = a.z-e.z;
+  ecx = c.x-e.x; ecy = c.y-e.y; ecz = c.z-e.z;
+  edx = d.x-e.x; edy = d.y-e.y; edz = d.z-e.z;
+  side = eax*ecy*edz+eay*ecz*edx+eaz*ecx*edy
+         -eaz*ecy*edx-eay*ecx*edz-eax*ecz*edy;
+  m = 0;
+  for (k=0; k<n; k++) {
+    epx = xs[idx[k]]-e.x; epy = ys[idx[k]]-e.y; epz = zs[idx[k]]-e.z;
+    if (side*(epx*ecy*edz+epy*ecz*edx+epz*ecx*edy
+              -epz*ecy*edx-epy*ecx*edz-epx*ecz*edy)>0.0) {
+      int i = idx[m]; idx[m++] = idx[k]; idx[k] = i;
     }
-  fclose(outfile);
+  }
+  if (m > 0) chunkdescent(c,d,a,e, xs,ys,zs, idx, m, level-1, heights);
+  if (m < n) chunkdescent(c,d,b,e, xs,ys,zs, idx+m, n-m, level-1, heights);
 }
 
-void printbmp(outfile) /* prints picture in BMP format */
-FILE *outfile;
+int planet_chunk(planet_state *planet, int face, int level, int i, int j,
+                 int n, double *heights)
 {
-  int i,j,c,s0, s, W1;
-
-  fprintf(outfile,"BM");
-
-  W1 = (3*Width+3);
-  W1 -= W1 % 4;
-  s0 = (strlen(cmdLine)+strlen("Command line:\n\n")+3) & 0xffc;
-  s = s0 + 54+W1*Height; /* file size */
-  putc(s&255,outfile);
-  putc((s>>8)&255,outfile);
-  putc((s>>16)&255,outfile);
-  putc(s>>24,outfile);
-
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(54,outfile); /* offset to data */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(40,outfile); /* size of infoheader */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(Width&255,outfile);
-  putc((Width>>8)&255,outfile);
-  putc((Width>>16)&255,outfile);
-  putc(Width>>24,outfile);
-
-  putc(Height&255,outfile);
-  putc((Height>>8)&255,outfile);
-  putc((Height>>16)&255,outfile);
-  putc(Height>>24,outfile);
-
-  putc(1,outfile);  /* no. of planes = 1 */
-  putc(0,outfile);
-
-  putc(24,outfile);  /* bpp */
-  putc(0,outfile);
-
-  putc(0,outfile); /* no compression */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* image size (unspecified) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* h. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* v. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* colours used (unspecified) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-
-  putc(0,outfile); /* important colours (all) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  if (doshade) {
-    for (j=Height-1; j>=0; j--) {
-      for (i=0; i<Width; i++) {
-        s =shades[i][j];
-        c = s*btable[col[i][j]]/150;
-        if (c>255) c=255;
-        putc(c,outfile);
-        c = s*gtable[col[i][j]]/150;
-        if (c>255) c=255;
-        putc(c,outfile);
-        c = s*rtable[col[i][j]]/150;
-        if (c>255) c=255;
-        putc(c,outfile);
-      }
-      for (i=3*Width; i<W1; i++) putc(0,outfile);
-    }
-  } else {
-    for (j=Height-1; j>=0; j--) {
-      for (i=0; i<Width; i++) {
-        putc(btable[col[i][j]],outfile);
-        putc(gtable[col[i][j]],outfile);
-        putc(rtable[col[i][j]],outfile);
-      }
-      for (i=3*Width; i<W1; i++) putc(0,outfile);
-    }
+  double *xs, *ys, *zs, cell, log_2();
+  int *idx, c, r, k, depth;
+  void facepoint(), chunkdescent();
+
+  if (face < 0 || face > 5 || level < 0 || level > 30 || n < 1
+      || i < 0 || j < 0 || i >= (1<<level) || j >= (1<<level))
+    return(PLANET_EPARAMS);
+
+  xs = (double*)malloc((size_t)n*n*sizeof(double));
+  ys = (double*)malloc((size_t)n*n*sizeof(double));
+  zs = (double*)malloc((size_t)n*n*sizeof(double));
+  idx = (int*)malloc((size_t)n*n*sizeof(int));
+  if (xs == NULL || ys == NULL || zs == NULL || idx == NULL) {
+    fprintf(stderr, "Memory allocation failed chunk.\n");
+    exit(1);
   }
 
-  fprintf(outfile,"Command line:\n%s\n",cmdLine);
+  cell = ldexp(2.0, -level);
+  for (r=k=0; r<n; r++)
+    for (c=0; c<n; c++, k++) {
+      facepoint(face, -1.0+cell*(i+(c+0.5)/n), -1.0+cell*(j+(r+0.5)/n),
+                &xs[k], &ys[k], &zs[k]);
+      idx[k] = k;
+    }
 
-  fclose(outfile);
+  /* Depth of a map with pixels as far apart as the columns */
+  depth = 3*((int)(log_2(ldexp((double)n, level))))+6;
+  M = planet->M; dd1 = planet->dd1; dd2 = planet->dd2;
+  doRainShadow = 0;
+  tracing = 0;
+  chunkdescent(planet->tetra[0], planet->tetra[1], planet->tetra[2],
+               planet->tetra[3], xs,ys,zs, idx, n*n, depth, heights);
+  for (k=0; k<n*n; k++) heights[k] += M;
+
+  free(xs); free(ys); free(zs); free(idx);
+  return(PLANET_OK);
 }
 
-void printbmpBW(outfile) /* prints picture in b/w BMP format */
-FILE *outfile;
+#ifndef NOTHREADS
+/* planet_stream() keeps the chunks near moving observers. Each call of */
+/* planet_observe() asks for the chunks near its observers, with the */
+/* distance an observer has to go to reach a chunk as its priority */
+/* (doubled behind the observer's view, and counting the way along its */
+/* velocity for the chunks it prefetches), and drops the chunks waiting */
+/* that were not asked for by it or the call before. Worker threads */
+/* make the chunks in order of priority, and the chunks used longest */
+/* ago are let go to stay under the memory cap. A chunk near several */
+/* observers is asked for and made once. */
+
+#define STREAMHASH 16384 /* buckets of the table of chunks */
+#define STREAMTIMES 4096 /* latencies kept for the percentiles */
+#define STREAMAHEAD 4    /* most places ahead of an observer to prefetch */
+
+#define ASKED 0
+#define MAKING 1
+#define KEPT 2
+
+typedef struct chunkentry
+{
+  int face, i, j, state;
+  double x, y, z;            /* centre on the sphere */
+  double priority;           /* lowest is made first */
+  long round;                /* planet_observe() that asked last */
+  int owner;                 /* observer that asked last */
+  double asked;              /* time first asked for */
+  int place;                 /* in queue, or -1 */
+  double *heights;           /* when KEPT */
+  struct chunkentry *next;   /* in the same bucket */
+  struct chunkentry *newer, *older; /* when KEPT, by last use */
+} chunkentry;
+
+struct planet_streamer
 {
-  int i,j,c,s,s0, W1;
-
-  fprintf(outfile,"BM");
-
-  W1 = (Width+31);
-  W1 -= W1 % 32;
-  s0 = (strlen(cmdLine)+strlen("Command line:\n\n")+3) & 0xffc;
-  s = s0 + 62+(W1*Height)/8; /* file size */
-  putc(s&255,outfile);
-  putc((s>>8)&255,outfile);
-  putc((s>>16)&255,outfile);
-  putc(s>>24,outfile);
-
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(62,outfile); /* offset to data */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(40,outfile); /* size of infoheader */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(Width&255,outfile);
-  putc((Width>>8)&255,outfile);
-  putc((Width>>16)&255,outfile);
-  putc(Width>>24,outfile);
-
-  putc(Height&255,outfile);
-  putc((Height>>8)&255,outfile);
-  putc((Height>>16)&255,outfile);
-  putc(Height>>24,outfile);
-
-  putc(1,outfile);  /* no. of planes = 1 */
-  putc(0,outfile);
-
-  putc(1,outfile);  /* bpp */
-  putc(0,outfile);
-
-  putc(0,outfile); /* no compression */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* image size (unspecified) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* h. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* v. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(2,outfile); /* colours used */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-
-  putc(2,outfile); /* important colours (2) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* colour 0 = black */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(255,outfile); /* colour 1 = white */
-  putc(255,outfile);
-  putc(255,outfile);
-  putc(255,outfile);
-
-  for (j=Height-1; j>=0; j--)
-    for (i=0; i<W1; i+=8) {
-      if (i<Width && col[i][j] >= WHITE)
-        c=128;
-      else c=0;
-      if (i+1<Width && col[i+1][j] >= WHITE)
-        c+=64;
-      if (i+2<Width && col[i+2][j] >= WHITE)
-        c+=32;
-      if (i+3<Width && col[i+3][j] >= WHITE)
-        c+=16;
-      if (i+4<Width && col[i+4][j] >= WHITE)
-        c+=8;
-      if (i+5<Width && col[i+5][j] >= WHITE)
-        c+=4;
-      if (i+6<Width && col[i+6][j] >= WHITE)
-        c+=2;
-      if (i+7<Width && col[i+7][j] >= WHITE)
-        c+=1;
-      putc(c,outfile);
-    }
-
-  fprintf(outfile,"Command line:\n%s\n",cmdLine);
+  planet_state *planet;
+  int level, n, nworkers, stop;
+  long maxbytes, bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_t *workers;
+  chunkentry *table[STREAMHASH];
+  chunkentry **queue;        /* heap by priority */
+  int nqueue, maxqueue, making, kept;
+  chunkentry *newest, *oldest;
+  long round, made, evicted, dropped, shared, hits, misses;
+  long nmade;
+  double makeTimes[STREAMTIMES], waitTimes[STREAMTIMES];
+};
 
-  fclose(outfile);
+double seconds() /* on a monotonic clock */
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec+1e-9*t.tv_nsec);
 }
 
-char *nletters(int n, int c)
+int chunkhash(face, i, j)
+int face, i, j;
 {
-  int i;
-  static char buffer[8];
+  return((int)(((unsigned)face*73856093u ^ (unsigned)i*19349663u
+                ^ (unsigned)j*83492791u) & (STREAMHASH-1)));
+}
 
-  buffer[n] = '\0';
+void queueswap(s, p, q)
+planet_streamer *s;
+int p, q;
+{
+  chunkentry *t = s->queue[p];
 
-  for (i = n-1; i >= 0; i--)
-  {
-    buffer[i] = letters[c & 0x001F];
-    c >>= 5;
+  s->queue[p] = s->queue[q]; s->queue[q] = t;
+  s->queue[p]->place = p; s->queue[q]->place = q;
+}
+
+void queuefix(s, p) /* moves entry p of the heap to its place */
+planet_streamer *s;
+int p;
+{
+  int c;
+
+  while (p > 0 && s->queue[p]->priority < s->queue[(p-1)/2]->priority) {
+    queueswap(s, p, (p-1)/2);
+    p = (p-1)/2;
   }
+  while ((c = 2*p+1) < s->nqueue) {
+    if (c+1 < s->nqueue && s->queue[c+1]->priority < s->queue[c]->priority)
+      c++;
+    if (s->queue[c]->priority >= s->queue[p]->priority) break;
+    queueswap(s, p, c);
+    p = c;
+  }
+}
 
-  return buffer;
+chunkentry *queuepop(s)
+planet_streamer *s;
+{
+  chunkentry *e = s->queue[0];
+
+  queueswap(s, 0, --s->nqueue);
+  if (s->nqueue > 0) queuefix(s, 0);
+  e->place = -1;
+  return(e);
 }
 
-void printxpm(outfile) /* prints picture in XPM (X-windows pixel map) format */
-FILE *outfile;
+void unkeep(s, e) /* takes kept chunk e out of the list by last use */
+planet_streamer *s;
+chunkentry *e;
+{
+  if (e->newer) e->newer->older = e->older; else s->newest = e->older;
+  if (e->older) e->older->newer = e->newer; else s->oldest = e->newer;
+  e->newer = e->older = NULL;
+}
+
+void keep(s, e) /* puts kept chunk e first in the list by last use */
+planet_streamer *s;
+chunkentry *e;
 {
-  int x,y,i,nbytes;
+  e->newer = NULL; e->older = s->newest;
+  if (s->newest) s->newest->newer = e; else s->oldest = e;
+  s->newest = e;
+}
 
-  x = nocols - 1;
-  for (nbytes = 0; x != 0; nbytes++)
-    x >>= 5;
+void forget(s, e) /* takes e out of the table and frees it */
+planet_streamer *s;
+chunkentry *e;
+{
+  chunkentry **p = &s->table[chunkhash(e->face, e->i, e->j)];
 
-  fprintf(outfile,"/* XPM */\n");
-  fprintf(outfile,"/* Command line: */\n/* %s*/\n",cmdLine);
-  fprintf(outfile,"static char *xpmdata[] = {\n");
-  fprintf(outfile,"/* width height ncolors chars_per_pixel */\n");
-  fprintf(outfile,"\"%d %d %d %d\",\n", Width, Height, nocols, nbytes);
-  fprintf(outfile,"/* colors */\n");
-  for (i = 0; i < nocols; i++)
-    fprintf(outfile,"\"%s c #%2.2X%2.2X%2.2X\",\n", 
-            nletters(nbytes, i), rtable[i], gtable[i], btable[i]);
+  while (*p != e) p = &(*p)->next;
+  *p = e->next;
+  free(e->heights);
+  free(e);
+}
 
-  fprintf(outfile,"/* pixels */\n");
-  for (y = 0 ; y < Height; y++) {
-    fprintf(outfile,"\"");
-    for (x = 0; x < Width; x++)
-      fprintf(outfile, "%s", nletters(nbytes, col[x][y]));
-    fprintf(outfile,"\",\n");
+chunkentry *findchunk(s, face, i, j, make) /* entry of chunk (face,i,j) */
+planet_streamer *s;                          /* made if not there and make */
+int face, i, j, make;
+{
+  int h = chunkhash(face, i, j);
+  chunkentry *e = s->table[h];
+  double cell;
+  void facepoint();
+
+  while (e != NULL && (e->face != face || e->i != i || e->j != j))
+    e = e->next;
+  if (e == NULL && make) {
+    e = (chunkentry*)calloc(1, sizeof(chunkentry));
+    if (e == NULL) {
+      fprintf(stderr, "Memory allocation failed stream.\n");
+      exit(1);
+    }
+    e->face = face; e->i = i; e->j = j; e->state = ASKED;
+    cell = ldexp(2.0, -s->level);
+    facepoint(face, -1.0+cell*(i+0.5), -1.0+cell*(j+0.5), &e->x,&e->y,&e->z);
+    e->round = -1; e->owner = -1; e->asked = seconds(); e->place = -1;
+    e->next = s->table[h];
+    s->table[h] = e;
   }
-  fprintf(outfile,"};\n");
-
-  fclose(outfile);
+  return(e);
 }
 
-void printxpmBW(outfile) /* prints picture in XPM (X-windows pixel map) format */
-FILE *outfile;
+void askchunk(s, e, priority, owner) /* asks for e in this round */
+planet_streamer *s;
+chunkentry *e;
+double priority;
+int owner;
 {
-  int x,y,nbytes;
+  if (e->round != s->round) {
+    e->round = s->round; e->owner = owner; e->priority = priority;
+  } else {
+    if (e->owner != owner && owner >= 0) { s->shared++; e->owner = owner; }
+    if (priority < e->priority) e->priority = priority;
+  }
+  if (e->state == KEPT) { /* used again */
+    unkeep(s, e);
+    keep(s, e);
+  } else if (e->state == ASKED) {
+    if (e->place < 0) {
+      if (s->nqueue == s->maxqueue) {
+        s->maxqueue = 2*s->maxqueue+64;
+        s->queue = (chunkentry**)
+          realloc(s->queue, s->maxqueue*sizeof(chunkentry*));
+        if (s->queue == NULL) {
+          fprintf(stderr, "Memory allocation failed stream.\n");
+          exit(1);
+        }
+      }
+      e->place = s->nqueue++;
+      s->queue[e->place] = e;
+      pthread_cond_signal(&s->work);
+    }
+    queuefix(s, e->place);
+  }
+}
 
-  x = nocols - 1;
-  nbytes = 1;
+void facecell(x, y, z, level, face, i, j) /* chunk under point (x,y,z) */
+double x, y, z;
+int level, *face, *i, *j;
+{
+  double ax = fabs(x), ay = fabs(y), az = fabs(z), u, v;
+  int cells = 1<<level;
 
-  fprintf(outfile,"/* XPM */\n");
-  fprintf(outfile,"/* Command line: */\n/* %s*/\n",cmdLine);
-  fprintf(outfile,"static char *xpmdata[] = {\n");
-  fprintf(outfile,"/* width height ncolors chars_per_pixel */\n");
-  fprintf(outfile,"\"%d %d %d %d\",\n", Width, Height, 2, nbytes);
-  fprintf(outfile,"/* colors */\n");
+  if (ax >= ay && ax >= az) {
+    *face = x < 0.0; u = z/ax; v = y/ax;
+  } else if (ay >= az) {
+    *face = 2 + (y < 0.0); u = x/ay; v = z/ay;
+  } else {
+    *face = 4 + (z < 0.0); u = x/az; v = y/az;
+  }
+  *i = (int)(0.5*(u+1.0)*cells);
+  *j = (int)(0.5*(v+1.0)*cells);
+  if (*i >= cells) *i = cells-1;
+  if (*j >= cells) *j = cells-1;
+}
 
-  fprintf(outfile,"\". c #FFFFFF\",\n");
-  fprintf(outfile,"\"X c #000000\",\n");
+/* asks for the chunks within the radius of observer k around (x,y,z) */
+/* on the sphere, with the distance from there plus ahead as priority */
+void askaround(s, o, k, x, y, z, ahead)
+planet_streamer *s;
+const planet_observer *o;
+int k;
+double x, y, z, ahead;
+{
+  double l, ux, uy, uz, wx, wy, wz, step, a, b, qx, qy, qz, d;
+  int face, i, j, lastface = -1, lasti = -1, lastj = -1, m, n, steps;
+  chunkentry *e;
+
+  /* u and w span the tangent plane at (x,y,z) */
+  if (fabs(y) < 0.9) { ux = z; uy = 0.0; uz = -x; }
+  else { ux = 0.0; uy = -z; uz = y; }
+  l = sqrt(ux*ux+uy*uy+uz*uz);
+  ux /= l; uy /= l; uz /= l;
+  wx = y*uz-z*uy; wy = z*ux-x*uz; wz = x*uy-y*ux;
+
+  /* a quarter of a cell in the middle of a face; the cells are still */
+  /* 0.47 as wide at the corners, so the grid hits every cell however */
+  /* it is turned */
+  step = ldexp(1.0, -s->level)/2.0;
+  l = tan(o->radius < 1.5 ? o->radius : 1.5);
+  steps = (int)(l/step)+1;
+  for (m=-steps; m<=steps; m++)
+    for (n=-steps; n<=steps; n++) {
+      a = m*step; b = n*step;
+      if (a*a+b*b > l*l) continue;
+      qx = x+a*ux+b*wx; qy = y+a*uy+b*wy; qz = z+a*uz+b*wz;
+      facecell(qx, qy, qz, s->level, &face, &i, &j);
+      if (face == lastface && i == lasti && j == lastj) continue;
+      lastface = face; lasti = i; lastj = j;
+      e = findchunk(s, face, i, j, 1);
+      d = x*e->x+y*e->y+z*e->z;
+      d = acos(d > 1.0 ? 1.0 : d);
+      if ((e->x-x)*o->dx+(e->y-y)*o->dy+(e->z-z)*o->dz < 0.0)
+        d *= 2.0; /* behind the view */
+      askchunk(s, e, ahead+d, k);
+    }
+}
 
-  fprintf(outfile,"/* pixels */\n");
-  for (y = 0 ; y < Height; y++) {
-    fprintf(outfile,"\"");
-    for (x = 0; x < Width; x++)
-      fprintf(outfile, "%s",
-              (col[x][y] < WHITE)
-              ? "X" : ".");
-    fprintf(outfile,"\",\n");
+void *chunkworker(arg) /* makes the chunks of the queue */
+void *arg;
+{
+  planet_streamer *s = (planet_streamer*)arg;
+  chunkentry *e, *o;
+  double *heights, t0, t1;
+  long size = (long)s->n*s->n*sizeof(double);
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (!s->stop && s->nqueue == 0) pthread_cond_wait(&s->work, &s->lock);
+    if (s->stop) break;
+    e = queuepop(s);
+    e->state = MAKING;
+    s->making++;
+    pthread_mutex_unlock(&s->lock);
+
+    heights = (double*)malloc(size);
+    if (heights == NULL) {
+      fprintf(stderr, "Memory allocation failed stream.\n");
+      exit(1);
+    }
+    t0 = seconds();
+    planet_chunk(s->planet, e->face, s->level, e->i, e->j, s->n, heights);
+    t1 = seconds();
+
+    pthread_mutex_lock(&s->lock);
+    s->making--;
+    e->heights = heights;
+    e->state = KEPT;
+    keep(s, e);
+    s->kept++;
+    s->bytes += size;
+    s->makeTimes[s->nmade%STREAMTIMES] = t1-t0;
+    s->waitTimes[s->nmade%STREAMTIMES] = t1-e->asked;
+    s->nmade++;
+    while (s->bytes > s->maxbytes && (o = s->oldest) != e) {
+      unkeep(s, o);
+      s->kept--;
+      s->bytes -= size;
+      s->evicted++;
+      forget(s, o);
+    }
   }
-  fprintf(outfile,"};\n");
+  pthread_mutex_unlock(&s->lock);
+  return(NULL);
+}
 
-  fclose(outfile);
+planet_streamer *planet_stream(planet_state *planet, int level, int n,
+                               int workers, long maxbytes)
+{
+  planet_streamer *s;
+  int k;
+  void *chunkworker();
+
+  if (level < 0 || level > 30 || n < 1 || workers < 1) return(NULL);
+  s = (planet_streamer*)calloc(1, sizeof(planet_streamer));
+  if (s == NULL) return(NULL);
+  s->planet = planet; s->level = level; s->n = n;
+  s->maxbytes = maxbytes;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  s->workers = (pthread_t*)malloc(workers*sizeof(pthread_t));
+  if (s->workers == NULL) { free(s); return(NULL); }
+  for (k=0; k<workers; k++)
+    if (pthread_create(&s->workers[k], NULL, chunkworker, s) != 0) break;
+  s->nworkers = k;
+  if (k == 0) { free(s->workers); free(s); return(NULL); }
+  return(s);
 }
 
-void printheights(outfile) /* prints heightfield */
-FILE *outfile;
+void planet_observe(planet_streamer *s, int n, const planet_observer *o)
 {
-  int i,j;
+  int k, m, ahead, waiting;
+  double x, y, z, px, py, pz, l, speed, way, along;
+  chunkentry *e;
+
+  pthread_mutex_lock(&s->lock);
+  s->round++;
+  for (k=0; k<n; k++) {
+    l = sqrt(o[k].x*o[k].x+o[k].y*o[k].y+o[k].z*o[k].z);
+    if (l == 0.0) continue;
+    x = o[k].x/l; y = o[k].y/l; z = o[k].z/l;
+    askaround(s, &o[k], k, x, y, z, 0.0);
+    /* prefetch at places no more than a radius apart on the way */
+    speed = sqrt(o[k].vx*o[k].vx+o[k].vy*o[k].vy+o[k].vz*o[k].vz);
+    way = speed*o[k].lookahead;
+    if (way <= 0.0 || o[k].radius <= 0.0) continue;
+    if (way > 1.5) way = 1.5;
+    ahead = (int)ceil(way/o[k].radius);
+    if (ahead > STREAMAHEAD) ahead = STREAMAHEAD;
+    for (m=1; m<=ahead; m++) {
+      along = way*m/ahead;
+      px = x+o[k].vx/speed*tan(along);
+      py = y+o[k].vy/speed*tan(along);
+      pz = z+o[k].vz/speed*tan(along);
+      l = sqrt(px*px+py*py+pz*pz);
+      askaround(s, &o[k], k, px/l, py/l, pz/l, along);
+    }
+  }
 
-  for (j=0; j<Height; j++) {
-    for (i=0; i<Width; i++)
-      fprintf(outfile,"%d ",heights[i][j]);
-    putc('\n',outfile);
+  /* drop the chunks no longer near an observer, and heap up the rest */
+  waiting = s->nqueue;
+  for (k=s->nqueue=0; k<waiting; k++) {
+    e = s->queue[k];
+    if (e->round < s->round-1) {
+      s->dropped++;
+      forget(s, e);
+    } else {
+      s->queue[s->nqueue] = e;
+      e->place = s->nqueue++;
+      queuefix(s, e->place);
+    }
   }
-  fclose(outfile);
+  pthread_mutex_unlock(&s->lock);
 }
 
-double log_2(x)
-double x;
-{ return(log(x)/log(2.0)); }
+int planet_fetch(planet_streamer *s, int face, int i, int j, double *heights)
+{
+  chunkentry *e;
+  int found = 0;
+
+  if (face < 0 || face > 5 || i < 0 || j < 0
+      || i >= (1<<s->level) || j >= (1<<s->level)) return(0);
+  pthread_mutex_lock(&s->lock);
+  e = findchunk(s, face, i, j, 1);
+  if (e->state == KEPT) {
+    memcpy(heights, e->heights, (size_t)s->n*s->n*sizeof(double));
+    found = 1;
+    s->hits++;
+  } else s->misses++;
+  askchunk(s, e, -1.0, -1); /* before all others if not kept */
+  pthread_mutex_unlock(&s->lock);
+  return(found);
+}
 
-void print_error(char *filename, char *ext)
+int byseconds(const void *a, const void *b)
+{
+  double ta = *(double*)a, tb = *(double*)b;
+
+  return((ta > tb) - (ta < tb));
+}
+
+void planet_stats(planet_streamer *s, planet_stream_stats *stats)
+{
+  double times[STREAMTIMES];
+  long n;
+
+  pthread_mutex_lock(&s->lock);
+  stats->queued = s->nqueue;
+  stats->making = s->making;
+  stats->kept = s->kept;
+  stats->bytes = s->bytes;
+  stats->made = s->nmade;
+  stats->evicted = s->evicted;
+  stats->dropped = s->dropped;
+  stats->shared = s->shared;
+  stats->hits = s->hits;
+  stats->misses = s->misses;
+  stats->hitRate = s->hits+s->misses > 0 ?
+    (double)s->hits/(s->hits+s->misses) : 0.0;
+  n = s->nmade < STREAMTIMES ? s->nmade : STREAMTIMES;
+  stats->make50 = stats->make99 = stats->wait50 = stats->wait99 = 0.0;
+  if (n > 0) {
+    memcpy(times, s->makeTimes, n*sizeof(double));
+    qsort(times, n, sizeof(double), byseconds);
+    stats->make50 = 1000.0*times[n/2];
+    stats->make99 = 1000.0*times[(n*99)/100];
+    memcpy(times, s->waitTimes, n*sizeof(double));
+    qsort(times, n, sizeof(double), byseconds);
+    stats->wait50 = 1000.0*times[n/2];
+    stats->wait99 = 1000.0*times[(n*99)/100];
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+void planet_unstream(planet_streamer *s)
+{
+  int k;
+  chunkentry *e, *next;
+
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+  for (k=0; k<s->nworkers; k++) pthread_join(s->workers[k], NULL);
+  for (k=0; k<STREAMHASH; k++)
+    for (e = s->table[k]; e != NULL; e = next) {
+      next = e->next;
+      free(e->heights);
+      free(e);
+    }
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->work);
+  free(s->queue);
+  free(s->workers);
+  free(s);
+}
+#endif
+
+
+void writecache(name) /* saves sea-level cache of rendered points */
+char *name;
+{
+  FILE *cf;
+  int i,j, head[4];
+  double *hc;
+
+  /* points planet0() never saw keep their colour and shade */
+  for (j=0; j<Height; j++)
+    for (i=0; i<Width; i++) {
+      hc = hcache+HCACHE*((long)j*Width+i);
+      if (hc[0] == NOPOINT) {
+        hc[1] = COL(i,j);
+        hc[5] = doshade>0 ? SHADES(i,j) : 0;
+      }
+    }
+
+  if (NULL == (cf = fopen(name,"wb"))) {
+    fprintf(stderr, "Could not open cache file %s, error code = %d\n",
+            name, errno);
+    exit(1);
+  }
+  head[0] = Width; head[1] = Height; head[2] = doshade; head[3] = matchMap;
+  fwrite("PLNTSEA1",1,8,cf);
+  fwrite(head,sizeof(int),4,cf);
+  fwrite(&M,sizeof(double),1,cf);
+  fwrite(hcache,sizeof(double),(size_t)Width*Height*HCACHE,cf);
+  fclose(cf);
+}
+
+void readcache(name) /* reads sea-level cache made with -K */
+char *name;
+{
+  FILE *cf;
+  char magic[8];
+  int head[4];
+  double M0;
+  size_t n;
+
+  if (NULL == (cf = fopen(name,"rb"))) {
+    fprintf(stderr, "Cannot open cache file %s\n", name);
+    exit(1);
+  }
+  if (fread(magic,1,8,cf) != 8 || strncmp(magic,"PLNTSEA1",8) != 0 ||
+      fread(head,sizeof(int),4,cf) != 4 || fread(&M0,sizeof(double),1,cf) != 1) {
+    fprintf(stderr, "%s is not a sea-level cache\n", name);
+    exit(1);
+  }
+  Width = head[0]; Height = head[1];
+  if (head[2] != doshade)
+    fprintf(stderr, "Warning: cache was made with different shading\n");
+  if (head[3] && M0 != M)
+    fprintf(stderr, "Warning: matched map (-M) heights do not follow M\n");
+
+  n = (size_t)Width*Height*HCACHE;
+  hcache = (double*)malloc(n*sizeof(double));
+  if (hcache == 0) {
+    fprintf(stderr, "Memory allocation failed hcache.");
+    exit(1);
+  }
+  if (fread(hcache,sizeof(double),n,cf) != n) {
+    fprintf(stderr, "Cache file %s is truncated\n", name);
+    exit(1);
+  }
+  fclose(cf);
+}
+
+void recolour() /* colours points from sea-level cache with current M */
+{
+  int i,j;
+  double *hc;
+  void colourpoint();
+
+  /* no rain shadow, as -k is not used with -r, -z or -Z */
+  for (j=0; j<Height; j++)
+    for (i=0; i<Width; i++) {
+      hc = hcache+HCACHE*((long)j*Width+i);
+      if (hc[0] == NOPOINT) {
+        COL(i,j) = (colno)hc[1];
+        if (doshade>0) SHADES(i,j) = (unsigned short)hc[5];
+      } else {
+        shade = (int)hc[5];
+        colourpoint(hc[0]+M, hc[1],hc[2],hc[3], i,j);
+      }
+    }
+}
+
+void facepoint(f, u, v, x, y, z) /* point on the sphere under (u,v) */
+int f;                            /* of face f of the cube, with u and */
+double u, v, *x, *y, *z;          /* v from -1 to 1 */
+{
+  double r = 1.0/sqrt(1.0+u*u+v*v);
+
+  /* faces 0-5 are x = 1, x = -1, y = 1, y = -1, z = 1, z = -1 */
+  switch (f/2) {
+    case 0: *x = (f&1) ? -r : r; *y = v*r; *z = u*r; break;
+    case 1: *y = (f&1) ? -r : r; *x = u*r; *z = v*r; break;
+    default: *z = (f&1) ? -r : r; *x = u*r; *y = v*r; break;
+  }
+}
+
+#define CUBEPARAMS 12 /* parameters a cube map file is made with */
+
+void cubeparams(p) /* sets p to what the texels of a cube map depend on */
+double p[CUBEPARAMS];
+{
+  int i, j;
+
+  p[0] = rseed; p[1] = M; /* (M decides which vertices get rain shadow) */
+  p[2] = dd1; p[3] = dd2; p[4] = POWA; p[5] = POW;
+  p[6] = shade_angle; p[7] = shade_angle2;
+  p[8] = rotate1; p[9] = rotate2;
+  p[10] = matchMap ? matchSize : 0.0;
+  p[11] = 0.0; /* checksum of the matched map */
+  if (matchMap)
+    for (i=0; i<60; i++)
+      for (j=0; j<30; j++) p[11] += cl0[i][j]*(double)(30*i+j+1);
+}
+
+void makecube() /* reads cube map from cubeFile or evaluates it */
+{
+  FILE *cf;
+  char magic[8];
+  int f, a, b, head[4], save = 0, big;
+  long n;
+  double u, v, x, y, z, pixel, planet1();
+  double params[CUBEPARAMS], made[CUBEPARAMS];
+  float *t;
+  void facepoint(), cubeparams();
+
+  cubeparams(params);
+  if (cubeFile != NULL && (cf = fopen(cubeFile,"rb")) != NULL) {
+    if (fread(magic,1,8,cf) != 8 || strncmp(magic,"PLNTCUB2",8) != 0
+        || fread(head,sizeof(int),4,cf) != 4
+        || fread(made,sizeof(double),CUBEPARAMS,cf) != CUBEPARAMS) {
+      fprintf(stderr, "%s is not a cube map file\n", cubeFile);
+      exit(1);
+    }
+    if (head[1] != doshade || head[2] != doRainShadow || head[3] != matchMap
+        || memcmp(made, params, sizeof(params)) != 0) {
+      fprintf(stderr, "Cube map %s was made with other seed or options\n",
+              cubeFile);
+      exit(1);
+    }
+    cubeN = head[0];
+  } else {
+    cf = NULL;
+    save = (cubeFile != NULL);
+    if (cubeError <= 0.0) cubeError = 1.0;
+    /* angle of a map pixel (at the centre) */
+    big = (view == 'o' || view == 's' || view == 'g' || view == 'a'
+           || view == 'h');
+    pixel = big ? 2.0/(Height*scale) : 2.0*PI/(Width*scale);
+    /* a texel at the centre of a face covers 2/cubeN radians */
+    cubeN = (int)ceil(2.0/(cubeError*pixel));
+    if (cubeN < 2) cubeN = 2;
+    if (cubeN > 8192) {
+      fprintf(stderr, "Cube map limited to 8192 x 8192 per face\n");
+      cubeN = 8192;
+    }
+  }
+
+  n = 6L*cubeN*cubeN;
+  cube = (float*)malloc(n*CUBE*sizeof(float));
+  if (cube == 0) {
+    fprintf(stderr, "Memory allocation failed cube.");
+    exit(1);
+  }
+
+  if (cf != NULL) {
+    if (fread(cube,sizeof(float),n*CUBE,cf) != n*CUBE) {
+      fprintf(stderr, "Cube map file %s is too short\n", cubeFile);
+      exit(1);
+    }
+    fclose(cf);
+    return;
+  }
+
+  rainShadow = 0.0; shade = 255;
+  t = cube;
+  for (f=0; f<6; f++) {
+    if (debug) {fprintf (stderr, "%d", f); fflush(stderr);}
+    for (b=0; b<cubeN; b++)
+      for (a=0; a<cubeN; a++) {
+        u = 2.0*(a+0.5)/cubeN-1.0;
+        v = 2.0*(b+0.5)/cubeN-1.0;
+        facepoint(f, u, v, &x, &y, &z);
+        t[0] = planet1(x,y,z);
+        t[1] = rainShadow;
+        t[2] = shade;
+        t += CUBE;
+      }
+  }
+
+  if (save) {
+    if (NULL == (cf = fopen(cubeFile,"wb"))) {
+      fprintf(stderr, "Could not open cube map file %s, error code = %d\n",
+              cubeFile, errno);
+      exit(1);
+    }
+    head[0] = cubeN; head[1] = doshade; head[2] = doRainShadow;
+    head[3] = matchMap;
+    fwrite("PLNTCUB2",1,8,cf);
+    fwrite(head,sizeof(int),4,cf);
+    fwrite(params,sizeof(double),CUBEPARAMS,cf);
+    fwrite(cube,sizeof(float),n*CUBE,cf);
+    fclose(cf);
+  }
+}
+
+double cubepoint(x,y,z) /* resamples cube map at (x,y,z) */
+double x,y,z;
+{
+  int f, a, b;
+  double ax = fabs(x), ay = fabs(y), az = fabs(z), u, v, fu, fv;
+  float *t, *t0, *t1;
+  long row = (long)cubeN*CUBE;
+
+  /* project onto the face of the largest coordinate */
+  if (ax >= ay && ax >= az) {
+    f = x < 0.0; u = z/ax; v = y/ax;
+  } else if (ay >= az) {
+    f = 2 + (y < 0.0); u = x/ay; v = z/ay;
+  } else {
+    f = 4 + (z < 0.0); u = x/az; v = y/az;
+  }
+  /* bilinear interpolation between the four nearest texel centres */
+  u = 0.5*(u+1.0)*cubeN-0.5;
+  v = 0.5*(v+1.0)*cubeN-0.5;
+  /* (also catches NaN from points rounded just off the sphere) */
+  if (!(u >= 0.0)) u = 0.0; else if (u > cubeN-1) u = cubeN-1;
+  if (!(v >= 0.0)) v = 0.0; else if (v > cubeN-1) v = cubeN-1;
+  a = (int)u; b = (int)v;
+  if (a > cubeN-2) a = cubeN-2;
+  if (b > cubeN-2) b = cubeN-2;
+  fu = u-a; fv = v-b;
+  t = cube+((long)f*cubeN*cubeN+(long)b*cubeN+a)*CUBE;
+  t0 = t; t1 = t+row;
+  rainShadow = (1.0-fv)*((1.0-fu)*t0[1]+fu*t0[CUBE+1])
+               + fv*((1.0-fu)*t1[1]+fu*t1[CUBE+1]);
+  shade = (int)((1.0-fv)*((1.0-fu)*t0[2]+fu*t0[CUBE+2])
+                + fv*((1.0-fu)*t1[2]+fu*t1[CUBE+2]) + 0.5);
+  return (1.0-fv)*((1.0-fu)*t0[0]+fu*t0[CUBE])
+         + fv*((1.0-fu)*t1[0]+fu*t1[CUBE]);
+}
+
+void seedtetra() /* sets the tetrahedron's seeds from rseed */
+{
+  int i;
+  double rand2();
+
+  r1 = rseed;
+
+  r1 = rand2(r1,r1);
+  r2 = rand2(r1,r1);
+  r3 = rand2(r1,r2);
+  r4 = rand2(r2,r3);
+
+  tetra[0].s = r1;
+  tetra[1].s = r2;
+  tetra[2].s = r3;
+  tetra[3].s = r4;
+
+  /* altitudes are relative to M, which planet0() adds back */
+  tetra[0].h = 0.0;
+  tetra[1].h = 0.0;
+  tetra[2].h = 0.0;
+  tetra[3].h = 0.0;
+
+  tetra[0].shadow = 0.0;
+  tetra[1].shadow = 0.0;
+  tetra[2].shadow = 0.0;
+  tetra[3].shadow = 0.0;
+
+  for (i=0; i<4; i++) tetra[i].id = i;
+
+  /* forget the cached tetrahedron of any earlier seed */
+  /* (a flat tetrahedron contains no points) */
+  ssa = ssb = ssc = ssd = tetra[0];
+}
+
+void screenseed(seed, r) /* screens planet of seed */
+double seed;
+screening *r;
+{
+  int k, b;
+  long land = 0;
+  double x, y, z, phi, alt, temp, rain, sum = 0.0, sum2 = 0.0;
+  double planet1();
+  void seedtetra(), climate();
+  char *c, biomeletter();
+
+  rseed = seed;
+  seedtetra();
+  memset(r, 0, sizeof(screening));
+  r->seed = seed;
+  r->tMin = 1000.0; r->tMax = -1000.0;
+  for (k=0; k<SCREENPOINTS; k++) {
+    /* spiral of points that each have the same area around them */
+    y = 1.0-(2.0*k+1.0)/SCREENPOINTS;
+    phi = k*PI*(3.0-sqrt(5.0));
+    x = sqrt(1.0-y*y)*cos(phi);
+    z = sqrt(1.0-y*y)*sin(phi);
+    alt = planet1(x,y,z)+M;
+    climate(alt, y, &temp, &rain);
+    sum += alt; sum2 += alt*alt;
+    b = (int)floor((alt+0.1)/0.2*HYPSO);
+    r->hypso[(b < 0) ? 0 : (b >= HYPSO) ? HYPSO-1 : b]++;
+    if (alt > 0.0) { /* as in colourpoint() and altcolour() */
+      land++;
+      if (temp<r->tMin) r->tMin = temp;
+      if (temp>r->tMax) r->tMax = temp;
+      if ((c = strchr(biomeLetters, biomeletter(alt, temp, rain))) != NULL)
+        r->biome[c-biomeLetters]++;
+    }
+  }
+  r->land = (double)land/SCREENPOINTS;
+  r->mean = sum/SCREENPOINTS;
+  r->spread = sqrt(fabs(sum2/SCREENPOINTS-r->mean*r->mean));
+}
+
+int closerland(a, b) /* orders screenings by distance to landTarget */
+const void *a, *b;
+{
+  double da = fabs(((screening*)a)->land-landTarget);
+  double db = fabs(((screening*)b)->land-landTarget);
+  return((da < db) ? -1 : (da > db) ? 1 : 0);
+}
+
+void screenseeds(outfile) /* screens seeds of -u and lists them */
+FILE *outfile;
+{
+  int n = screenSeeds, k, w, b, land;
+  screening *r;
+  double p, seed0 = rseed;
+  double log_2();
+  void screenseed();
+  int closerland();
+
+  /* points are as far apart as pixels of a map of SCREENPOINTS pixels */
+  Depth = 3*((int)(log_2(sqrt((double)SCREENPOINTS))))+6;
+
+#if !defined(WIN32) && !defined(_WIN32)
+  /* results are shared with the workers */
+  r = (screening*)mmap(NULL, n*sizeof(screening), PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (r == MAP_FAILED) r = 0;
+#else
+  r = (screening*)malloc(n*sizeof(screening));
+#endif
+  if (r == 0) {
+    fprintf(stderr, "Memory allocation failed screening.");
+    exit(1);
+  }
+
+#if !defined(WIN32) && !defined(_WIN32)
+  fflush(outfile);
+  for (w=1; w<workers; w++) /* each process takes every workers'th seed */
+    if (fork() == 0) break;
+  if (w == workers) w = 0; /* the parent is worker 0 */
+#else
+  w = 0; workers = 1;
+#endif
+
+  for (k=w; k<n; k+=workers) screenseed(seed0+k*screenStep, &r[k]);
+
+#if !defined(WIN32) && !defined(_WIN32)
+  if (w != 0) _exit(0);
+  while (wait(NULL) > 0) ; /* wait for the other workers */
+#endif
+
+  qsort(r, n, sizeof(screening), closerland);
+
+  /* 95% confidence bounds of fractions of SCREENPOINTS points */
+  fprintf(outfile, "# %d points per seed, land target %.3f\n",
+          SCREENPOINTS, landTarget);
+  fprintf(outfile, "# seed land +- mean spread tempMin tempMax"
+          " | %% of points per 0.02 of altitude from -0.1 to 0.1"
+          " | %% of land per biome +-\n");
+  for (k=0; k<n; k++) {
+    p = r[k].land;
+    fprintf(outfile, "%.6f %.4f %.4f %.4f %.4f %.4f %.4f |",
+            r[k].seed, p, 1.96*sqrt(p*(1.0-p)/SCREENPOINTS),
+            r[k].mean, r[k].spread, r[k].tMin, r[k].tMax);
+    for (b=0; b<HYPSO; b++)
+      fprintf(outfile, " %.1f", 100.0*r[k].hypso[b]/SCREENPOINTS);
+    fprintf(outfile, " |");
+    land = (int)(p*SCREENPOINTS+0.5);
+    for (b=0; b<NBIOMES; b++) {
+      p = (land > 0) ? (double)r[k].biome[b]/land : 0.0;
+      fprintf(outfile, " %c %.1f %.1f", biomeLetters[b], 100.0*p,
+              (land > 0) ? 196.0*sqrt(p*(1.0-p)/land) : 0.0);
+    }
+    fprintf(outfile, "\n");
+  }
+  fclose(outfile);
+}
+
+void *growarray(p, n, max, size) /* makes room for n elements */
+void *p;
+long n, *max;
+size_t size;
+{
+  if (n > *max) {
+    *max = 2*n+1024;
+    p = realloc(p, (size_t)*max*size);
+    if (p == 0) {
+      fprintf(stderr, "Memory allocation failed for traversal record.");
+      exit(1);
+    }
+  }
+  return(p);
+}
+
+void tracepoint(x,y,z, i,j) /* starts recording traversal of a point */
+double x,y,z;
+int i,j;
+{
+  trace *t;
+
+  traces = (trace*)growarray(traces, ntraces+1, &maxtraces, sizeof(trace));
+  t = &traces[ntraces++];
+  t->first = ntsteps; t->n = 0;
+  t->i = i; t->j = j;
+  t->x = x; t->y = y; t->z = z;
+}
+
+int tracestep(a, b) /* records subdivision of edge ab */
+vertex *a, *b;
+{
+  trace *t = &traces[ntraces-1];
+  step *st;
+
+  if (4+t->n >= TMAXV) {
+    fprintf(stderr, "Depth too large for traversal record\n");
+    exit(1);
+  }
+  tsteps = (step*)growarray(tsteps, ntsteps+1, &maxtsteps, sizeof(step));
+  st = &tsteps[ntsteps];
+  st->a = a->id; st->b = b->id;
+  ntsteps++;
+  return(4+t->n++);
+}
+
+void tracelast(a,b,c,d) /* records final tetrahedron of traversal */
+vertex *a, *b, *c, *d;
+{
+  trace *t = &traces[ntraces-1];
+
+  t->last[0] = a->id; t->last[1] = b->id;
+  t->last[2] = c->id; t->last[3] = d->id;
+}
+
+void writetrace(name) /* saves recorded traversals and background */
+char *name;
+{
+  FILE *tf;
+  int i,j, head[3];
+  long counts[2];
+  unsigned short *row;
+
+  if (NULL == (tf = fopen(name,"wb"))) {
+    fprintf(stderr, "Could not open trace file %s, error code = %d\n",
+            name, errno);
+    exit(1);
+  }
+  head[0] = Width; head[1] = Height;
+  head[2] = doshade;
+  counts[0] = ntraces; counts[1] = ntsteps;
+  fwrite("PLNTTRC2",1,8,tf);
+  fwrite(head,sizeof(int),3,tf);
+  fwrite(counts,sizeof(long),2,tf);
+  fwrite(tetra,sizeof(vertex),4,tf);
+  fwrite(traces,sizeof(trace),ntraces,tf);
+  fwrite(tsteps,sizeof(step),ntsteps,tf);
+
+  /* colours and shades of points that were not traversed */
+  row = (unsigned short*)malloc(Width*sizeof(unsigned short));
+  for (j=0; j<Height; j++) {
+    for (i=0; i<Width; i++) row[i] = COL(i,j);
+    fwrite(row,sizeof(unsigned short),Width,tf);
+  }
+  if (doshade>0)
+    for (j=0; j<Height; j++) {
+      for (i=0; i<Width; i++) row[i] = SHADES(i,j);
+      fwrite(row,sizeof(unsigned short),Width,tf);
+    }
+  free(row);
+  fclose(tf);
+}
+
+unsigned short *tcol, *tshades; /* background read with trace */
+vertex ttetra[4]; /* tetrahedron the recorded traversals start from */
+
+void readtrace(name) /* reads traversals recorded with -Y */
+char *name;
+{
+  FILE *tf;
+  char magic[8];
+  int head[3], ok;
+  long counts[2];
+  size_t n;
+
+  if (NULL == (tf = fopen(name,"rb"))) {
+    fprintf(stderr, "Cannot open trace file %s\n", name);
+    exit(1);
+  }
+  if (fread(magic,1,8,tf) != 8 || strncmp(magic,"PLNTTRC2",8) != 0 ||
+      fread(head,sizeof(int),3,tf) != 3 || fread(counts,sizeof(long),2,tf) != 2
+      || fread(ttetra,sizeof(vertex),4,tf) != 4) {
+    fprintf(stderr, "%s is not a traversal record\n", name);
+    exit(1);
+  }
+  Width = head[0]; Height = head[1];
+  if (head[2] != doshade) {
+    fprintf(stderr, "Traversal record was made with different -B/-b/-d\n");
+    exit(1);
+  }
+  ntraces = counts[0]; ntsteps = counts[1];
+  n = (size_t)Width*Height;
+  traces = (trace*)malloc(ntraces*sizeof(trace)+1);
+  tsteps = (step*)malloc(ntsteps*sizeof(step)+1);
+  tcol = (unsigned short*)malloc(n*sizeof(unsigned short));
+  if (doshade>0) tshades = (unsigned short*)malloc(n*sizeof(unsigned short));
+  if (traces == 0 || tsteps == 0 || tcol == 0
+      || (doshade>0 && tshades == 0)) {
+    fprintf(stderr, "Memory allocation failed for traversal record.");
+    exit(1);
+  }
+  ok = fread(traces,sizeof(trace),ntraces,tf) == ntraces
+    && fread(tsteps,sizeof(step),ntsteps,tf) == ntsteps
+    && fread(tcol,sizeof(unsigned short),n,tf) == n
+    && (doshade==0 || fread(tshades,sizeof(unsigned short),n,tf) == n);
+  if (!ok) {
+    fprintf(stderr, "Traversal record %s is truncated\n", name);
+    exit(1);
+  }
+  fclose(tf);
+}
+
+void replaytrace() /* evaluates recorded traversals with current parameters */
+{
+  long p;
+  int i,j,k;
+  double alt;
+  trace *t;
+  step *st;
+  vertex v[TMAXV], *a, *b, *c, *d;
+  void colourpoint(), shadepoint(), newvertex();
+
+  for (j=0; j<Height; j++)
+    for (i=0; i<Width; i++) {
+      COL(i,j) = tcol[(long)j*Width+i];
+      if (doshade>0) SHADES(i,j) = tshades[(long)j*Width+i];
+    }
+
+  for (p=0; p<ntraces; p++) {
+    t = &traces[p];
+    st = &tsteps[t->first];
+    for (k=0; k<4; k++) v[k] = ttetra[k];
+
+    /* same cuts as in planet() */
+    for (k=0; k<t->n; k++, st++)
+      newvertex(&v[st->a], &v[st->b], &v[4+k], dist2(v[st->a],v[st->b]),
+                t->x,t->y,t->z);
+
+    a = &v[t->last[0]]; b = &v[t->last[1]];
+    c = &v[t->last[2]]; d = &v[t->last[3]];
+    if (doshade>0) shadepoint(*a,*b,*c,*d, t->x,t->y,t->z);
+    rainShadow = 0.25*(a->shadow+b->shadow+c->shadow+d->shadow);
+    alt = 0.25*(a->h+b->h+c->h+d->h);
+    colourpoint(alt+M, t->x,t->y,t->z, t->i,t->j);
+  }
+}
+
+struct { char *data; long len; } wblock[NBLOCK]; /* writer queue */
+int wfill, wdrain, wcount, wrows, wdone; /* queue state */
+FILE *wfile; /* file the writer writes to */
+#ifndef NOTHREADS
+pthread_t wthread;
+pthread_mutex_t wlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wnotempty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t wnotfull = PTHREAD_COND_INITIALIZER;
+
+void *writerthread(arg) /* writes blocks until the queue is closed */
+void *arg;
+{
+  pthread_mutex_lock(&wlock);
+  for (;;) {
+    while (wcount == 0 && !wdone) pthread_cond_wait(&wnotempty, &wlock);
+    if (wcount == 0) break;
+    pthread_mutex_unlock(&wlock);
+    fwrite(wblock[wdrain].data, 1, wblock[wdrain].len, wfile);
+    pthread_mutex_lock(&wlock);
+    wdrain = (wdrain+1) % NBLOCK;
+    wcount--;
+    pthread_cond_signal(&wnotfull);
+  }
+  pthread_mutex_unlock(&wlock);
+  return(NULL);
+}
+#endif
+
+void startwriter(outfile) /* sets up row buffers and the writer queue */
+FILE *outfile;
+{
+  int k;
+
+  rowcol = (colno*)calloc(Width,sizeof(colno));
+  rowshade = (unsigned short*)calloc(Width,sizeof(unsigned short));
+  grid0 = (char*)calloc(Width,sizeof(char));
+  grid1 = (char*)calloc(Width,sizeof(char));
+  if (rowcol == 0 || rowshade == 0 || grid0 == 0 || grid1 == 0) {
+    fprintf(stderr, "Memory allocation failed.");
+    exit(1);
+  }
+  for (k=0; k<NBLOCK; k++) {
+    /* no format needs more than 4 bytes per pixel and 8 per row */
+    wblock[k].data = (char*)malloc((size_t)BANDROWS*(4*Width+8));
+    if (wblock[k].data == 0) {
+      fprintf(stderr, "Memory allocation failed.");
+      exit(1);
+    }
+    wblock[k].len = 0;
+  }
+  wfile = outfile;
+  wfill = wdrain = wcount = wrows = wdone = 0;
+#ifndef NOTHREADS
+  if (pthread_create(&wthread, NULL, writerthread, NULL) != 0) {
+    fprintf(stderr, "Could not start writer thread\n");
+    exit(1);
+  }
+#endif
+}
+
+void sendblock() /* passes the current block to the writer */
+{
+  if (wblock[wfill].len == 0) return;
+#ifdef NOTHREADS
+  fwrite(wblock[wfill].data, 1, wblock[wfill].len, wfile);
+#else
+  pthread_mutex_lock(&wlock);
+  wfill = (wfill+1) % NBLOCK;
+  wcount++;
+  pthread_cond_signal(&wnotempty);
+  while (wcount == NBLOCK) pthread_cond_wait(&wnotfull, &wlock);
+  pthread_mutex_unlock(&wlock);
+#endif
+  wblock[wfill].len = 0;
+  wrows = 0;
+}
+
+void putrow(c, s, b) /* formats colours c, shades s and blended colours b */
+colno *c;            /* (if not NULL) into the current block */
+unsigned short *s;
+unsigned int *b;
+{
+  long formatrow();
+
+  wblock[wfill].len += formatrow(c, s, b, wblock[wfill].data+wblock[wfill].len);
+  if (++wrows == BANDROWS) sendblock();
+}
+
+void stopwriter() /* writes what is left and stops the writer */
+{
+  int k;
+
+  sendblock();
+#ifndef NOTHREADS
+  pthread_mutex_lock(&wlock);
+  wdone = 1;
+  pthread_cond_signal(&wnotempty);
+  pthread_mutex_unlock(&wlock);
+  pthread_join(wthread, NULL);
+#endif
+  for (k=0; k<NBLOCK; k++) free(wblock[k].data);
+  free(rowcol); free(rowshade);
+  free(grid0); free(grid1);
+}
+
+void printhead(outfile) /* prints the header of the picture file */
+FILE *outfile;
+{
+  int i, s, s0, W1, nbytes;
+  char *nletters();
+
+  switch (file_type) {
+    case ppm:
+      fprintf(outfile,"P6\n");
+      fprintf(outfile,"#fractal planet image\n");
+      fprintf(outfile,"# Command line:\n# %s\n",cmdLine);
+      fprintf(outfile,"%d %d %d\n",Width,Height,do_bw ? 1 : 255);
+      break;
+
+    case bmp:
+      fprintf(outfile,"BM");
+
+      s0 = (strlen(cmdLine)+strlen("Command line:\n\n")+3) & 0xffc;
+      if (do_bw) {
+        W1 = (Width+31);
+        W1 -= W1 % 32;
+        s = s0 + 62+(W1*Height)/8; /* file size */
+      } else {
+        W1 = (3*Width+3);
+        W1 -= W1 % 4;
+        s = s0 + 54+W1*Height; /* file size */
+      }
+      putc(s&255,outfile);
+      putc((s>>8)&255,outfile);
+      putc((s>>16)&255,outfile);
+      putc(s>>24,outfile);
+
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      putc(do_bw ? 62 : 54,outfile); /* offset to data */
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      putc(40,outfile); /* size of infoheader */
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      putc(Width&255,outfile);
+      putc((Width>>8)&255,outfile);
+      putc((Width>>16)&255,outfile);
+      putc(Width>>24,outfile);
+
+      putc(Height&255,outfile);
+      putc((Height>>8)&255,outfile);
+      putc((Height>>16)&255,outfile);
+      putc(Height>>24,outfile);
+
+      putc(1,outfile);  /* no. of planes = 1 */
+      putc(0,outfile);
+
+      putc(do_bw ? 1 : 24,outfile);  /* bpp */
+      putc(0,outfile);
+
+      putc(0,outfile); /* no compression */
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      putc(0,outfile); /* image size (unspecified) */
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      putc(0,outfile); /* h. pixels/m */
+      putc(32,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      putc(0,outfile); /* v. pixels/m */
+      putc(32,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      putc(do_bw ? 2 : 0,outfile); /* colours used (2 or unspecified) */
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+
+      putc(do_bw ? 2 : 0,outfile); /* important colours (2 or all) */
+      putc(0,outfile);
+      putc(0,outfile);
+      putc(0,outfile);
+
+      if (do_bw) {
+        putc(0,outfile); /* colour 0 = black */
+        putc(0,outfile);
+        putc(0,outfile);
+        putc(0,outfile);
+
+        putc(255,outfile); /* colour 1 = white */
+        putc(255,outfile);
+        putc(255,outfile);
+        putc(255,outfile);
+      }
+      break;
+
+    case xpm:
+      if (do_bw) nbytes = 1;
+      else {
+        i = nocols - 1;
+        for (nbytes = 0; i != 0; nbytes++)
+          i >>= 5;
+      }
+
+      fprintf(outfile,"/* XPM */\n");
+      fprintf(outfile,"/* Command line: */\n/* %s*/\n",cmdLine);
+      fprintf(outfile,"static char *xpmdata[] = {\n");
+      fprintf(outfile,"/* width height ncolors chars_per_pixel */\n");
+      fprintf(outfile,"\"%d %d %d %d\",\n", Width, Height,
+              do_bw ? 2 : nocols, nbytes);
+      fprintf(outfile,"/* colors */\n");
+      if (do_bw) {
+        fprintf(outfile,"\". c #FFFFFF\",\n");
+        fprintf(outfile,"\"X c #000000\",\n");
+      } else
+        for (i = 0; i < nocols; i++)
+          fprintf(outfile,"\"%s c #%2.2X%2.2X%2.2X\",\n",
+                  nletters(nbytes, i), rtable[i], gtable[i], btable[i]);
+
+      fprintf(outfile,"/* pixels */\n");
+      break;
+
+    case heightfield: /* see printheights() and printbinheights() */
+      break;
+  }
+}
+
+long formatrow(c, s, b, buf) /* formats a row of colours c, shades s */
+colno *c;                    /* and blended colours b into buf and */
+unsigned short *s;           /* returns its length */
+unsigned int *b;
+char *buf;
+{
+  int i,k,v,nbytes;
+  char *p = buf, *nletters();
+
+  switch (file_type) {
+    case ppm:
+      for (i=0; i<Width; i++)
+        if (do_bw) {
+          v = (c[i] < WHITE) ? 0 : 1;
+          *p++ = v; *p++ = v; *p++ = v;
+        } else if (b != NULL && b[i] && c[i] >= LOWEST) {
+          /* (outlines and grid are drawn over blended pixels) */
+          *p++ = b[i]>>16; *p++ = b[i]>>8; *p++ = b[i];
+        } else if (doshade) {
+          v = s[i]*rtable[c[i]]/150;
+          *p++ = (v>255) ? 255 : v;
+          v = s[i]*gtable[c[i]]/150;
+          *p++ = (v>255) ? 255 : v;
+          v = s[i]*btable[c[i]]/150;
+          *p++ = (v>255) ? 255 : v;
+        } else {
+          *p++ = rtable[c[i]];
+          *p++ = gtable[c[i]];
+          *p++ = btable[c[i]];
+        }
+      break;
+
+    case bmp:
+      if (do_bw) {
+        for (i=0; i<Width; i+=8) {
+          v = 0;
+          for (k=0; k<8; k++)
+            if (i+k<Width && c[i+k] >= WHITE)
+              v += 128>>k;
+          *p++ = v;
+        }
+        while ((p-buf)%4) *p++ = 0; /* rows are padded to 32 bits */
+      } else {
+        for (i=0; i<Width; i++)
+          if (b != NULL && b[i] && c[i] >= LOWEST) {
+            *p++ = b[i]; *p++ = b[i]>>8; *p++ = b[i]>>16;
+          } else if (doshade) {
+            v = s[i]*btable[c[i]]/150;
+            *p++ = (v>255) ? 255 : v;
+            v = s[i]*gtable[c[i]]/150;
+            *p++ = (v>255) ? 255 : v;
+            v = s[i]*rtable[c[i]]/150;
+            *p++ = (v>255) ? 255 : v;
+          } else {
+            *p++ = btable[c[i]];
+            *p++ = gtable[c[i]];
+            *p++ = rtable[c[i]];
+          }
+        while ((p-buf)%4) *p++ = 0; /* rows are padded to 32 bits */
+      }
+      break;
+
+    case xpm:
+      v = nocols - 1;
+      for (nbytes = 0; v != 0; nbytes++)
+        v >>= 5;
+      *p++ = '"';
+      for (i=0; i<Width; i++)
+        if (do_bw) *p++ = (c[i] < WHITE) ? 'X' : '.';
+        else {
+          memcpy(p, nletters(nbytes, c[i]), nbytes);
+          p += nbytes;
+        }
+      *p++ = '"'; *p++ = ','; *p++ = '\n';
+      break;
+
+    case heightfield: /* not made of colour rows */
+      break;
+  }
+  return(p-buf);
+}
+
+void printtail(outfile) /* prints what follows the pixels and closes */
+FILE *outfile;
+{
+  switch (file_type) {
+    case bmp:
+      fprintf(outfile,"Command line:\n%s\n",cmdLine);
+      break;
+    case xpm:
+      fprintf(outfile,"};\n");
+      break;
+    default: /* nothing follows the pixels */
+      break;
+  }
+  fclose(outfile);
+}
+
+char *nletters(int n, int c)
+{
+  int i;
+  static char buffer[8];
+
+  buffer[n] = '\0';
+
+  for (i = n-1; i >= 0; i--)
+  {
+    buffer[i] = letters[c & 0x001F];
+    c >>= 5;
+  }
+
+  return buffer;
+}
+
+void printheights(outfile) /* prints heightfield */
+FILE *outfile;
+{
+  int i,j;
+  void printbinheights();
+
+  if (height_format != htext) {
+    printbinheights(outfile);
+    return;
+  }
+
+  for (j=0; j<Height; j++) {
+    for (i=0; i<Width; i++)
+      fprintf(outfile,"%d ",heights[PIXEL(i,j)]);
+    putc('\n',outfile);
+  }
+  fclose(outfile);
+}
+
+void putle(p, v, n) /* stores the n low bytes of v little-endian at p */
+unsigned char *p;
+unsigned long long v;
+int n;
+{
+  int k;
+
+  for (k=0; k<n; k++) {
+    p[k] = v & 255;
+    v >>= 8;
+  }
+}
+
+unsigned long long doublebits(x) /* IEEE bits of x */
+double x;
+{
+  unsigned long long v;
+
+  memcpy(&v, &x, sizeof(v));
+  return(v);
+}
+
+void printbinheights(outfile) /* prints heightfield as raw samples */
+FILE *outfile;
+{
+  /* Header (64 bytes, little-endian):             */
+  /*  0 "PLNTHGT1"                                 */
+  /*  8 int32 sample type: 1 int16, 2 int32, 3 float32 */
+  /* 12 int32 width, 16 int32 height               */
+  /* 20 int32 projection letter (as given by -p)   */
+  /* 24 double scale (-m), 32 double seed (-s)     */
+  /* 40 double unit: height = sample * unit       */
+  /* 48 double longitude, 56 double latitude (deg) */
+  /* followed by width*height samples, top row first. */
+  /* Heights are those of the text format / 10000000, so 0 is sea */
+  /* level and 1 the radius of the planet (unless -n is used); */
+  /* float32 samples are the altitudes before that rounding. */
+  unsigned char head[64], *buf, *p;
+  int i, j, n, h, size, q = 1;
+  long maxh = 0;
+  float f;
+  unsigned int fbits;
+
+  size = (height_format == hint16) ? 2 : 4;
+
+  if (height_format == hint16) { /* divide so largest height fits */
+    for (i=0; i<Width*Height; i++)
+      if (labs(heights[i]) > maxh) maxh = labs(heights[i]);
+    q = maxh/32767+1;
+  }
+
+  memcpy(head, "PLNTHGT1", 8);
+  putle(head+8, (unsigned long long)height_format, 4);
+  putle(head+12, (unsigned long long)Width, 4);
+  putle(head+16, (unsigned long long)Height, 4);
+  putle(head+20, (unsigned long long)view, 4);
+  putle(head+24, doublebits(scale), 8);
+  putle(head+32, doublebits(rseed), 8);
+  putle(head+40, doublebits(height_format == hfloat32 ? 1.0 : q/10000000.0), 8);
+  putle(head+48, doublebits(longi/DEG2RAD), 8);
+  putle(head+56, doublebits(lat/DEG2RAD), 8);
+  fwrite(head, 1, 64, outfile);
+
+  buf = (unsigned char*)malloc((size_t)BANDROWS*Width*size);
+  if (buf == 0) {
+    fprintf(stderr, "Memory allocation failed.");
+    exit(1);
+  }
+  for (j=0; j<Height; j+=BANDROWS) { /* write BANDROWS rows at a time */
+    n = (Height-j < BANDROWS) ? Height-j : BANDROWS;
+    p = buf;
+    for (i=0; i<n*Width; i++) {
+      switch (height_format) {
+        case hint16:
+          h = heights[(long)j*Width+i];
+          h = (h >= 0) ? (h+q/2)/q : -((-h+q/2)/q);
+          putle(p, (unsigned long long)(h & 0xffff), 2);
+          break;
+        case hint32:
+          h = heights[(long)j*Width+i];
+          putle(p, (unsigned long long)(h & 0xffffffffL), 4);
+          break;
+        case hfloat32:
+          f = fheights[(long)j*Width+i];
+          memcpy(&fbits, &f, 4);
+          putle(p, (unsigned long long)fbits, 4);
+          break;
+        default: break;
+      }
+      p += size;
+    }
+    fwrite(buf, size, (size_t)n*Width, outfile);
+  }
+  free(buf);
+  fclose(outfile);
+}
+
+double log_2(x)
+double x;
+{ return(log(x)/log(2.0)); }
+
+void print_error(char *filename, char *ext)
 {
   fprintf(stderr,"Usage: planet [options]\n\n");
   fprintf(stderr,"See Manual.txt for details\n\n");
   exit(0);
 }
+
+#ifdef PLANET_BENCH
+/* Workloads for bench.cpp (compile with -DPLANET_LIBRARY -DPLANET_BENCH). */
+/* Each does its operation n times on points from a fixed sequence and */
+/* returns the sum of the results, so the work is not optimised away and */
+/* the same n gives the same work in every run. */
+
+unsigned long benchState;
+
+void benchpoint(x, y, z) /* next point of the sequence, on the sphere */
+double *x, *y, *z;
+{
+  double u, a, r;
+
+  benchState = benchState*6364136223846793005UL+1442695040888963407UL;
+  u = 2.0*((benchState>>11)&0xfffff)/1048575.0-1.0;
+  a = 2.0*PI*((benchState>>31)&0xfffff)/1048576.0;
+  r = sqrt(1.0-u*u);
+  *x = r*cos(a); *y = u; *z = r*sin(a);
+}
+
+PLANET_API void planet_bench_seed(double seed) /* planet of -s seed */
+{
+  planet_params params;
+  int setparams();
+  void setview(), seedtetra();
+
+  planet_defaults(&params);
+  params.seed = seed;
+  setparams(&params);
+  setview();
+  seedtetra();
+  doRainShadow = 0;
+  tracing = 0;
+  ssa = ssb = ssc = ssd = tetra[0]; /* planet1() misses at first */
+  ssDepth = Depth;
+  benchState = 1;
+}
+
+PLANET_API double planet_bench_planet(int depth, long n) /* from the top */
+{
+  double x, y, z, sum = 0.0;
+  long k;
+
+  for (k=0; k<n; k++) {
+    benchpoint(&x, &y, &z);
+    sum += planet(tetra[0], tetra[1], tetra[2], tetra[3], x,y,z, depth);
+  }
+  return(sum);
+}
+
+/* planet1() at Depth, with points a pixel of a 4000 pixel wide map apart */
+/* along a parallel (hot) or far apart, so every point misses (cold) */
+PLANET_API double planet_bench_planet1(int hot, long n)
+{
+  double x, y, z, lo, sum = 0.0;
+  long k;
+
+  benchpoint(&x, &y, &z);
+  lo = atan2(x, z);
+  for (k=0; k<n; k++) {
+    if (hot) {
+      lo += 2.0*PI/4000.0;
+      x = cos(0.3)*sin(lo); y = sin(0.3); z = cos(0.3)*cos(lo);
+    } else benchpoint(&x, &y, &z);
+    sum += planet1(x, y, z);
+  }
+  return(sum);
+}
+
+PLANET_API double planet_bench_rand2(long n)
+{
+  double p = 0.21, q = 0.47, sum = 0.0;
+  long k;
+
+  for (k=0; k<n; k++) {
+    p = rand2(p, q);
+    sum += p;
+  }
+  return(sum);
+}
+
+/* renders a width x height mercator map of the seed for writing as */
+/* format: bmp, ppm, xpm, heights (text), int16, int32 or float32 */
+PLANET_API int planet_bench_map(const char *format, int width, int height)
+{
+  planet_params params;
+  int setparams();
+  void *rasterarray();
+  void freeraster(), defaultcolours(), clearmaps();
+  void setview(), seedtetra(), render(), finishmap();
+
+  planet_defaults(&params);
+  params.seed = rseed;
+  params.width = width; params.height = height;
+  if (setparams(&params) != PLANET_OK) return(PLANET_EPARAMS);
+  height_format = htext;
+  if (strcmp(format, "bmp") == 0) file_type = bmp;
+  else if (strcmp(format, "ppm") == 0) file_type = ppm;
+  else if (strcmp(format, "xpm") == 0) file_type = xpm;
+  else {
+    file_type = heightfield;
+    if (strcmp(format, "int16") == 0) height_format = hint16;
+    else if (strcmp(format, "int32") == 0) height_format = hint32;
+    else if (strcmp(format, "float32") == 0) height_format = hfloat32;
+    else if (strcmp(format, "heights") != 0) return(PLANET_EPARAMS);
+  }
+  defaultcolours();
+  if (col != NULL) freeraster(col);
+  if (heights != NULL) freeraster(heights);
+  if (fheights != NULL) freeraster(fheights);
+  col = rasterarray(sizeof(colno), "cols");
+  heights = (file_type == heightfield && height_format != hfloat32)
+            ? rasterarray(sizeof(int), "heights") : NULL;
+  fheights = (file_type == heightfield && height_format == hfloat32)
+             ? rasterarray(sizeof(float), "heights") : NULL;
+  shades = NULL; altitudes = NULL;
+  colT = colR = colB = NULL;
+  xxx = yyy = zzz = NULL; blend = NULL;
+  clearmaps();
+  setview();
+  seedtetra();
+  render();
+  finishmap();
+  return(PLANET_OK);
+}
+
+PLANET_API void planet_bench_write(long n) /* writes the map n times */
+{
+  FILE *outfile;
+  long k;
+  void printpicture();
+
+  for (k=0; k<n; k++) {
+    outfile = fopen("/dev/null", "wb");
+    if (outfile == NULL) {
+      fprintf(stderr, "Could not open /dev/null\n");
+      exit(1);
+    }
+    printpicture(outfile);
+  }
+}
+#endif
@@ -0,0 +1,173 @@
+/* planet.h */
+/* interface for rendering maps with planet.c from other programs */
+
+/* Compile planet.c with -DPLANET_LIBRARY to leave out main(), and the */
+/* program renders into buffers of its own with planet_render(). Nothing */
+/* is read or written except the colour file, if one is named. */
+
+/* planet.c keeps its state in globals, so planet_render() must not be */
+/* called by two threads at once. Its other names (rseed, M, tetra, */
+/* planet() and so on) are not part of the interface, and can be hidden */
+/* from programs that use the same names, such as test.cpp, by */
+/*   cc -O2 -DPLANET_LIBRARY -fvisibility=hidden -c planet.c            */
+/*   objcopy --localize-hidden planet.o                                 */
+/* and linking planet.o with -lm -lpthread. */
+
+#ifndef PLANET_H
+#define PLANET_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(PLANET_LIBRARY) && defined(__GNUC__)
+#define PLANET_API __attribute__((visibility("default")))
+#else
+#define PLANET_API
+#endif
+
+/* colour numbers, as in the colour file (see readcolors() in planet.c) */
+#ifdef SMALLCOL
+typedef unsigned char planet_colour;
+#else
+typedef unsigned short planet_colour;
+#endif
+
+/* The fields are the command line options of the same meaning. */
+/* Angles are in degrees. */
+typedef struct planet_params
+{
+  double seed;              /* -s */
+  char projection;          /* -p: m p q M S s o g i a c */
+  int width, height;        /* -w, -h */
+  double longitude, latitude; /* -l, -L: centre of the map */
+  double scale;             /* -m */
+  double altitude;          /* -i: initial altitude */
+  double altitudeWeight;    /* -v */
+  double distanceWeight;    /* -V */
+  double vgrid, hgrid;      /* -g, -G: 0 for no grid lines */
+  int shading;              /* 0, 1 (-B), 2 (-b) or 3 (-d) */
+  double shadeAngle, shadeAngle2; /* -a, -A */
+  int latitudeColours;      /* -c given this many times */
+  int nonLinear;            /* -n */
+  int outline;              /* 0, 1 (-E) or 2 (-O) */
+  int contourLines;         /* n of -En or -On */
+  char colouring;           /* 0 (altitude), 't', 'r' or 'z' */
+  int adaptiveDepth;        /* -D */
+  int supersamples;         /* -e */
+  const char *colours;      /* -C: colour file, or NULL for Olsson.col */
+} planet_params;
+
+/* Each buffer is width x height samples in rows from the top, or NULL */
+/* if the channel is not wanted. Pixels off the map get colour numbers */
+/* below 6 (see the colour file) and altitude 0. */
+typedef struct planet_buffers
+{
+  planet_colour *colour;    /* map, as coloured by params.colouring */
+  unsigned short *shade;    /* shade (150 is unshaded), with shading */
+  unsigned char *rgb;       /* 3 bytes (red, green, blue) per sample */
+  float *altitude;          /* altitude (or temperature or rainfall) */
+  planet_colour *temperature, *rainfall, *biome; /* maps made with -Z */
+} planet_buffers;
+
+#define PLANET_OK 0
+#define PLANET_EPARAMS 1   /* size, projection or colouring not known */
+#define PLANET_ECOLOURS 2  /* colour file can not be read */
+
+/* sets params to the defaults of the command line */
+PLANET_API void planet_defaults(planet_params *params);
+
+/* renders the map of params into the buffers of channels */
+PLANET_API int planet_render(const planet_params *params,
+                             planet_buffers *channels);
+
+/* Point queries. A planet is set up once by planet_open() from the seed, */
+/* altitude and weights of params, at the Depth of a map of its scale and */
+/* height, and keeps its own subdivision cache between calls, so points */
+/* near the ones asked before are fastest. */
+typedef struct planet_state planet_state;
+
+typedef struct planet_values
+{
+  float altitude;           /* 0 is sea level */
+  float temperature;        /* -0.1 to 0.1 is -30 to 30 Celsius */
+  float rainfall;
+  char biome;               /* T G B D S F R W E O I, or 0 for sea */
+} planet_values;
+
+/* sets up the planet of params, or returns NULL if params is wrong */
+PLANET_API planet_state *planet_open(const planet_params *params);
+
+PLANET_API void planet_close(planet_state *planet);
+
+/* values of n points given as latitude, longitude pairs in latlong */
+PLANET_API void planet_points(planet_state *planet, int n,
+                              const double *latlong, planet_values *values);
+
+/* Chunks, for terrain at any scale. Each face of the cube around the */
+/* planet (0 to 5 are x = 1, x = -1, y = 1, y = -1, z = 1, z = -1, as in */
+/* -F) is split into 2^level x 2^level cells, and the chunk of cell */
+/* (i, j) is n x n columns at the centres of n x n squares of the cell, */
+/* projected from the face onto the sphere. planet_chunk() sets */
+/* heights[r*n+c] to the altitude of column c of row r (i and c along */
+/* the face's first axis), at the Depth of a map with pixels as far */
+/* apart as the columns. Heights are doubles, as floats can not hold */
+/* the detail of small chunks. Returns PLANET_EPARAMS for a bad address. */
+PLANET_API int planet_chunk(planet_state *planet, int face, int level,
+                            int i, int j, int n, double *heights);
+
+/* planet_chunk() may be called by several threads at once, unless */
+/* planet.c is compiled with -DNOTHREADS, and so can planet_stream(), */
+/* which keeps the n x n chunks of one level near moving observers. */
+/* Its worker threads make the chunks nearest to the observers (along */
+/* their way) first, and the chunks used longest ago are let go when */
+/* they take more than maxbytes. */
+typedef struct planet_streamer planet_streamer;
+
+typedef struct planet_observer
+{
+  double x, y, z;           /* position, as a direction from the centre */
+  double vx, vy, vz;        /* velocity along the surface, radians/second */
+  double dx, dy, dz;        /* view direction, or 0 0 0 for all round */
+  double radius;            /* chunks within this (radians) are wanted */
+  double lookahead;         /* seconds of the way ahead to prefetch */
+} planet_observer;
+
+typedef struct planet_stream_stats
+{
+  int queued, making, kept; /* chunks waiting, being made and kept */
+  long bytes;               /* of the kept chunks */
+  long made, evicted;       /* chunks made, and let go for memory */
+  long dropped;             /* not made, as no longer near an observer */
+  long shared;              /* asked for by more than one observer */
+  long hits, misses;        /* of planet_fetch() */
+  double hitRate;
+  double make50, make99;    /* milliseconds to make a chunk (median, 99%) */
+  double wait50, wait99;    /* milliseconds from asking to kept */
+} planet_stream_stats;
+
+/* starts workers threads making chunks of planet, or returns NULL */
+PLANET_API planet_streamer *planet_stream(planet_state *planet, int level,
+                                          int n, int workers, long maxbytes);
+
+/* asks for the chunks near the n observers, which should be called */
+/* often (each frame or tick) with all the observers */
+PLANET_API void planet_observe(planet_streamer *stream, int n,
+                               const planet_observer *observers);
+
+/* copies chunk (face, i, j) into heights and returns 1 if it is kept, */
+/* else asks for it before all others and returns 0 */
+PLANET_API int planet_fetch(planet_streamer *stream, int face, int i, int j,
+                            double *heights);
+
+PLANET_API void planet_stats(planet_streamer *stream,
+                             planet_stream_stats *stats);
+
+/* stops the workers and frees the chunks */
+PLANET_API void planet_unstream(planet_streamer *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,439 @@
+/* planetd.c */
+/* answers point queries of planets over a Unix domain socket */
+
+/* planetd keeps planets set up by planet.c (see planet.h) in one process, */
+/* so a query costs only the subdivision of its points, from the cached */
+/* tetrahedron of the planet's last point where it can. Build it with */
+/*   cc -O2 -DPLANET_LIBRARY -c planet.c                               */
+/*   cc -O2 -o planetd planetd.c planet.o -lm -lpthread                */
+
+/* Usage: planetd [options] socket                                      */
+/* Each -s seed adds a planet, numbered from 0, with the options given */
+/* before it: -i altitude, -v and -V weights, and -m scale and -h height */
+/* of the map whose Depth its points get. -r n reports latencies every */
+/* n seconds (default 10) on standard error. */
+
+/* A request is, in the byte order of the machine,                     */
+/*   uint32 PLQMAGIC, uint32 planet, uint32 n,                         */
+/*   n x (double latitude, double longitude) in degrees                */
+/* and its answer is                                                    */
+/*   uint32 n, n x planet_values (see planet.h)                        */
+/* A client may send more requests before reading the answers, which  */
+/* come in the order of the requests. A bad request closes the socket. */
+/* Answers are queued for each client and sent as its socket takes */
+/* them, so a client that does not read only holds up itself: planetd */
+/* stops reading its requests while more than QUEUEREAD bytes of */
+/* answers wait, and closes it if they ever exceed MAXQUEUED. */
+
+/* Requests that arrive together, from one client or several, are       */
+/* answered as one batch: the points of each planet are sorted along a */
+/* Morton curve, so neighbouring points are evaluated one after the     */
+/* other and mostly start from the cached tetrahedron. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "planet.h"
+
+#define PLQMAGIC 0x31514c50 /* "PLQ1" */
+#define MAXPLANETS 64
+#define MAXCLIENTS 256
+#define MAXPOINTS (1<<20)   /* per request */
+#define QUEUEREAD (1L<<20)  /* unsent bytes above which requests wait */
+#define MAXQUEUED (64L<<20) /* unsent bytes above which a client is closed */
+#define LATENCIES 65536     /* latencies kept for the percentiles */
+#define DEG2RAD 0.01745329251994329576923 /* pi/180 */
+
+typedef struct request
+{
+  int client;
+  unsigned int planet, n;
+  double *latlong;
+  planet_values *values;
+  double start;             /* time the whole request was read */
+} request;
+
+typedef struct client
+{
+  int fd;
+  char *buf;                /* bytes read of requests not yet whole */
+  long used, size;
+  char *out;                /* answers not yet sent, from outsent */
+  long outsent, outused, outsize;
+} client;
+
+typedef struct point
+{
+  unsigned int key;         /* position along Morton curve */
+  request *r;
+  unsigned int k;           /* point in request */
+} point;
+
+planet_state *planets[MAXPLANETS];
+int nplanets = 0;
+client clients[MAXCLIENTS];
+int nclients = 0;
+request *pending = NULL;
+int npending = 0, maxpending = 0;
+point *points = NULL;
+long maxpoints = 0;
+double latencies[LATENCIES];
+long nlatencies = 0, nrequests = 0, npoints = 0;
+volatile sig_atomic_t stop = 0;
+
+double now() /* seconds on a monotonic clock */
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec+1e-9*t.tv_nsec);
+}
+
+void stopped(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+unsigned int spread(unsigned int v) /* bits of 10 bit v, 3 apart */
+{
+  v = (v | (v<<16)) & 0x030000ff;
+  v = (v | (v<<8)) & 0x0300f00f;
+  v = (v | (v<<4)) & 0x030c30c3;
+  v = (v | (v<<2)) & 0x09249249;
+  return(v);
+}
+
+unsigned int mortonkey(double la, double lo) /* key of point on sphere */
+{
+  double x, y, z;
+
+  la *= DEG2RAD; lo *= DEG2RAD;
+  x = cos(la)*sin(lo); y = sin(la); z = cos(la)*cos(lo);
+  return((spread((unsigned int)((x+1.0)*511.5))<<2)
+         | (spread((unsigned int)((y+1.0)*511.5))<<1)
+         | spread((unsigned int)((z+1.0)*511.5)));
+}
+
+int bykey(const void *a, const void *b)
+{
+  unsigned int ka = ((point*)a)->key, kb = ((point*)b)->key;
+
+  return((ka > kb) - (ka < kb));
+}
+
+int bytime(const void *a, const void *b)
+{
+  double ta = *(double*)a, tb = *(double*)b;
+
+  return((ta > tb) - (ta < tb));
+}
+
+void *grow(void *p, long n, long *max, size_t size) /* room for n elements */
+{
+  if (n <= *max) return(p);
+  while (*max < n) *max = (*max == 0) ? 1024 : 2*(*max);
+  p = realloc(p, *max*size);
+  if (p == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    exit(1);
+  }
+  return(p);
+}
+
+void dropclient(int c) /* closes client c and forgets its requests */
+{
+  int k;
+
+  close(clients[c].fd);
+  clients[c].fd = -1;
+  for (k=0; k<npending; k++)
+    if (pending[k].client == c) pending[k].client = -1;
+}
+
+void readrequests(int c) /* reads what client c has sent */
+{
+  client *cl = &clients[c];
+  unsigned int head[3];
+  long whole, max;
+  request *r;
+  ssize_t got;
+
+  cl->buf = grow(cl->buf, cl->used+65536, &cl->size, 1);
+  got = recv(cl->fd, cl->buf+cl->used, cl->size-cl->used, MSG_DONTWAIT);
+  if (got <= 0) {
+    if (got < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    dropclient(c);
+    return;
+  }
+  cl->used += got;
+
+  while (cl->used >= (long)sizeof(head)) {
+    memcpy(head, cl->buf, sizeof(head));
+    if (head[0] != PLQMAGIC || head[1] >= (unsigned int)nplanets
+        || head[2] > MAXPOINTS) {
+      dropclient(c);
+      return;
+    }
+    whole = sizeof(head)+(long)head[2]*2*sizeof(double);
+    if (cl->used < whole) return;
+    max = maxpending;
+    pending = grow(pending, npending+1, &max, sizeof(request));
+    maxpending = max;
+    r = &pending[npending++];
+    r->client = c;
+    r->planet = head[1];
+    r->n = head[2];
+    r->latlong = malloc((size_t)r->n*2*sizeof(double)+1);
+    r->values = malloc((size_t)r->n*sizeof(planet_values)+1);
+    if (r->latlong == NULL || r->values == NULL) {
+      fprintf(stderr, "Memory allocation failed.\n");
+      exit(1);
+    }
+    memcpy(r->latlong, cl->buf+sizeof(head), (size_t)r->n*2*sizeof(double));
+    r->start = now();
+    memmove(cl->buf, cl->buf+whole, cl->used-whole);
+    cl->used -= whole;
+  }
+}
+
+void flushclient(int c) /* sends what client c's socket takes now */
+{
+  client *cl = &clients[c];
+  ssize_t sent;
+
+  while (cl->outsent < cl->outused) {
+    sent = send(cl->fd, cl->out+cl->outsent, cl->outused-cl->outsent,
+                MSG_NOSIGNAL|MSG_DONTWAIT);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (sent <= 0) {
+      dropclient(c);
+      return;
+    }
+    cl->outsent += sent;
+  }
+  cl->outsent = cl->outused = 0;
+}
+
+int queueanswer(int c, void *p, long n) /* 0 if client c was closed */
+{
+  client *cl = &clients[c];
+
+  if (cl->outused-cl->outsent+n > MAXQUEUED) {
+    fprintf(stderr, "Closing a client that leaves its answers unread\n");
+    dropclient(c);
+    return(0);
+  }
+  if (cl->outsent > 0) { /* move what is left to the front */
+    memmove(cl->out, cl->out+cl->outsent, cl->outused-cl->outsent);
+    cl->outused -= cl->outsent;
+    cl->outsent = 0;
+  }
+  cl->out = grow(cl->out, cl->outused+n, &cl->outsize, 1);
+  memcpy(cl->out+cl->outused, p, n);
+  cl->outused += n;
+  return(1);
+}
+
+void answer() /* evaluates the pending requests and answers them */
+{
+  int p, k, i, c;
+  long n;
+  double *latlong = NULL, t;
+  planet_values *values = NULL;
+  request *r;
+
+  for (p=0; p<nplanets; p++) {
+    n = 0;
+    for (k=0; k<npending; k++)
+      if (pending[k].planet == (unsigned int)p && pending[k].client >= 0) {
+        r = &pending[k];
+        points = grow(points, n+r->n, &maxpoints, sizeof(point));
+        for (i=0; i<(int)r->n; i++) {
+          points[n].key = mortonkey(r->latlong[2*i], r->latlong[2*i+1]);
+          points[n].r = r;
+          points[n++].k = i;
+        }
+      }
+    if (n == 0) continue;
+    qsort(points, n, sizeof(point), bykey);
+
+    latlong = malloc(n*2*sizeof(double));
+    values = malloc(n*sizeof(planet_values));
+    if (latlong == NULL || values == NULL) {
+      fprintf(stderr, "Memory allocation failed.\n");
+      exit(1);
+    }
+    for (i=0; i<n; i++) {
+      latlong[2*i] = points[i].r->latlong[2*points[i].k];
+      latlong[2*i+1] = points[i].r->latlong[2*points[i].k+1];
+    }
+    planet_points(planets[p], n, latlong, values);
+    for (i=0; i<n; i++) points[i].r->values[points[i].k] = values[i];
+    free(latlong);
+    free(values);
+    npoints += n;
+  }
+
+  for (k=0; k<npending; k++) { /* answers in the order of the requests */
+    r = &pending[k];
+    if (r->client >= 0
+        && queueanswer(r->client, &r->n, sizeof(r->n))
+        && queueanswer(r->client, r->values,
+                       (long)r->n*sizeof(planet_values))) {
+      t = now()-r->start; /* (until the answer is queued) */
+      latencies[nlatencies++ % LATENCIES] = t;
+      nrequests++;
+    }
+    free(r->latlong);
+    free(r->values);
+  }
+  npending = 0;
+
+  for (c=0; c<nclients; c++)
+    if (clients[c].fd >= 0 && clients[c].outused > 0) flushclient(c);
+}
+
+void report(double seconds) /* prints throughput and latency percentiles */
+{
+  static double sorted[LATENCIES];
+  long n = (nlatencies < LATENCIES) ? nlatencies : LATENCIES;
+
+  if (nrequests == 0) return;
+  memcpy(sorted, latencies, n*sizeof(double));
+  qsort(sorted, n, sizeof(double), bytime);
+  fprintf(stderr, "%ld requests, %ld points in %.1f s (%.0f points/s), "
+          "latency p50 %.3f ms p99 %.3f ms\n",
+          nrequests, npoints, seconds, npoints/seconds,
+          1000.0*sorted[n/2], 1000.0*sorted[(n*99)/100]);
+  nlatencies = nrequests = npoints = 0;
+}
+
+int main(int ac, char **av)
+{
+  planet_params params;
+  struct sockaddr_un addr;
+  struct pollfd fds[MAXCLIENTS+1];
+  char *path = NULL;
+  int i, c, listener, nfds, every = 10;
+  double last;
+
+  planet_defaults(&params);
+  for (i = 1; i<ac; i++) {
+    if (av[i][0] == '-' && i+1 < ac) {
+      switch (av[i][1]) {
+        case 's' : sscanf(av[++i],"%lf",&params.seed);
+                   if (nplanets == MAXPLANETS) {
+                     fprintf(stderr,"At most %d planets\n",MAXPLANETS);
+                     exit(1);
+                   }
+                   planets[nplanets++] = planet_open(&params);
+                   if (planets[nplanets-1] == NULL) {
+                     fprintf(stderr,"Bad parameters for planet %s\n",av[i]);
+                     exit(1);
+                   }
+                   break;
+        case 'i' : sscanf(av[++i],"%lf",&params.altitude);
+                   break;
+        case 'v' : sscanf(av[++i],"%lf",&params.altitudeWeight);
+                   break;
+        case 'V' : sscanf(av[++i],"%lf",&params.distanceWeight);
+                   break;
+        case 'm' : sscanf(av[++i],"%lf",&params.scale);
+                   break;
+        case 'h' : sscanf(av[++i],"%d",&params.height);
+                   break;
+        case 'r' : sscanf(av[++i],"%d",&every);
+                   break;
+        default: fprintf(stderr,"Unknown option: %s\n",av[i]);
+                 exit(1);
+      }
+    }
+    else path = av[i];
+  }
+  if (path == NULL || nplanets == 0) {
+    fprintf(stderr,"Usage: planetd [options] -s seed [-s seed ...] socket\n");
+    exit(1);
+  }
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+  unlink(path);
+  if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || listen(listener, 64) < 0) {
+    fprintf(stderr, "Could not listen on %s, error code = %d\n", path, errno);
+    exit(1);
+  }
+  signal(SIGINT, stopped);
+  signal(SIGTERM, stopped);
+  signal(SIGPIPE, SIG_IGN);
+
+  last = now();
+  while (!stop) {
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (c=0; c<nclients; c++) {
+      fds[c+1].fd = clients[c].fd;
+      fds[c+1].events = 0;
+      if (clients[c].outused-clients[c].outsent <= QUEUEREAD)
+        fds[c+1].events |= POLLIN;
+      if (clients[c].outused > 0) fds[c+1].events |= POLLOUT;
+    }
+    nfds = poll(fds, nclients+1, 1000);
+    if (nfds < 0 && errno != EINTR) break;
+
+    if (nfds > 0) {
+      for (c=0; c<nclients; c++) {
+        if (clients[c].fd >= 0 && (fds[c+1].revents & POLLOUT))
+          flushclient(c);
+        if (clients[c].fd >= 0
+            && (fds[c+1].revents & (POLLIN|POLLHUP|POLLERR)))
+          readrequests(c);
+      }
+      if (npending > 0) answer();
+
+      /* forget closed clients, then take new ones */
+      for (c=i=0; c<nclients; c++)
+        if (clients[c].fd >= 0) clients[i++] = clients[c];
+        else {
+          free(clients[c].buf);
+          free(clients[c].out);
+        }
+      nclients = i;
+      if ((fds[0].revents & POLLIN) && nclients < MAXCLIENTS) {
+        c = accept(listener, NULL, NULL);
+        if (c >= 0 && fcntl(c, F_SETFL, fcntl(c, F_GETFL)|O_NONBLOCK) < 0) {
+          close(c);
+          c = -1;
+        }
+        if (c >= 0) {
+          memset(&clients[nclients], 0, sizeof(client));
+          clients[nclients++].fd = c;
+        }
+      }
+    }
+    if (every > 0 && now()-last >= every) {
+      report(now()-last);
+      last = now();
+    }
+  }
+
+  report(now()-last);
+  close(listener);
+  unlink(path);
+  for (i=0; i<nplanets; i++) planet_close(planets[i]);
+  return(0);
+}
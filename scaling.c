@@ -0,0 +1,411 @@
+/* scaling.c */
+/* measures how whole runs of planet and test scale */
+
+/* scaling runs planet for each projection at map sizes from 512 x 512 */
+/* up, and test at each tessellation level, with 1 to N runs at once, */
+/* and records wall time, throughput (pixels or vertices per second of */
+/* all runs together), peak RSS and I/O bytes of each. For every series */
+/* it fits the exponent k of time ~ work^k and flags superlinear ones. */
+/* A run is skipped when the series so far predicts it would take more */
+/* than the budget, so the sweep ends in reasonable time. Build it with */
+/*   cc -O2 -o scaling scaling.c -lm                                    */
+
+/* A single planet map is made by one process (-N only shares tiles and */
+/* screened seeds), so n runs at once measure how the machine scales */
+/* with n renders, as when sizing hardware for several maps at a time. */
+
+/* Usage: scaling [options]                                             */
+/*   -P file  planet program (default ./planet, - for none)              */
+/*   -T file  test program (default ./test, - for none)                  */
+/*   -p list  projections (default mpqMSsogiac)                          */
+/*   -w n,..  map widths, each square (default 512,...,16384)            */
+/*   -l a,b   tessellation levels a to b (default 4,11)                  */
+/*   -n n,..  runs at once (default 1, 2, 4, ... up to the processors)   */
+/*   -b s     budget in seconds of a run (default 300)                  */
+/*   -e k     exponent above which a series is flagged (default 1.15)   */
+/*   -m s     fit only runs of at least s seconds, where start-up costs */
+/*            do not hide the growth (default 0.5)                     */
+/*   -j file  also write the results as JSON to file                    */
+/* Each run writes into a fresh directory under $TMPDIR (or /tmp), */
+/* removed after it; planet runs in the current directory, so it finds */
+/* its colour file there. I/O bytes are from /proc (Linux). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAXLIST 32
+#define MAXAT 256   /* most runs at once */
+#define MAXRUNS 4096
+
+typedef struct run
+{
+  char program;             /* 'p' planet or 't' test */
+  char projection;
+  int size;                 /* map width or tessellation level */
+  int at;                   /* runs at once */
+  double units;             /* pixels or vertices of one run */
+  double wall;              /* seconds until all had finished */
+  long maxrss, sumrss;      /* kB, largest and all together */
+  long long rchar, wchar;   /* bytes read and written by all */
+  int failed;               /* runs that did not exit with 0 */
+  double predicted;         /* if skipped, the time predicted */
+} run;
+
+run runs[MAXRUNS];
+int nruns = 0;
+char *planetProgram = "./planet", *testProgram = "./test";
+char *projections = "mpqMSsogiac";
+int sizes[MAXLIST], nsizes = 0, levels[2] = {4, 11}, ats[MAXLIST], nats = 0;
+double budget = 300.0, flagAbove = 1.15, minWall = 0.5;
+
+double now() /* seconds on a monotonic clock */
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec+1e-9*t.tv_nsec);
+}
+
+int readlist(char *s, int *list) /* comma separated numbers */
+{
+  int n = 0;
+
+  while (n < MAXLIST && *s) {
+    list[n++] = atoi(s);
+    while (*s && *s != ',') s++;
+    if (*s == ',') s++;
+  }
+  return(n);
+}
+
+void removedir(char *dir) /* removes dir and the files in it */
+{
+  DIR *d;
+  struct dirent *e;
+  char name[1024];
+
+  if ((d = opendir(dir)) != NULL) {
+    while ((e = readdir(d)) != NULL) {
+      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+        continue;
+      snprintf(name, sizeof(name), "%s/%s", dir, e->d_name);
+      unlink(name);
+    }
+    closedir(d);
+  }
+  rmdir(dir);
+}
+
+void readio(pid_t pid, long long *rchar, long long *wchar)
+{
+  char name[64], line[128];
+  long long v;
+  FILE *f;
+
+  snprintf(name, sizeof(name), "/proc/%d/io", (int)pid);
+  if ((f = fopen(name, "r")) == NULL) return;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "rchar: %lld", &v) == 1) *rchar += v;
+    else if (sscanf(line, "wchar: %lld", &v) == 1) *wchar += v;
+  }
+  fclose(f);
+}
+
+/* makes r->at runs of r's program at once and measures them */
+void measure(run *r)
+{
+  pid_t pids[MAXAT], pid;
+  char dirs[MAXAT][256], arg[32], out[300], *tmp = getenv("TMPDIR");
+  int k, left, status, fd;
+  siginfo_t info;
+  struct rusage ru;
+  double start;
+
+  r->maxrss = r->sumrss = 0;
+  r->rchar = r->wchar = 0;
+  r->failed = 0;
+  for (k=0; k<r->at; k++) {
+    snprintf(dirs[k], sizeof(dirs[k]), "%s/scalingXXXXXX", tmp ? tmp : "/tmp");
+    if (mkdtemp(dirs[k]) == NULL) {
+      fprintf(stderr, "Could not make directory %s, error code = %d\n",
+              dirs[k], errno);
+      exit(1);
+    }
+  }
+
+  start = now();
+  for (k=0; k<r->at; k++) {
+    if ((pids[k] = fork()) == 0) {
+      /* planet reads its colour file here; test writes where it runs */
+      if (r->program == 't' && chdir(dirs[k]) != 0) _exit(127);
+      fd = open("/dev/null", O_WRONLY);
+      dup2(fd, 1); dup2(fd, 2);
+      if (r->program == 'p') {
+        char size[16], projection[4] = {'-', 'p', r->projection, 0};
+        snprintf(size, sizeof(size), "%d", r->size);
+        snprintf(out, sizeof(out), "%s/map", dirs[k]);
+        execl(planetProgram, planetProgram, "-s", "0.21", projection,
+              "-w", size, "-h", size, "-o", out, (char *)NULL);
+      } else {
+        snprintf(arg, sizeof(arg), "%d", r->size);
+        execl(testProgram, testProgram, arg, (char *)NULL);
+      }
+      _exit(127);
+    }
+    if (pids[k] < 0) {
+      fprintf(stderr, "Could not start a run, error code = %d\n", errno);
+      exit(1);
+    }
+  }
+
+  /* read each run's I/O while it is a zombie, then reap it */
+  for (left = r->at; left > 0; left--) {
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_ALL, 0, &info, WEXITED|WNOWAIT) != 0) break;
+    pid = info.si_pid;
+    readio(pid, &r->rchar, &r->wchar);
+    wait4(pid, &status, 0, &ru);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) r->failed++;
+    r->sumrss += ru.ru_maxrss;
+    if (ru.ru_maxrss > r->maxrss) r->maxrss = ru.ru_maxrss;
+  }
+  r->wall = now()-start;
+
+  for (k=0; k<r->at; k++) removedir(dirs[k]);
+}
+
+/* exponent k of wall ~ units^k by least squares over the runs of a */
+/* series that were made (first to last), did not fail and took at */
+/* least minWall, or all of them if fewer did, or 0 if fewer than two */
+/* were made */
+double exponent(int first, int last, double *lastStep)
+{
+  double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0, x, y, least = minWall;
+  int k, n = 0, prev = -1;
+
+  for (k=first; k<=last; k++)
+    if (runs[k].predicted == 0.0 && !runs[k].failed
+        && runs[k].wall >= minWall) n++;
+  if (n < 2) least = 0.0;
+  n = 0;
+  *lastStep = 0.0;
+  for (k=first; k<=last; k++) {
+    if (runs[k].predicted > 0.0 || runs[k].failed || runs[k].wall < least)
+      continue;
+    x = log(runs[k].units); y = log(runs[k].wall);
+    sx += x; sy += y; sxx += x*x; sxy += x*y; n++;
+    if (prev >= 0)
+      *lastStep = (y-log(runs[prev].wall))/(x-log(runs[prev].units));
+    prev = k;
+  }
+  if (n < 2 || n*sxx-sx*sx <= 0.0) return(0.0);
+  return((n*sxy-sx*sy)/(n*sxx-sx*sx));
+}
+
+void printrun(run *r)
+{
+  char what[32];
+
+  if (r->program == 'p')
+    snprintf(what, sizeof(what), "planet -p%c %dx%d", r->projection,
+             r->size, r->size);
+  else snprintf(what, sizeof(what), "test level %d", r->size);
+  if (r->predicted > 0.0) {
+    printf("%-24s %3d  skipped (predicted %.0f s)\n", what, r->at,
+           r->predicted);
+    return;
+  }
+  printf("%-24s %3d %10.2f %14.0f %9.1f %9.1f %10.1f %10.1f%s\n", what,
+         r->at, r->wall, r->at*r->units/r->wall, r->maxrss/1024.0,
+         r->sumrss/1024.0, r->rchar/1048576.0, r->wchar/1048576.0,
+         r->failed ? "  FAILED" : "");
+  fflush(stdout);
+}
+
+/* runs a series of growing sizes (as units[]) with at runs at once, */
+/* skipping the rest once one is predicted to go over the budget */
+void series(char program, char projection, int at, int n, int *size,
+            double *units)
+{
+  int k, first = nruns;
+  double step = 1.0, predicted = 0.0, t;
+  run *r;
+
+  for (k=0; k<n && nruns < MAXRUNS; k++) {
+    r = &runs[nruns++];
+    r->program = program; r->projection = projection;
+    r->size = size[k]; r->at = at; r->units = units[k];
+    r->predicted = 0.0;
+    if (predicted == 0.0 && k > 0 && !runs[nruns-2].failed) {
+      /* from the last run, at least linear */
+      exponent(first, nruns-2, &step);
+      if (step < 1.0) step = 1.0;
+      t = runs[nruns-2].wall*pow(units[k]/units[k-1], step);
+      if (t > budget) predicted = t;
+    }
+    if (predicted > 0.0) {
+      r->predicted = predicted;
+      predicted *= (k+1 < n) ? pow(units[k+1]/units[k], step) : 1.0;
+    } else measure(r);
+    printrun(r);
+  }
+}
+
+void printseries(FILE *f, int first, int last, int json, int more)
+{
+  double e, step;
+  run *r = &runs[first];
+  int flag, k, failed = 0, made = 0;
+
+  /* the times of failed runs say nothing about scaling, so a series */
+  /* with any is reported as failed rather than with an exponent */
+  for (k=first; k<=last; k++)
+    if (runs[k].predicted == 0.0) {
+      made++;
+      if (runs[k].failed) failed++;
+    }
+  e = exponent(first, last, &step);
+  flag = !failed && e > flagAbove;
+  if (json) {
+    fprintf(f, "    {\"program\": \"%s\", \"projection\": \"%c\", "
+            "\"at_once\": %d, ", r->program == 'p' ? "planet" : "test",
+            r->program == 'p' ? r->projection : '-', r->at);
+    if (failed)
+      fprintf(f, "\"failed\": true, \"failed_runs\": %d, "
+              "\"runs\": %d}%s\n", failed, made, more ? "," : "");
+    else
+      fprintf(f, "\"failed\": false, \"exponent\": %.3f, "
+              "\"last_exponent\": %.3f, \"superlinear\": %s}%s\n", e, step,
+              flag ? "true" : "false", more ? "," : "");
+    return;
+  }
+  if (r->program == 'p')
+    fprintf(f, "planet -p%c, %3d at once: ", r->projection, r->at);
+  else fprintf(f, "test,      %3d at once: ", r->at);
+  if (failed)
+    fprintf(f, "FAILED (%d of %d runs)\n", failed, made);
+  else
+    fprintf(f, "time ~ work^%.2f (last step %.2f)%s\n", e, step,
+            flag ? "  SUPERLINEAR" : "");
+}
+
+int main(int ac, char **av)
+{
+  int i, k, a, n, first[MAXLIST*MAXLIST+MAXLIST], nseries = 0, sizeList[MAXLIST];
+  double units[MAXLIST];
+  char *jsonFile = NULL;
+  FILE *f;
+
+  for (i = 1; i<ac; i++) {
+    if (av[i][0] == '-' && i+1 < ac) {
+      switch (av[i][1]) {
+        case 'P' : planetProgram = av[++i]; break;
+        case 'T' : testProgram = av[++i]; break;
+        case 'p' : projections = av[++i]; break;
+        case 'w' : nsizes = readlist(av[++i], sizes); break;
+        case 'l' : if (readlist(av[++i], levels) != 2) {
+                     fprintf(stderr,"-l wants two levels: first,last\n");
+                     exit(1);
+                   }
+                   break;
+        case 'n' : nats = readlist(av[++i], ats); break;
+        case 'b' : sscanf(av[++i],"%lf",&budget); break;
+        case 'e' : sscanf(av[++i],"%lf",&flagAbove); break;
+        case 'm' : sscanf(av[++i],"%lf",&minWall); break;
+        case 'j' : jsonFile = av[++i]; break;
+        default: fprintf(stderr,"Unknown option: %s\n",av[i]);
+                 exit(1);
+      }
+    } else {
+      fprintf(stderr,"Unknown option: %s\n",av[i]);
+      exit(1);
+    }
+  }
+  if (strcmp(testProgram, "-") != 0 && testProgram[0] != '/') {
+    static char path[4096]; /* as test runs in another directory */
+    if (realpath(testProgram, path) == NULL) {
+      fprintf(stderr, "Could not find %s\n", testProgram);
+      exit(1);
+    }
+    testProgram = path;
+  }
+  if (nsizes == 0)
+    for (n = 512; n <= 16384; n *= 2) sizes[nsizes++] = n;
+  if (nats == 0) {
+    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (a = 1; a < n && nats < MAXLIST-1; a *= 2) ats[nats++] = a;
+    ats[nats++] = n > 1 ? n : 1;
+  }
+  for (k=0; k<nats; k++)
+    if (ats[k] < 1 || ats[k] > MAXAT) {
+      fprintf(stderr,"Runs at once must be 1 to %d\n", MAXAT);
+      exit(1);
+    }
+
+  printf("%-24s %3s %10s %14s %9s %9s %10s %10s\n", "run", "at", "wall s",
+         "units/s", "RSS MB", "all MB", "read MB", "written MB");
+  if (strcmp(planetProgram, "-") != 0)
+    for (i=0; projections[i] && i < MAXLIST; i++)
+      for (a=0; a<nats; a++) {
+        for (k=0; k<nsizes; k++) units[k] = (double)sizes[k]*sizes[k];
+        first[nseries++] = nruns;
+        series('p', projections[i], ats[a], nsizes, sizes, units);
+      }
+  if (strcmp(testProgram, "-") != 0)
+    for (a=0; a<nats; a++) {
+      for (n=0, k=levels[0]; k<=levels[1] && n<MAXLIST; k++, n++) {
+        sizeList[n] = k;
+        units[n] = 10.0*ldexp(1.0, 2*k)+2.0; /* vertices of level k */
+      }
+      first[nseries++] = nruns;
+      series('t', '-', ats[a], n, sizeList, units);
+    }
+  first[nseries] = nruns;
+
+  printf("\n");
+  for (k=0; k<nseries; k++)
+    printseries(stdout, first[k], first[k+1]-1, 0, 0);
+
+  if (jsonFile != NULL) {
+    if ((f = fopen(jsonFile, "w")) == NULL) {
+      fprintf(stderr, "Could not open %s, error code = %d\n", jsonFile, errno);
+      exit(1);
+    }
+    fprintf(f, "{\n  \"budget\": %g,\n  \"runs\": [\n", budget);
+    for (k=0; k<nruns; k++) {
+      run *r = &runs[k];
+      fprintf(f, "    {\"program\": \"%s\", \"projection\": \"%c\", "
+              "\"%s\": %d, \"at_once\": %d, \"units\": %.0f",
+              r->program == 'p' ? "planet" : "test",
+              r->program == 'p' ? r->projection : '-',
+              r->program == 'p' ? "size" : "level", r->size, r->at, r->units);
+      if (r->predicted > 0.0)
+        fprintf(f, ", \"skipped\": true, \"predicted_seconds\": %.1f}",
+                r->predicted);
+      else
+        fprintf(f, ", \"wall_seconds\": %.4f, \"units_per_second\": %.1f, "
+                "\"max_rss_kb\": %ld, \"all_rss_kb\": %ld, "
+                "\"read_bytes\": %lld, \"written_bytes\": %lld, "
+                "\"failed\": %d}", r->wall, r->at*r->units/r->wall,
+                r->maxrss, r->sumrss, r->rchar, r->wchar, r->failed);
+      fprintf(f, "%s\n", k+1 < nruns ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"series\": [\n");
+    for (k=0; k<nseries; k++)
+      printseries(f, first[k], first[k+1]-1, 1, k+1 < nseries);
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+  }
+  return(0);
+}
@@ -14,6 +14,19 @@ Stuff to do:
 #include <fstream>
 #include <iomanip>
 #include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 extern "C" {
   #include "libs/Planet/planet.h"
 }
@@ -27,12 +40,22 @@ using namespace std; // Moving this to line 200 was a suggested change but I'm r
 
 const double pi = 3.141592653589793;
 int Tessalation_Level = 7;
+const int maxTessalationLevel = 20; // highest level accepted on the command line
 int Calc_Level = Tessalation_Level + 15; // used by planet() to determine the level of detail for the terrain generation.
+bool showProgress = true; // if false, tessellateLevel() works silently (as in bench.cpp)
 const double radius = 1.0;
 const double heightMod = 1.0;
 bool triOrQuad = true; // if false the output will be quads, if true the output will be triangles
+bool useHeightCache = false; // if true (-k), the tessellated mesh is cached so a change of M only re-applies the sea level
+const int meshGenerator = 1; // version of the terrain and tessellation; change it whenever planet() or the tessellation
+                              // makes other vertices, so caches of the old ones are not used
 
-// Defines the latitude, longitude, and height of each vertex.
+// Heights are generated relative to sea level (tetrahedron heights of 0) and M is only added when the
+// mesh is written, so a cached mesh stays valid for any M. Adding M afterwards rounds differently from starting
+// the subdivision at M, so a few vertices are written differently in their last decimal than by the versions that
+// did (38 of the 217958 of level 7 with the default seed and M).
+
+// Defines the latitude, longitude, and height (relative to sea level) of each vertex.
 struct struct_VertexArray {
 //  int v_Index;
   double v_Lat, v_Long, v_Height;
@@ -67,6 +90,205 @@ v7s is the midpoint between v3s & v4s
 v8s is the midpoint between v4s & v1s
 v9s is the midpoint between v2s & v4s
 */
+// ******************************* Profiling ********************
+// Compile with -DTEST_PROFILE to time the phases of each tessellation level and count what they do, without a
+// profiler. At exit T<level>_S<seed>_Profile.json and T<level>_S<seed>_Profile.csv are written, with a row per
+// level (level 0 is everything outside the levels: the icosahedron, the height cache and the .OBJ). Without
+// TEST_PROFILE the macros below are empty and nothing is timed.
+
+enum profilePhase { phaseLevel, phaseEdgeSearch, phaseMidpoint, phasePlanet, phaseCacheLoad, phaseCacheSave, phaseWriteOBJ, phaseCount };
+enum profileCounter { counterPlanetCalls, counterEdgeSearches, counterEdgesFound, counterReallocations, counterReallocatedBytes,
+                      counterBytesRead, counterBytesWritten, counterVertices, counterFaces, counterCount };
+
+#ifdef TEST_PROFILE
+const char *phaseNames[phaseCount] = { "level", "checkEdgeDivide", "midpointCalc", "planet", "cacheLoad", "cacheSave", "writeOBJ" };
+const char *counterNames[counterCount] = { "planet_calls", "edge_searches", "edges_found", "reallocations", "reallocated_bytes",
+                                           "bytes_read", "bytes_written", "vertices", "faces" };
+const int profileLevels = 32;
+double profileSeconds[profileLevels][phaseCount];
+long long profileCounts[profileLevels][counterCount];
+int profileLevel = 0; // level being tessellated, 0 outside tessellateLevel()
+
+// adds the time from its construction to its destruction to a phase of the current level
+struct struct_ScopedTimer {
+  int phase;
+  chrono::steady_clock::time_point start;
+  struct_ScopedTimer(int p) : phase(p), start(chrono::steady_clock::now()) {}
+  ~struct_ScopedTimer() { profileSeconds[profileLevel][phase] += chrono::duration<double>(chrono::steady_clock::now() - start).count(); }
+};
+
+// counts the reallocations of a vector (and the bytes they copy) when check() is called after each few push_backs
+template <class T> struct struct_CapacityWatch {
+  const vector<T> &v;
+  size_t seen;
+  struct_CapacityWatch(const vector<T> &vec) : v(vec), seen(vec.capacity()) {}
+  void check() {
+    if (v.capacity() == seen) return;
+    if (seen > 0) {
+      profileCounts[profileLevel][counterReallocations]++;
+      profileCounts[profileLevel][counterReallocatedBytes] += seen * sizeof(T);
+    }
+    seen = v.capacity();
+  }
+};
+template <class T> struct_CapacityWatch<T> watchCapacity(const vector<T> &v) { return struct_CapacityWatch<T>(v); }
+
+void writeProfile();
+
+#define PROFILE_SCOPE(phase) struct_ScopedTimer profileTimer(phase)
+#define PROFILE_COUNT(counter, n) (profileCounts[profileLevel][counter] += (n))
+#define PROFILE_SET(counter, n) (profileCounts[profileLevel][counter] = (n))
+#define PROFILE_LEVEL(level) (profileLevel = std::min(std::max(level, 0), profileLevels - 1))
+#define PROFILE_WATCH(watch, v) auto watch = watchCapacity(v)
+#define PROFILE_CHECK(watch) watch.check()
+#define PROFILE_AT_EXIT() atexit(writeProfile)
+#else
+#define PROFILE_SCOPE(phase)
+#define PROFILE_COUNT(counter, n)
+#define PROFILE_SET(counter, n)
+#define PROFILE_LEVEL(level)
+#define PROFILE_WATCH(watch, v)
+#define PROFILE_CHECK(watch)
+#define PROFILE_AT_EXIT()
+#endif
+
+// ******************************* Progress ********************
+// The loops only store how far they are in relaxed atomics, a slot per thread. A reporter thread reads the
+// slots every progressRefresh and writes a progress line, or with -p json a JSON line, to stderr, with the
+// rate, the time left (of the level and of the run) and the resident memory. With -p none, or showProgress
+// false, there is no reporter.
+
+enum progressFormat { progressNone, progressText, progressJSON };
+progressFormat progressMode = progressText;
+const chrono::milliseconds progressRefresh(250);
+
+struct struct_ProgressSlot { // how far one thread is
+  atomic<const char*> name{nullptr};
+  atomic<long long> done{0}, total{0};
+  void start(long long n) { done.store(0, memory_order_relaxed); total.store(n, memory_order_relaxed); }
+  void set(long long n) { done.store(n, memory_order_relaxed); }
+};
+
+const int progressSlots = 8;
+struct_ProgressSlot progressSlot[progressSlots];
+atomic<int> progressLevel{0}; // tessellation level being made, 0 once the levels are done
+
+// the slot of name, taken from the free ones the first time
+struct_ProgressSlot &progressClaim(const char *name) {
+  for (int k = 0; k < progressSlots; k++) {
+    const char *expected = nullptr;
+    if (progressSlot[k].name.compare_exchange_strong(expected, name) || strcmp(expected, name) == 0)
+      return progressSlot[k];
+  }
+  return progressSlot[progressSlots - 1]; // shared by the rest
+}
+
+long long residentBytes() {
+#ifdef __linux__
+  ifstream statm("/proc/self/statm");
+  long long pages, resident;
+  if (statm >> pages >> resident) return resident * sysconf(_SC_PAGESIZE);
+#endif
+  return 0;
+}
+
+struct struct_ProgressReporter {
+  thread reporter;
+  mutex lock;
+  condition_variable wake;
+  bool stopping = false;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  long long lastDone = 0; // of the first busy slot, at the last report
+  double lastSeconds = 0.0, rate = 0.0; // items per second, smoothed
+  int lastLevel = 0;
+  size_t lineLength = 0;
+
+  struct_ProgressReporter() {
+    if (showProgress && progressMode != progressNone) reporter = thread([this] { run(); });
+  }
+  ~struct_ProgressReporter() { stop(); }
+  void stop() { // writes the last report
+    if (!reporter.joinable()) return;
+    { lock_guard<mutex> guard(lock); stopping = true; }
+    wake.notify_one();
+    reporter.join();
+  }
+  void run() {
+    unique_lock<mutex> guard(lock);
+    while (!wake.wait_for(guard, progressRefresh, [this] { return stopping; })) report(false);
+    report(true);
+  }
+  void report(bool last) {
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    int level = progressLevel.load(memory_order_relaxed);
+    int busy = -1;
+    for (int k = 0; k < progressSlots; k++) {
+      long long total = progressSlot[k].total.load(memory_order_relaxed);
+      if (busy < 0 && total > 0 && progressSlot[k].done.load(memory_order_relaxed) < total) busy = k;
+    }
+    long long done = busy < 0 ? 0 : progressSlot[busy].done.load(memory_order_relaxed);
+    long long total = busy < 0 ? 0 : progressSlot[busy].total.load(memory_order_relaxed);
+    if (level != lastLevel || done < lastDone) { lastDone = 0; rate = 0.0; lastLevel = level; }
+    if (seconds > lastSeconds) {
+      double now = (done - lastDone) / (seconds - lastSeconds);
+      rate = rate == 0.0 ? now : 0.7 * rate + 0.3 * now;
+    }
+    lastDone = done;
+    lastSeconds = seconds;
+    // each level has four times the faces of the one before
+    double left = static_cast<double>(total - done), runLeft = left;
+    double faces = 4.0 * total;
+    for (int l = level + 1; level > 0 && l <= Tessalation_Level; l++, faces *= 4.0) runLeft += faces;
+    double eta = rate > 0.0 ? left / rate : -1.0, runEta = rate > 0.0 ? runLeft / rate : -1.0;
+    long long rss = residentBytes();
+
+    ostringstream out;
+    out << fixed << setprecision(3);
+    if (progressMode == progressJSON) {
+      out << "{\"seconds\": " << seconds << ", \"event\": \"" << (last ? "done" : "progress") << "\", \"level\": " << level
+          << ", \"levels\": " << Tessalation_Level << ", \"phase\": \"" << (busy < 0 ? "" : progressSlot[busy].name.load())
+          << "\", \"done\": " << done << ", \"total\": " << total << ", \"rate\": " << rate
+          << ", \"eta_seconds\": " << eta << ", \"run_eta_seconds\": " << runEta << ", \"rss_bytes\": " << rss << ", \"threads\": [";
+      bool first = true;
+      for (int k = 0; k < progressSlots; k++) {
+        const char *name = progressSlot[k].name.load();
+        if (name == nullptr) continue;
+        out << (first ? "" : ", ") << "{\"name\": \"" << name << "\", \"done\": " << progressSlot[k].done.load(memory_order_relaxed)
+            << ", \"total\": " << progressSlot[k].total.load(memory_order_relaxed) << "}";
+        first = false;
+      }
+      out << "]}\n";
+      cerr << out.str() << flush;
+      return;
+    }
+    if (last) {
+      if (lineLength > 0) cerr << "\n" << flush;
+      return;
+    }
+    if (busy < 0) return;
+    if (level > 0) out << "  Tessellation Level " << level << " of " << Tessalation_Level;
+    else out << "  " << progressSlot[busy].name.load();
+    out << " | " << done << " / " << total << " | " << setprecision(1) << 100.0 * done / total << "%"
+        << " | " << setprecision(0) << rate << "/s";
+    if (eta >= 0.0) {
+      out << " | ETA " << setprecision(1) << eta << " s";
+      if (runEta > eta) out << " (run " << runEta << " s)";
+    }
+    if (rss > 0) out << " | RSS " << setprecision(1) << rss / 1048576.0 << " MB";
+    for (int k = 0; k < progressSlots; k++) { // the other threads
+      const char *name = progressSlot[k].name.load();
+      long long n = progressSlot[k].total.load(memory_order_relaxed);
+      if (k != busy && name != nullptr && n > 0 && progressSlot[k].done.load(memory_order_relaxed) < n)
+        out << " | " << name << " " << setprecision(0) << 100.0 * progressSlot[k].done.load(memory_order_relaxed) / n << "%";
+    }
+    string line = out.str();
+    size_t length = line.size();
+    if (line.size() < lineLength) line.append(lineLength - line.size(), ' '); // over the longer line before
+    lineLength = length;
+    cerr << line << "\r" << flush;
+  }
+};
+
 // ******************************* Functions ********************
 
 // convert lat/long to xyz
@@ -83,6 +305,13 @@ llxyz ll_to_xyz(double lat, double lon){
   return {lat, lon, x, y, z};
 }
 
+// height of the terrain at coord, relative to sea level
+planet_out planetAt(const llxyz &coord) {
+  PROFILE_SCOPE(phasePlanet);
+  PROFILE_COUNT(counterPlanetCalls, 1);
+  return planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+}
+
 // Generates the 12 vertices of a regular icosahedron, aligned so that one vertex is at the north pole of the sphere and two vertices are aligned opposite each other on the z-axis
 vector<struct_VertexArray> generate_initial_icosahedron_vertices() { // function named "generate_icosahedron_vertices" using vector<Vertex> instead of void.
   vector<struct_VertexArray> VertexArray; // initializes vartype:vector using struct_VertexArray.
@@ -107,53 +336,53 @@ South_Long5 = (9*pi)/5;
 
 // Northern vertices
     llxyz coord = ll_to_xyz(pi/2.0, 0.0);
-    planet_out result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    planet_out result = planetAt(coord);
     VertexArray.push_back({ pi/2.0, 0.0, (result.h * heightMod) * radius });        // North pole      (0)
 //           cout << planetgen::get_planet_height(pi/2, 0, seed) * 100 * height << endl;
 //           cout << height << endl;
     coord = ll_to_xyz(x1, 0.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ x1, 0.0, (result.h * heightMod) * radius  });            // North point 1   (1)
     
     coord = ll_to_xyz(x1, (2.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ x1, (2.0*pi)/5.0, (result.h * heightMod) * radius });   // North point 2   (2)
 
     coord = ll_to_xyz(x1, (4.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ x1, (4.0*pi)/5.0, (result.h * heightMod) * radius });   // North point 3   (3)
 
     coord = ll_to_xyz(x1, (6.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ x1, (6.0*pi)/5.0, (result.h * heightMod) * radius });   // North point 4   (4)
 
     coord = ll_to_xyz(x1, (8.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ x1, (8.0*pi)/5.0, (result.h * heightMod) * radius });   // North point 5   (5)
     
 // Southern vertices
     coord = ll_to_xyz(-x1, pi/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ -x1, pi/5.0, (result.h * heightMod) * radius });        // South point 1.5 (6)
     
     coord = ll_to_xyz(-x1, (3.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ -x1, (3.0*pi)/5.0, (result.h * heightMod) * radius });  // South point 2.5 (7)
 
     coord = ll_to_xyz(-x1, (5.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ -x1, (5.0*pi)/5.0, (result.h * heightMod) * radius });  // South point 3.5 (8)
 
     coord = ll_to_xyz(-x1, (7.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ -x1, (7.0*pi)/5.0, (result.h * heightMod) * radius });  // South point 4.5 (9)
 
     coord = ll_to_xyz(-x1, (9.0*pi)/5.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ -x1, (9.0*pi)/5.0, (result.h * heightMod) * radius });  // South point 5.5 (10)
 
     coord = ll_to_xyz(-pi/2.0, 0.0);
-    result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
+    result = planetAt(coord);
     VertexArray.push_back({ -pi/2.0, 0.0, (result.h * heightMod) * radius });       // South pole      (11)
 
  return VertexArray;   
@@ -181,6 +410,7 @@ vector<struct_FaceArray> associate_initial_faces() { // This is a function.
 // Function to find the midpoint between two points : output is vertex<double> (Lat, Long)
 // input and output in radians
 vector<double> midpointCalc(double Lat_1, double Long_1, double Lat_2, double Long_2) { // Function
+  PROFILE_SCOPE(phaseMidpoint);
   double dLong = Long_2 - Long_1;
   double Bx = cos(Lat_2)*cos(dLong);
   double By = cos(Lat_2)*sin(dLong);
@@ -220,6 +450,8 @@ vector<double> midpointCalc(double Lat_1, double Long_1, double Lat_2, double Lo
 // OR return a value of -1 if it hasn't.
  int checkEdgeDivide(vector<struct_EdgeArray> &edgeList, int tempOne, int tempTwo) // 3 input arguments (name of array to check (EdgeArray), target start, target end)
  {
+    PROFILE_SCOPE(phaseEdgeSearch);
+    PROFILE_COUNT(counterEdgeSearches, 1);
     // std::find_if searches for the first element in edgeList that satisfies the lambda condition
     int targetOne, targetTwo;
     if (tempOne < tempTwo) {
@@ -238,86 +470,278 @@ vector<double> midpointCalc(double Lat_1, double Long_1, double Lat_2, double Lo
 
     // Check if an edge was found (i.e., iterator is not at the end)
     if (it != edgeList.end()) {
+        PROFILE_COUNT(counterEdgesFound, 1);
         return it->v_Mid;  // Return the midpoint value of the matching edge
     } else {
         return -1;         // Return -1 to indicate edge was not found
     }
 }
 
-// Function 
+// Name of the height cache for the current seed and tessellation settings.
+string heightCacheName() {
+  ostringstream CFN;
+  CFN << "T" << Tessalation_Level << "_S" << rseed << "_HeightCache.bin";
+  return CFN.str();
+}
 
+// Saves the final vertices (heights relative to sea level) and faces so the next run can skip tessellation.
+void saveHeightCache(const vector<struct_VertexArray> &VertexArray, const vector<struct_FaceArray> &FaceArray_current) {
+  PROFILE_SCOPE(phaseCacheSave);
+  ofstream cacheFile(heightCacheName(), ios::binary);
+  if (!cacheFile.is_open()) {
+    cerr << "Unable to open " << heightCacheName() << " for writing.\n";
+    return;
+  }
+  size_t vcount = VertexArray.size();
+  size_t fcount = FaceArray_current.size();
+  cacheFile.write("ICOHCACHE2", 10);
+  cacheFile.write(reinterpret_cast<const char*>(&meshGenerator), sizeof(meshGenerator));
+  cacheFile.write(reinterpret_cast<const char*>(&rseed), sizeof(rseed));
+  cacheFile.write(reinterpret_cast<const char*>(&heightMod), sizeof(heightMod));
+  cacheFile.write(reinterpret_cast<const char*>(&radius), sizeof(radius));
+  cacheFile.write(reinterpret_cast<const char*>(&Tessalation_Level), sizeof(Tessalation_Level));
+  cacheFile.write(reinterpret_cast<const char*>(&Calc_Level), sizeof(Calc_Level));
+  cacheFile.write(reinterpret_cast<const char*>(&vcount), sizeof(vcount));
+  cacheFile.write(reinterpret_cast<const char*>(&fcount), sizeof(fcount));
+  cacheFile.write(reinterpret_cast<const char*>(VertexArray.data()), vcount * sizeof(struct_VertexArray));
+  cacheFile.write(reinterpret_cast<const char*>(FaceArray_current.data()), fcount * sizeof(struct_FaceArray));
+  PROFILE_COUNT(counterBytesWritten, static_cast<long long>(cacheFile.tellp()));
+}
 
+// Loads a height cache written by saveHeightCache. Returns false if there is no cache for these settings.
+bool loadHeightCache(vector<struct_VertexArray> &VertexArray, vector<struct_FaceArray> &FaceArray_current) {
+  PROFILE_SCOPE(phaseCacheLoad);
+  ifstream cacheFile(heightCacheName(), ios::binary);
+  if (!cacheFile.is_open()) return false;
+  char magic[10];
+  double c_rseed, c_heightMod, c_radius;
+  int c_meshGenerator, c_Tessalation_Level, c_Calc_Level;
+  size_t vcount, fcount;
+  cacheFile.read(magic, 10);
+  cacheFile.read(reinterpret_cast<char*>(&c_meshGenerator), sizeof(c_meshGenerator));
+  cacheFile.read(reinterpret_cast<char*>(&c_rseed), sizeof(c_rseed));
+  cacheFile.read(reinterpret_cast<char*>(&c_heightMod), sizeof(c_heightMod));
+  cacheFile.read(reinterpret_cast<char*>(&c_radius), sizeof(c_radius));
+  cacheFile.read(reinterpret_cast<char*>(&c_Tessalation_Level), sizeof(c_Tessalation_Level));
+  cacheFile.read(reinterpret_cast<char*>(&c_Calc_Level), sizeof(c_Calc_Level));
+  cacheFile.read(reinterpret_cast<char*>(&vcount), sizeof(vcount));
+  cacheFile.read(reinterpret_cast<char*>(&fcount), sizeof(fcount));
+  if (!cacheFile || string(magic, 10) != "ICOHCACHE2" || c_meshGenerator != meshGenerator) {
+    cerr << heightCacheName() << " is not a height cache of this version; tessellating again.\n";
+    return false;
+  }
+  if (c_rseed != rseed || c_heightMod != heightMod
+      || c_radius != radius || c_Tessalation_Level != Tessalation_Level || c_Calc_Level != Calc_Level) {
+    return false; // cache belongs to other settings
+  }
+  VertexArray.resize(vcount);
+  FaceArray_current.resize(fcount);
+  cacheFile.read(reinterpret_cast<char*>(VertexArray.data()), vcount * sizeof(struct_VertexArray));
+  cacheFile.read(reinterpret_cast<char*>(FaceArray_current.data()), fcount * sizeof(struct_FaceArray));
+  PROFILE_COUNT(counterBytesRead, static_cast<long long>(cacheFile.tellg()));
+  return static_cast<bool>(cacheFile);
+}
 
-// **************************************************************************************
+// ******************************* Checkpoints ********************
+// With -c seconds the mesh is saved to T<level>_S<seed>_Checkpoint.bin after each level, and every that many
+// seconds within a level (0 for only between levels) with the faces split so far and the faces and edges they
+// made. -r goes on from it and makes the same mesh as a run that was never stopped. The mesh after a level is
+// written under another name and renamed, so a save that is cut short leaves the one before; within a level only
+// the vertices, faces and edges added since the last checkpoint are appended to it, and -r ignores a record that
+// was cut short. The file is removed once the .OBJ is written.
+
+double checkpointInterval = -1.0; // seconds, or -1 for no checkpoints
+bool resumeRun = false;
+int checkpointCount = 0;
+long long checkpointBytes = 0;
+double checkpointSeconds = 0.0; // spent saving
+chrono::steady_clock::time_point lastCheckpoint = chrono::steady_clock::now();
+bool checkpointWhole = false; // if true, the file holds this run's mesh and records can be appended to it
+size_t checkpointVertices = 0, checkpointFaces = 0, checkpointEdges = 0; // as far as the file has them
+
+struct struct_LevelState { // how far the next level is
+  int levelsDone = 0; // levels made in VertexArray and FaceArray_current
+  int fcount = 0;     // faces of FaceArray_current split for the next level
+  vector<struct_FaceArray> FaceArray_new;
+  vector<struct_EdgeArray> EdgeArray;
+};
 
-int main() {
-  initialize_vertices(); // Initialize the tetrahedron vertices and seed for planet generation
-  llxyz coord;
+string checkpointName() {
+  ostringstream CFN;
+  CFN << "T" << Tessalation_Level << "_S" << rseed << "_Checkpoint.bin";
+  return CFN.str();
+}
 
-//  using namespace std;  // commented out until I can figure out what's going on.
-// Generate the inital 12 vertices and original 10 faces.  
-  vector<struct_VertexArray> VertexArray = generate_initial_icosahedron_vertices(); // Generate initial vertices
-  vector<struct_FaceArray> FaceArray_current = associate_initial_faces(); // Associate initial faces
-  
-  cout << "Is Triangles: " << triOrQuad << endl << endl;
-  /*/ **************************    initialization testing
-  int vcount = 1;
-  int fcount = 1;
-  // Print the index, Lat, Long, and Height of each vertex
-  for (struct_VertexArray vertex_loop : VertexArray) {
-    cout << "v" << vcount << " " << vertex_loop.v_Index << " " << vertex_loop.v_Lat << " " << vertex_loop.v_Long << " " << vertex_loop.v_Height << endl;
-    vcount++;  };
-        
-  for (struct_FaceArray face_loop : FaceArray_current) { // int f_Index, v1, v2, v3, v4;
-      cout << "f" << fcount << " " << face_loop.f_Index << " " << face_loop.v1 << " " << face_loop.v2 << " " << face_loop.v3 << " " << face_loop.v4 << endl;
-      fcount++;  };
-  
- // midpoint test.
-  cout << "Lat_1:0.0, Long_1:1.0, Lat_2:1.0, Long_2:2.0" << " : " << midpoint_Lat(0.0, 1.0, 1.0, 2.0) << endl;
-  cout << "Lat_1:0.0, Long_1:1.0, Lat_2:1.0, Long_2:2.0" << " : " << midpoint_Long(0.0, 1.0, 1.0, 2.0) << endl;
-  // End of initialization testing */ 
- 
-cout << "Initialization of icosahedron complete." << endl;
-cout << VertexArray.size() << " vertices calculated." << endl;
-cout << FaceArray_current.size() << " faces created." << endl << endl;
+bool checkpointDue() {
+  return chrono::duration<double>(chrono::steady_clock::now() - lastCheckpoint).count() >= checkpointInterval;
+}
 
-  // ******************** Start of Tessalation *********************
-  
-  for ( int Tessalation_Level_current = Tessalation_Level; Tessalation_Level_current > 0; Tessalation_Level_current--)
-  {
+void saveCheckpoint(const vector<struct_VertexArray> &VertexArray, const vector<struct_FaceArray> &FaceArray_current, const struct_LevelState &state) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  string name = checkpointName(), temp = name + ".tmp";
+  ofstream checkFile(temp, ios::binary);
+  if (!checkFile.is_open()) {
+    cerr << "Unable to open " << temp << " for writing.\n";
+    return;
+  }
+  size_t counts[4] = { VertexArray.size(), FaceArray_current.size(), state.FaceArray_new.size(), state.EdgeArray.size() };
+  checkFile.write("ICOCHECK01", 10);
+  checkFile.write(reinterpret_cast<const char*>(&rseed), sizeof(rseed));
+  checkFile.write(reinterpret_cast<const char*>(&heightMod), sizeof(heightMod));
+  checkFile.write(reinterpret_cast<const char*>(&radius), sizeof(radius));
+  checkFile.write(reinterpret_cast<const char*>(&Tessalation_Level), sizeof(Tessalation_Level));
+  checkFile.write(reinterpret_cast<const char*>(&Calc_Level), sizeof(Calc_Level));
+  checkFile.write(reinterpret_cast<const char*>(&state.levelsDone), sizeof(state.levelsDone));
+  checkFile.write(reinterpret_cast<const char*>(&state.fcount), sizeof(state.fcount));
+  checkFile.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+  checkFile.write(reinterpret_cast<const char*>(VertexArray.data()), counts[0] * sizeof(struct_VertexArray));
+  checkFile.write(reinterpret_cast<const char*>(FaceArray_current.data()), counts[1] * sizeof(struct_FaceArray));
+  checkFile.write(reinterpret_cast<const char*>(state.FaceArray_new.data()), counts[2] * sizeof(struct_FaceArray));
+  checkFile.write(reinterpret_cast<const char*>(state.EdgeArray.data()), counts[3] * sizeof(struct_EdgeArray));
+  long long bytes = checkFile.tellp();
+  checkFile.close();
+  checkpointWhole = false;
+  if (!checkFile || rename(temp.c_str(), name.c_str()) != 0) {
+    cerr << "Unable to write " << name << ".\n";
+    return;
+  }
+  checkpointWhole = true;
+  checkpointVertices = counts[0];
+  checkpointFaces = counts[2];
+  checkpointEdges = counts[3];
+  checkpointCount++;
+  checkpointBytes += bytes;
+  lastCheckpoint = chrono::steady_clock::now();
+  checkpointSeconds += chrono::duration<double>(lastCheckpoint - start).count();
+}
+
+// Appends what the level has added since the last checkpoint, or saves it all if the file is not this run's.
+void appendCheckpoint(const vector<struct_VertexArray> &VertexArray, const vector<struct_FaceArray> &FaceArray_current, const struct_LevelState &state) {
+  if (!checkpointWhole) {
+    saveCheckpoint(VertexArray, FaceArray_current, state);
+    return;
+  }
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  string name = checkpointName();
+  ofstream checkFile(name, ios::binary | ios::app);
+  if (!checkFile.is_open()) {
+    cerr << "Unable to open " << name << " for writing.\n";
+    return;
+  }
+  size_t counts[3] = { VertexArray.size(), state.FaceArray_new.size(), state.EdgeArray.size() };
+  checkFile.write("ICODELTA01", 10);
+  checkFile.write(reinterpret_cast<const char*>(&state.fcount), sizeof(state.fcount));
+  checkFile.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+  checkFile.write(reinterpret_cast<const char*>(VertexArray.data() + checkpointVertices), (counts[0] - checkpointVertices) * sizeof(struct_VertexArray));
+  checkFile.write(reinterpret_cast<const char*>(state.FaceArray_new.data() + checkpointFaces), (counts[1] - checkpointFaces) * sizeof(struct_FaceArray));
+  checkFile.write(reinterpret_cast<const char*>(state.EdgeArray.data() + checkpointEdges), (counts[2] - checkpointEdges) * sizeof(struct_EdgeArray));
+  long long bytes = 10 + sizeof(state.fcount) + sizeof(counts) + (counts[0] - checkpointVertices) * sizeof(struct_VertexArray)
+                    + (counts[1] - checkpointFaces) * sizeof(struct_FaceArray) + (counts[2] - checkpointEdges) * sizeof(struct_EdgeArray);
+  checkFile.close();
+  if (!checkFile) {
+    cerr << "Unable to write " << name << ".\n";
+    checkpointWhole = false; // the next checkpoint saves it all again
+    return;
+  }
+  checkpointVertices = counts[0];
+  checkpointFaces = counts[1];
+  checkpointEdges = counts[2];
+  checkpointCount++;
+  checkpointBytes += bytes;
+  lastCheckpoint = chrono::steady_clock::now();
+  checkpointSeconds += chrono::duration<double>(lastCheckpoint - start).count();
+}
+
+// Loads the checkpoint of these settings into VertexArray, FaceArray_current and state, with the records appended
+// to it. Returns false if there is none.
+bool loadCheckpoint(vector<struct_VertexArray> &VertexArray, vector<struct_FaceArray> &FaceArray_current, struct_LevelState &state) {
+  ifstream checkFile(checkpointName(), ios::binary);
+  if (!checkFile.is_open()) return false;
+  char magic[10];
+  double c_rseed, c_heightMod, c_radius;
+  int c_Tessalation_Level, c_Calc_Level;
+  size_t counts[4];
+  checkFile.read(magic, 10);
+  checkFile.read(reinterpret_cast<char*>(&c_rseed), sizeof(c_rseed));
+  checkFile.read(reinterpret_cast<char*>(&c_heightMod), sizeof(c_heightMod));
+  checkFile.read(reinterpret_cast<char*>(&c_radius), sizeof(c_radius));
+  checkFile.read(reinterpret_cast<char*>(&c_Tessalation_Level), sizeof(c_Tessalation_Level));
+  checkFile.read(reinterpret_cast<char*>(&c_Calc_Level), sizeof(c_Calc_Level));
+  checkFile.read(reinterpret_cast<char*>(&state.levelsDone), sizeof(state.levelsDone));
+  checkFile.read(reinterpret_cast<char*>(&state.fcount), sizeof(state.fcount));
+  checkFile.read(reinterpret_cast<char*>(counts), sizeof(counts));
+  if (!checkFile || string(magic, 10) != "ICOCHECK01" || c_rseed != rseed || c_heightMod != heightMod
+      || c_radius != radius || c_Tessalation_Level != Tessalation_Level || c_Calc_Level != Calc_Level
+      || state.levelsDone < 0 || state.levelsDone > Tessalation_Level || state.fcount < 0
+      || static_cast<size_t>(state.fcount) > counts[1]) {
+    return false; // checkpoint of other settings
+  }
+  VertexArray.resize(counts[0]);
+  FaceArray_current.resize(counts[1]);
+  state.FaceArray_new.resize(counts[2]);
+  state.EdgeArray.resize(counts[3]);
+  checkFile.read(reinterpret_cast<char*>(VertexArray.data()), counts[0] * sizeof(struct_VertexArray));
+  checkFile.read(reinterpret_cast<char*>(FaceArray_current.data()), counts[1] * sizeof(struct_FaceArray));
+  checkFile.read(reinterpret_cast<char*>(state.FaceArray_new.data()), counts[2] * sizeof(struct_FaceArray));
+  checkFile.read(reinterpret_cast<char*>(state.EdgeArray.data()), counts[3] * sizeof(struct_EdgeArray));
+  if (!checkFile) return false;
+  for (;;) { // records of the level, up to the first that is not whole
+    int fcount;
+    size_t added[3];
+    checkFile.read(magic, 10);
+    checkFile.read(reinterpret_cast<char*>(&fcount), sizeof(fcount));
+    checkFile.read(reinterpret_cast<char*>(added), sizeof(added));
+    if (!checkFile || string(magic, 10) != "ICODELTA01" || fcount < state.fcount
+        || static_cast<size_t>(fcount) > FaceArray_current.size() || added[0] < VertexArray.size()
+        || added[1] < state.FaceArray_new.size() || added[2] < state.EdgeArray.size())
+      break;
+    size_t had[3] = { VertexArray.size(), state.FaceArray_new.size(), state.EdgeArray.size() };
+    VertexArray.resize(added[0]);
+    state.FaceArray_new.resize(added[1]);
+    state.EdgeArray.resize(added[2]);
+    checkFile.read(reinterpret_cast<char*>(VertexArray.data() + had[0]), (added[0] - had[0]) * sizeof(struct_VertexArray));
+    checkFile.read(reinterpret_cast<char*>(state.FaceArray_new.data() + had[1]), (added[1] - had[1]) * sizeof(struct_FaceArray));
+    checkFile.read(reinterpret_cast<char*>(state.EdgeArray.data() + had[2]), (added[2] - had[2]) * sizeof(struct_EdgeArray));
+    if (!checkFile) { // cut short: go on from the record before
+      VertexArray.resize(had[0]);
+      state.FaceArray_new.resize(had[1]);
+      state.EdgeArray.resize(had[2]);
+      break;
+    }
+    state.fcount = fcount;
+  }
+  return true;
+}
+
+// Subdivides every quad of FaceArray_current from firstFace on into four in FaceArray_new, keeping the edges split
+// in EdgeArray. newVertex(lat, long) adds each new vertex and returns its index; VertexArray only has to hold the
+// vertices of FaceArray_current. afterFace(n) is called when n faces are split.
+template <class NewVertex, class AfterFace>
+void subdivideFaces(const vector<struct_VertexArray> &VertexArray, const vector<struct_FaceArray> &FaceArray_current,
+                    vector<struct_FaceArray> &FaceArray_new, vector<struct_EdgeArray> &EdgeArray, int firstFace,
+                    NewVertex newVertex, AfterFace afterFace, struct_ProgressSlot &progress)
+{
   // Step 1: Determine number of faces to subdivide and apply that to a count number
   int fcountMax = FaceArray_current.size();
-  float fcountPercent = 0.0;
-  vector <struct_EdgeArray> EdgeArray;
-  vector <struct_FaceArray> FaceArray_new;
+  progress.start(fcountMax);
+  progress.set(firstFace);
+  PROFILE_WATCH(watchVertices, VertexArray);
+  PROFILE_WATCH(watchEdges, EdgeArray);
+  PROFILE_WATCH(watchFaces, FaceArray_new);
     
   // Step 2: Face Subdivide Loop
-  int progressInterval = std::max(1, std::min(5000, fcountMax / 100));
-  for ( int fcount = 0; fcount < fcountMax; fcount++)
+  for ( int fcount = firstFace; fcount < fcountMax; fcount++)
 {
-       if (fcount % progressInterval == 0) {
-        fcountPercent = (static_cast<float>(fcount) / fcountMax) * 100.0;
-        cout << "  Tessellation Level " << (Tessalation_Level - Tessalation_Level_current + 1)
-             << " | Face " << fcount << " / " << fcountMax
-             << " | Current vertex count: " << VertexArray.size() 
-             << " | " << fcountPercent << "%" << "\r" << flush;
-    }
       int v_I1 = FaceArray_current.at(fcount).v1; // index of vertex 1 on parent face (North)
       int v_I2 = FaceArray_current.at(fcount).v2; // index of vertex 2 on parent face (East)
       int v_I3 = FaceArray_current.at(fcount).v3; // index of vertex 3 on parent face (South)
       int v_I4 = FaceArray_current.at(fcount).v4; // index of vertex 4 on parent face (West) 
       int v_I5 = -1;
-      double elevation = 1.0; // value here is irrellevant and only used to initialize the variable.
       int edgecheck = checkEdgeDivide(EdgeArray, v_I1, v_I2);
       if (edgecheck == -1)
       {
           vector<double> midpoint_temp = midpointCalc(VertexArray.at(v_I1).v_Lat, VertexArray.at(v_I1).v_Long, VertexArray.at(v_I2).v_Lat, VertexArray.at(v_I2).v_Long);
-          coord = ll_to_xyz(midpoint_temp.at(0), midpoint_temp.at(1));
-          planet_out result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
-          elevation = result.h * heightMod * radius; // generate the height value at the coordinates
-          VertexArray.push_back({ midpoint_temp.at(0), midpoint_temp.at(1), elevation }); // Add vertices to VertexArray
-          midpoint_temp.clear();
-          v_I5 = VertexArray.size()-1;
+          v_I5 = newVertex(midpoint_temp.at(0), midpoint_temp.at(1)); // add the new vertex
           if (v_I1 < v_I2)
           {
           EdgeArray.push_back({ v_I1, v_I2, v_I5 }); // add calculated edge to edgeArray
@@ -336,12 +760,7 @@ cout << FaceArray_current.size() << " faces created." << endl << endl;
       if (checkEdgeDivide(EdgeArray, v_I2,v_I3)==-1)
       {
           vector<double> midpoint_temp = midpointCalc(VertexArray.at(v_I2).v_Lat, VertexArray.at(v_I2).v_Long, VertexArray.at(v_I3).v_Lat, VertexArray.at(v_I3).v_Long);
-          coord = ll_to_xyz(midpoint_temp.at(0), midpoint_temp.at(1));
-          planet_out result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
-          elevation = result.h * heightMod * radius; // generate the height value at the coordinates
-          VertexArray.push_back({ midpoint_temp.at(0), midpoint_temp.at(1), elevation});
-          midpoint_temp.clear();
-          v_I6 = VertexArray.size()-1;
+          v_I6 = newVertex(midpoint_temp.at(0), midpoint_temp.at(1)); // add the new vertex
           EdgeArray.push_back({ v_I2, v_I3, v_I6 }); // add calculated edge to edgeArray
       }
       else
@@ -352,12 +771,7 @@ cout << FaceArray_current.size() << " faces created." << endl << endl;
       if (checkEdgeDivide(EdgeArray, v_I3,v_I4)==-1)
       {
           vector<double> midpoint_temp = midpointCalc(VertexArray.at(v_I3).v_Lat, VertexArray.at(v_I3).v_Long, VertexArray.at(v_I4).v_Lat, VertexArray.at(v_I4).v_Long);
-          coord = ll_to_xyz(midpoint_temp.at(0), midpoint_temp.at(1));
-          planet_out result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
-          elevation = result.h * heightMod * radius; // generate the height value at the coordinates
-          VertexArray.push_back({ midpoint_temp.at(0), midpoint_temp.at(1), elevation });
-          midpoint_temp.clear();
-          v_I7 = VertexArray.size()-1;
+          v_I7 = newVertex(midpoint_temp.at(0), midpoint_temp.at(1)); // add the new vertex
           EdgeArray.push_back({ v_I3, v_I4, v_I7 }); // add calculated edge to edgeArray
       }
       else
@@ -368,12 +782,7 @@ cout << FaceArray_current.size() << " faces created." << endl << endl;
       if (checkEdgeDivide(EdgeArray, v_I4,v_I1)==-1)
       {
           vector<double> midpoint_temp = midpointCalc(VertexArray.at(v_I4).v_Lat, VertexArray.at(v_I4).v_Long, VertexArray.at(v_I1).v_Lat, VertexArray.at(v_I1).v_Long);
-          coord = ll_to_xyz(midpoint_temp.at(0), midpoint_temp.at(1));
-          planet_out result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
-          elevation = result.h * heightMod * radius; // generate the height value at the coordinates
-          VertexArray.push_back({ midpoint_temp.at(0), midpoint_temp.at(1), elevation });
-          midpoint_temp.clear();
-          v_I8 = VertexArray.size()-1;
+          v_I8 = newVertex(midpoint_temp.at(0), midpoint_temp.at(1)); // add the new vertex
           EdgeArray.push_back({ v_I4, v_I1, v_I8 }); // add calculated edge to edgeArray
       }
       else
@@ -382,30 +791,736 @@ cout << FaceArray_current.size() << " faces created." << endl << endl;
       }
 // int v_I9 = -1;
           vector<double> midpoint_temp = midpointCalc(VertexArray.at(v_I2).v_Lat, VertexArray.at(v_I2).v_Long, VertexArray.at(v_I4).v_Lat, VertexArray.at(v_I4).v_Long);
-          coord = ll_to_xyz(midpoint_temp.at(0), midpoint_temp.at(1));
-          planet_out result = planet(tetra[0], tetra[1], tetra[2], tetra[3], coord.x, coord.y, coord.z, Calc_Level);
-          elevation = result.h * heightMod * radius; // generate the height value at the coordinates
-          VertexArray.push_back({ midpoint_temp.at(0), midpoint_temp.at(1), elevation });
-          midpoint_temp.clear();
-          int v_I9 = VertexArray.size()-1;
+          int v_I9 = newVertex(midpoint_temp.at(0), midpoint_temp.at(1)); // add the new vertex
           EdgeArray.push_back({ v_I2, v_I4, v_I9});
 // add new faces to FaceArray_new
 FaceArray_new.push_back ({v_I1, v_I5, v_I9, v_I8}); // Face 1
 FaceArray_new.push_back ({v_I5, v_I2, v_I6, v_I9}); // Face 2
 FaceArray_new.push_back ({v_I9, v_I6, v_I3, v_I7}); // Face 3
 FaceArray_new.push_back ({v_I8, v_I9, v_I7, v_I4}); // Face 4
+PROFILE_CHECK(watchVertices);
+PROFILE_CHECK(watchEdges);
+PROFILE_CHECK(watchFaces);
+progress.set(fcount + 1);
+afterFace(fcount + 1);
 // if (fcount > 0 && fcount % 1000 == 0) { // used to check tessalation completion.
 // fcountPercent = (static_cast<float>(fcount) / fcountMax) * 100.0f;
 // cout << endl << "Tessalation Level " << Tessalation_Level_current << ": " << fcountPercent << "% complete." << endl; }
 }
+}
+
+// Prints the counts of the level just made.
+void levelDone(const vector<struct_VertexArray> &VertexArray, const vector<struct_FaceArray> &FaceArray_current, int Tessalation_Level_current)
+{
+PROFILE_SET(counterVertices, VertexArray.size());
+PROFILE_SET(counterFaces, FaceArray_current.size());
+if (showProgress) {
  cout << endl << "Tessalation " << Tessalation_Level - Tessalation_Level_current + 1 << " of " << Tessalation_Level << " complete." << endl;
-FaceArray_current.clear();
-FaceArray_current = FaceArray_new;
 cout << VertexArray.size() << " vertices calculated." << endl;
 cout << FaceArray_current.size() << " faces created." << endl << endl; // number will always represent quads as triangles are calculated at output stage by dividing the quad into two triangles then.
-FaceArray_new.clear();
-EdgeArray.clear();
+}
+}
+
+// Subdivides every quad of FaceArray_current into four, adding the new vertices (with their heights) to VertexArray.
+// Tessalation_Level_current counts down to 1 and is only used for the progress output. A level begun before
+// (by a checkpoint) goes on from resumeFrom.
+void tessellateLevel(vector<struct_VertexArray> &VertexArray, vector<struct_FaceArray> &FaceArray_current, int Tessalation_Level_current,
+                     struct_LevelState *resumeFrom = nullptr)
+{
+  PROFILE_LEVEL(Tessalation_Level - Tessalation_Level_current + 1);
+  PROFILE_SCOPE(phaseLevel);
+  progressLevel.store(Tessalation_Level - Tessalation_Level_current + 1, memory_order_relaxed);
+  struct_LevelState state;
+  if (resumeFrom != nullptr) state = std::move(*resumeFrom);
+  state.levelsDone = Tessalation_Level - Tessalation_Level_current;
+  subdivideFaces(VertexArray, FaceArray_current, state.FaceArray_new, state.EdgeArray, state.fcount, [&VertexArray](double lat, double lon) {
+    llxyz coord = ll_to_xyz(lat, lon);
+    planet_out result = planetAt(coord);
+    VertexArray.push_back({ lat, lon, result.h * heightMod * radius }); // Add vertices to VertexArray
+    return static_cast<int>(VertexArray.size()) - 1;
+  }, [&](int fcount) {
+    if (checkpointInterval > 0.0 && fcount % 1024 == 0 && checkpointDue()) {
+      state.fcount = fcount;
+      appendCheckpoint(VertexArray, FaceArray_current, state);
+    }
+  }, progressClaim("tessellate"));
+FaceArray_current.clear();
+FaceArray_current = state.FaceArray_new;
+levelDone(VertexArray, FaceArray_current, Tessalation_Level_current);
+if (checkpointInterval >= 0.0) {
+  struct_LevelState next; // the next level, not begun
+  next.levelsDone = state.levelsDone + 1;
+  saveCheckpoint(VertexArray, FaceArray_current, next);
+}
+}
+
+// Writes the head of a Wavefront .OBJ.
+void writeOBJHeader(ostream &outFile)
+{
+    outFile << std::fixed << std::setprecision(12);
+    outFile << "# icosahedron test\n";
+    outFile << "# This is your first file output.\n";
+}
+
+// Writes the v line of a vertex, at its height above the sea level seaLevel.
+void writeOBJVertex(ostream &outFile, const struct_VertexArray &vertex_loop, double seaLevel)
+{
+      /* commented out for bug fix
+ //         double x = vertex_loop.v_Height * cos(vertex_loop.v_Lat) * cos(vertex_loop.v_Long);
+ //         double y = vertex_loop.v_Height * cos(vertex_loop.v_Lat) * sin(vertex_loop.v_Long);
+ //         double z = vertex_loop.v_Height * sin(vertex_loop.v_Lat);
+ */
+        double unit_x = cos(vertex_loop.v_Lat) * cos(vertex_loop.v_Long);
+        double unit_y = cos(vertex_loop.v_Lat) * sin(vertex_loop.v_Long);
+        double unit_z = sin(vertex_loop.v_Lat);
+
+        double r = radius + seaLevel + vertex_loop.v_Height;
+
+        double x = r * unit_x;
+        double y = r * unit_y;
+        double z = r * unit_z;
+
+      // rounding error correction
+      if (abs(x) < 1e-10) x = 0.0;
+      if (abs(y) < 1e-10) y = 0.0;
+      if (abs(z) < 1e-10) z = 0.0;
+      
+      outFile << "v " << x << " " << y << " " << -z << endl;
+}
+
+// Writes the faces, after the vertices; progress counts on from before.
+void writeOBJFaces(ostream &outFile, const vector<struct_FaceArray> &FaceArray_current, struct_ProgressSlot &progress, long long before)
+{
+    // add faces to output file
+    int fcount = 0;
+    if (triOrQuad == true ) {
+    fcount = 0;
+    outFile << endl << "# Faces - Triangles" << endl;
+    for (struct_FaceArray face_loop : FaceArray_current) {
+      // 1,4,2
+      outFile << "f " << face_loop.v1+1 << " " << face_loop.v4+1 << " " << face_loop.v2+1 << endl;
+      // 4,3,2
+      outFile << "f " << face_loop.v4+1 << " " << face_loop.v3+1 << " " << face_loop.v2+1 << endl;
+      progress.set(before + ++fcount);
+    }
+    } else {
+    fcount = 0;
+    outFile << endl << "# Faces - Quads" << endl;
+    for (struct_FaceArray face_loop : FaceArray_current) {
+      outFile << "f " << face_loop.v1+1 << " " << face_loop.v4+1 << " " << face_loop.v3+1 << " " << face_loop.v2+1 << endl;
+      fcount++;
+      progress.set(before + fcount); };
+    }
+}
+
+// Writes the mesh as a Wavefront .OBJ, with triangles or quads as set by triOrQuad.
+void writeOBJ(ostream &outFile, const vector<struct_VertexArray> &VertexArray, const vector<struct_FaceArray> &FaceArray_current)
+{
+    writeOBJHeader(outFile);
+    int vcount = 0;
+    double seaLevel = M * heightMod * radius; // vertex heights are stored relative to sea level
+    struct_ProgressSlot &progress = progressClaim("writeOBJ");
+    progress.start(static_cast<long long>(VertexArray.size() + FaceArray_current.size()));
+
+    // add vertices to output file.
+    for (const struct_VertexArray &vertex_loop: VertexArray) {
+      writeOBJVertex(outFile, vertex_loop, seaLevel);
+      vcount++;
+      progress.set(vcount);
+    }
+
+    writeOBJFaces(outFile, FaceArray_current, progress, vcount);
+}
+
+// ******************************* Pipeline ********************
+// With -P the last level is made and written in three stages at once: topology (the calling thread) splits the
+// faces and numbers the new vertices as tessellateLevel() does, evaluate gives them their heights and write writes
+// them to the .OBJ, each stage passing blocks of vertices to the next through a bounded queue in order. The faces
+// follow the last vertex, so the .OBJ is the same as without -P. The stages' utilisation is reported on stderr.
+
+bool pipelined = false;
+const size_t pipelineBlock = 4096; // vertices per block
+
+struct struct_VertexBlock {
+  vector<struct_VertexArray> vertices;
+};
+
+// Queue of blocks from one thread to one other, without locks; a nullptr ends it. A stage waiting for room or
+// for a block yields, and adds the time to waited.
+struct struct_BlockQueue {
+  static const size_t capacity = 16;
+  struct_VertexBlock *slots[capacity];
+  atomic<size_t> head{0}, tail{0}; // next to pop, next to push
+
+  void push(struct_VertexBlock *block, double &waited) {
+    size_t t = tail.load(memory_order_relaxed);
+    if (t - head.load(memory_order_acquire) == capacity) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      while (t - head.load(memory_order_acquire) == capacity) this_thread::yield();
+      waited += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    slots[t % capacity] = block;
+    tail.store(t + 1, memory_order_release);
+  }
+  struct_VertexBlock *pop(double &waited) {
+    size_t h = head.load(memory_order_relaxed);
+    if (tail.load(memory_order_acquire) == h) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      while (tail.load(memory_order_acquire) == h) this_thread::yield();
+      waited += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    struct_VertexBlock *block = slots[h % capacity];
+    head.store(h + 1, memory_order_release);
+    return block;
+  }
+};
+
+// Makes the last level as tessellateLevel(VertexArray, FaceArray_current, 1) does, and writes the .OBJ as
+// writeOBJ() does while the level is made.
+void tessellateAndWrite(vector<struct_VertexArray> &VertexArray, vector<struct_FaceArray> &FaceArray_current, ostream &outFile)
+{
+  PROFILE_LEVEL(Tessalation_Level);
+  PROFILE_SCOPE(phaseLevel);
+  progressLevel.store(Tessalation_Level, memory_order_relaxed);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  const char *stageNames[3] = { "topology", "evaluate", "write" };
+  double waited[3] = { 0.0, 0.0, 0.0 }, finished[3];
+  auto since = [&start] { return chrono::duration<double>(chrono::steady_clock::now() - start).count(); };
+  size_t oldVertices = VertexArray.size();
+  long long newVertices = 3LL * FaceArray_current.size(); // of a closed mesh: one per edge (two per face) and face
+  struct_BlockQueue toEvaluate, toWrite;
+  vector<struct_FaceArray> FaceArray_new;
+  vector<struct_VertexBlock*> written; // in order
+
+  thread evaluate([&] {
+    struct_ProgressSlot &progress = progressClaim("evaluate");
+    progress.start(newVertices);
+    long long count = 0;
+    while (struct_VertexBlock *block = toEvaluate.pop(waited[1])) {
+      for (struct_VertexArray &vertex : block->vertices) {
+        llxyz coord = ll_to_xyz(vertex.v_Lat, vertex.v_Long);
+        planet_out result = planetAt(coord);
+        vertex.v_Height = result.h * heightMod * radius;
+      }
+      progress.set(count += block->vertices.size());
+      toWrite.push(block, waited[1]);
+    }
+    toWrite.push(nullptr, waited[1]);
+    finished[1] = since();
+  });
+
+  thread write([&] {
+    struct_ProgressSlot &progress = progressClaim("writeOBJ");
+    progress.start(static_cast<long long>(oldVertices + 4 * FaceArray_current.size()) + newVertices);
+    double seaLevel = M * heightMod * radius; // vertex heights are stored relative to sea level
+    long long vcount = 0;
+    writeOBJHeader(outFile);
+    for (size_t k = 0; k < oldVertices; k++) { // these have their heights already
+      writeOBJVertex(outFile, VertexArray[k], seaLevel);
+      progress.set(++vcount);
+    }
+    while (struct_VertexBlock *block = toWrite.pop(waited[2])) {
+      for (const struct_VertexArray &vertex : block->vertices) writeOBJVertex(outFile, vertex, seaLevel);
+      progress.set(vcount += block->vertices.size());
+      written.push_back(block);
+    }
+    // topology finished before the end of the queue, so FaceArray_new is complete
+    writeOBJFaces(outFile, FaceArray_new, progress, vcount);
+    finished[2] = since();
+  });
+
+  struct_VertexBlock *block = new struct_VertexBlock;
+  block->vertices.reserve(pipelineBlock);
+  int next = oldVertices;
+  vector<struct_EdgeArray> EdgeArray;
+  subdivideFaces(VertexArray, FaceArray_current, FaceArray_new, EdgeArray, 0, [&](double lat, double lon) {
+    if (block->vertices.size() == pipelineBlock) {
+      toEvaluate.push(block, waited[0]);
+      block = new struct_VertexBlock;
+      block->vertices.reserve(pipelineBlock);
+    }
+    block->vertices.push_back({ lat, lon, 0.0 });
+    return next++;
+  }, [](int) {}, progressClaim("tessellate"));
+  toEvaluate.push(block, waited[0]);
+  toEvaluate.push(nullptr, waited[0]);
+  finished[0] = since();
+  evaluate.join();
+  write.join();
+  double wall = since();
+
+  VertexArray.reserve(next);
+  for (struct_VertexBlock *done : written) {
+    VertexArray.insert(VertexArray.end(), done->vertices.begin(), done->vertices.end());
+    delete done;
+  }
+  FaceArray_current.swap(FaceArray_new);
+  levelDone(VertexArray, FaceArray_current, 1);
+
+  ostringstream out;
+  out << fixed << setprecision(3);
+  if (progressMode == progressJSON) {
+    out << "{\"seconds\": " << wall << ", \"event\": \"pipeline\", \"level\": " << Tessalation_Level << ", \"stages\": [";
+    for (int k = 0; k < 3; k++)
+      out << (k ? ", " : "") << "{\"name\": \"" << stageNames[k] << "\", \"seconds\": " << finished[k]
+          << ", \"waited\": " << waited[k] << ", \"utilisation\": " << (finished[k] - waited[k]) / wall << "}";
+    out << "]}\n";
+  } else {
+    out << "Pipelined level " << Tessalation_Level << " in " << wall << " s:";
+    for (int k = 0; k < 3; k++)
+      out << (k ? "," : "") << " " << stageNames[k] << " " << setprecision(3) << finished[k] - waited[k] << " s busy ("
+          << setprecision(0) << 100.0 * (finished[k] - waited[k]) / wall << "%)" << setprecision(3);
+    out << "\n";
+  }
+  if (progressMode != progressNone) cerr << out.str() << flush;
+}
+
+// ******************************* Region ********************
+// With -R only the faces that meet a region, a latitude/longitude box "south,north,west,east" or a cap
+// "latitude,longitude,radius" (degrees), are split at each level, the rest are dropped, and just that patch is
+// written to T<level>_Tri<t>_Region.OBJ. Its vertices are where a full-globe run puts them, with the same heights,
+// and T<level>_Tri<t>_Region.txt gives the number of each of its vertices and faces in the full-globe .OBJ.
+//
+// A full run numbers the new vertices of a level in the order of the faces that make them, and a face only reuses
+// the midpoint of an edge if checkEdgeDivide() finds the other face's entry, which it does not when that entry is
+// not in order (only the first edge of a face is stored sorted). How each edge is split is the same below every face,
+// so it is followed by a code per edge, and the vertices made before a face are counted from the codes rather than
+// made. The faces next to the patch whose midpoints it reuses are split too, but not written.
+
+enum regionShape { regionNone, regionBox, regionCap };
+regionShape regionMode = regionNone;
+double regionBounds[4]; // radians: south, north, west, east of a box, or latitude, longitude, radius of a cap
+
+// Sets the region from -R's argument. Returns false if it is neither a box nor a cap.
+bool parseRegion(const char *spec) {
+  double b[4];
+  int n = sscanf(spec, "%lf,%lf,%lf,%lf", &b[0], &b[1], &b[2], &b[3]);
+  if (n < 3) return false;
+  for (int k = 0; k < n; k++) regionBounds[k] = b[k] * pi / 180.0;
+  regionMode = n == 4 ? regionBox : regionCap;
+  return n == 4 ? b[0] <= b[1] : b[2] >= 0.0;
+}
+
+// angle between two directions
+double angleBetween(const llxyz &a, const llxyz &b) {
+  double cx = a.y * b.z - a.z * b.y, cy = a.z * b.x - a.x * b.z, cz = a.x * b.y - a.y * b.x;
+  return atan2(sqrt(cx * cx + cy * cy + cz * cz), a.x * b.x + a.y * b.y + a.z * b.z);
+}
+
+// whether a face may meet the region: the smallest cap about the middle of its corners holds it (its edges are
+// great circle arcs), and the cap is tested
+bool regionMeets(const vector<struct_VertexArray> &VertexArray, const struct_FaceArray &face) {
+  const int corners[4] = { face.v1, face.v2, face.v3, face.v4 };
+  llxyz c[4];
+  double x = 0.0, y = 0.0, z = 0.0;
+  for (int k = 0; k < 4; k++) {
+    c[k] = ll_to_xyz(VertexArray[corners[k]].v_Lat, VertexArray[corners[k]].v_Long);
+    x += c[k].x; y += c[k].y; z += c[k].z;
+  }
+  double length = sqrt(x * x + y * y + z * z);
+  llxyz middle = { asin(y / length), atan2(x, z), x / length, y / length, z / length };
+  double r = 0.0;
+  for (int k = 0; k < 4; k++) r = max(r, angleBetween(middle, c[k]));
+  r += 1e-12; // rounding
+  if (regionMode == regionCap)
+    return angleBetween(middle, ll_to_xyz(regionBounds[0], regionBounds[1])) <= r + regionBounds[2];
+  if (middle.lat - r > regionBounds[1] || middle.lat + r < regionBounds[0]) return false;
+  if (middle.lat + r >= pi / 2.0 || middle.lat - r <= -pi / 2.0) return true; // round a pole
+  double dLong = asin(min(1.0, sin(r) / cos(middle.lat)));
+  double width = regionBounds[3] - regionBounds[2];
+  if (width < 0.0) width += 2.0 * pi; // across the antimeridian
+  double start = middle.lon - dLong - regionBounds[2]; // of the face's longitudes, east of the box's west side
+  start -= 2.0 * pi * floor(start / (2.0 * pi));
+  return start <= width || start + 2.0 * dLong >= 2.0 * pi;
+}
+
+// The code of an edge of a face: its role (0 if no other face has the edge, 1 if the other face comes later, 2 if
+// earlier), its slot in the face (0 for v1-v2 to 3 for v4-v1), its slot in the other face, and whether it runs
+// from the lower vertex index to the higher.
+const int edgeCodes = 96;
+int edgeCode(int role, int slot, int otherSlot, int ascending) { return ((role * 4 + slot) * 4 + otherSlot) * 2 + ascending; }
+int edgeRole(int code) { return code / 32; }
+int edgeSlot(int code) { return code / 8 % 4; }
+int edgeOtherSlot(int code) { return code / 2 % 4; }
+int edgeAscending(int code) { return code % 2; }
+
+// whether the face makes the midpoint of the edge, rather than finding the other face's (stored sorted, or in order)
+bool edgeMakes(int code) {
+  return !(edgeRole(code) == 2 && (edgeOtherSlot(code) == 0 || !edgeAscending(code)));
+}
+
+// whether both faces of the edge use the same midpoint
+bool edgeShared(int code) {
+  if (edgeRole(code) == 1) return edgeSlot(code) == 0 || edgeAscending(code);
+  return edgeRole(code) == 2 && !edgeMakes(code);
+}
+
+// code of the half of the edge from its first vertex (first) or to its last, at the next level; the midpoint is
+// newer than the ends, and the halves have no other face if the midpoint was not shared
+int edgeHalf(int code, bool first) {
+  return edgeCode(edgeShared(code) ? edgeRole(code) : 0, edgeSlot(code), edgeOtherSlot(code), first ? 1 : 0);
+}
+
+// the edge codes of the four faces a face is split into, as subdivideFaces() makes them; the centre is newer than
+// the midpoints
+void childEdges(const unsigned char edges[4], unsigned char child[4][4]) {
+  const int split[4][4] = {
+    { edgeHalf(edges[0], true), edgeCode(1, 1, 3, 1), edgeCode(1, 2, 0, 0), edgeHalf(edges[3], false) },
+    { edgeHalf(edges[0], false), edgeHalf(edges[1], true), edgeCode(1, 2, 0, 1), edgeCode(2, 3, 1, 0) },
+    { edgeCode(2, 0, 2, 0), edgeHalf(edges[1], false), edgeHalf(edges[2], true), edgeCode(1, 3, 1, 1) },
+    { edgeCode(2, 0, 2, 1), edgeCode(2, 1, 3, 0), edgeHalf(edges[2], false), edgeHalf(edges[3], true) } };
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++) child[i][j] = split[i][j];
+}
+const int innerEdges[8] = { edgeCode(1, 1, 3, 1), edgeCode(1, 2, 0, 0), edgeCode(1, 2, 0, 1), edgeCode(2, 3, 1, 0),
+                            edgeCode(2, 0, 2, 0), edgeCode(1, 3, 1, 1), edgeCode(2, 0, 2, 1), edgeCode(2, 1, 3, 0) };
+
+struct struct_RegionFace {
+  long long number;       // in a full-globe run, from 0
+  unsigned char edges[4]; // edge codes
+  bool inside;            // meets the region (or, before it is tested, its parent did)
+};
+
+// Makes the faces of Tessalation_Level that meet the region, and the vertices they use, as a full-globe run does.
+// number[k] is the full-globe index of VertexArray[k], and faceNumber[k] of FaceArray_current[k], both from 0.
+void tessellateRegion(vector<struct_VertexArray> &VertexArray, vector<struct_FaceArray> &FaceArray_current,
+                      vector<long long> &number, vector<long long> &faceNumber)
+{
+  int levels = Tessalation_Level;
+  // midpoints made at each depth below an edge of each code, and below the inside of a face
+  vector<vector<long long>> made(levels + 1, vector<long long>(edgeCodes));
+  vector<long long> inside(levels + 1);
+  for (int c = 0; c < edgeCodes; c++) made[0][c] = edgeMakes(c);
+  for (int d = 1; d <= levels; d++)
+    for (int c = 0; c < edgeCodes; c++) made[d][c] = made[d - 1][edgeHalf(c, true)] + made[d - 1][edgeHalf(c, false)];
+  for (int d = 0; d <= levels; d++) {
+    long long faces = 1; // 4^(i - 1)
+    inside[d] = 1LL << (2 * d); // centres
+    for (int i = 1; i <= d; i++, faces *= 4)
+      for (int c : innerEdges) inside[d] += faces * made[d - i][c];
+  }
+  auto faceMakes = [&](const unsigned char edges[4], int d) {
+    return inside[d] + made[d][edges[0]] + made[d][edges[1]] + made[d][edges[2]] + made[d][edges[3]];
+  };
+
+  // the icosahedron, with the codes of its edges
+  VertexArray = generate_initial_icosahedron_vertices();
+  FaceArray_current = associate_initial_faces();
+  number.clear();
+  for (int k = 0; k < 12; k++) number.push_back(k);
+  vector<struct_RegionFace> faces(FaceArray_current.size());
+  for (size_t f = 0; f < faces.size(); f++) {
+    faces[f].number = f;
+    faces[f].inside = true;
+    const int *v = &FaceArray_current[f].v1;
+    for (int j = 0; j < 4; j++)
+      for (size_t g = 0; g < faces.size(); g++) {
+        const int *w = &FaceArray_current[g].v1;
+        for (int k = 0; k < 4; k++)
+          if (g != f && w[k] == v[(j + 1) % 4] && w[(k + 1) % 4] == v[j])
+            faces[f].edges[j] = edgeCode(g > f ? 1 : 2, j, k, v[j] < v[(j + 1) % 4]);
+      }
+  }
+  vector<long long> vertexCount(levels + 1, 12); // of a full-globe run, at each level
+  for (int d = 0; d < levels; d++) {
+    vertexCount[d + 1] = vertexCount[d];
+    for (const struct_RegionFace &face : faces) vertexCount[d + 1] += faceMakes(face.edges, d);
+  }
+  // made at each depth below the faces before each face
+  vector<long long> before(faces.size() * levels);
+  for (size_t f = 1; f < faces.size(); f++)
+    for (int d = 0; d < levels; d++) before[f * levels + d] = before[(f - 1) * levels + d] + faceMakes(faces[f - 1].edges, d);
+
+  auto newVertex = [&](int from, int to, long long n) { // the midpoint, as midpointCalc(from, to) of a full run
+    vector<double> midpoint = midpointCalc(VertexArray[from].v_Lat, VertexArray[from].v_Long, VertexArray[to].v_Lat, VertexArray[to].v_Long);
+    VertexArray.push_back({ midpoint[0], midpoint[1], 0.0 });
+    number.push_back(n);
+    return static_cast<int>(VertexArray.size()) - 1;
+  };
+  auto edgeKey = [](int a, int b) { return (static_cast<long long>(min(a, b)) << 32) | max(a, b); };
+
+  struct_ProgressSlot &progress = progressClaim("tessellate");
+  for (int level = 0; ; level++) {
+    int depths = levels - level; // of before, per face
+    // keep the faces that meet the region, and those whose midpoints they find at the next level
+    unordered_set<long long> found;
+    for (size_t f = 0; f < faces.size(); f++) {
+      faces[f].inside = faces[f].inside && regionMeets(VertexArray, FaceArray_current[f]);
+      const int *v = &FaceArray_current[f].v1;
+      for (int j = 0; j < 4 && faces[f].inside && level < levels; j++)
+        if (!edgeMakes(faces[f].edges[j])) found.insert(edgeKey(v[j], v[(j + 1) % 4]));
+    }
+    size_t kept = 0, around = 0;
+    for (size_t f = 0; f < faces.size(); f++) {
+      bool keep = faces[f].inside;
+      const int *v = &FaceArray_current[f].v1;
+      for (int j = 0; j < 4 && !keep && !found.empty(); j++)
+        keep = edgeRole(faces[f].edges[j]) == 1 && found.count(edgeKey(v[j], v[(j + 1) % 4])) > 0;
+      if (!keep) continue;
+      around += !faces[f].inside;
+      faces[kept] = faces[f];
+      FaceArray_current[kept] = FaceArray_current[f];
+      copy(before.begin() + f * depths, before.begin() + (f + 1) * depths, before.begin() + kept * depths);
+      kept++;
+    }
+    faces.resize(kept);
+    FaceArray_current.resize(kept);
+    before.resize(kept * depths);
+    if (showProgress && level > 0) {
+      cout << endl << "Tessalation " << level << " of " << levels << " complete." << endl;
+      cout << kept - around << " faces in the region, " << around << " around it." << endl;
+    }
+    if (level == levels) break;
+    progressLevel.store(level + 1, memory_order_relaxed);
+
+    // split them as subdivideFaces() does, numbering the vertices as a full-globe run
+    vector<struct_RegionFace> faces_new;
+    vector<struct_FaceArray> FaceArray_new;
+    vector<long long> before_new(4 * kept * (depths - 1));
+    faces_new.reserve(4 * kept);
+    FaceArray_new.reserve(4 * kept);
+    unordered_map<long long, int> midpoints; // of the edges both faces share, by their ends
+    progress.start(kept);
+    for (size_t f = 0; f < kept; f++) {
+      long long next = vertexCount[level] + before[f * depths];
+      const int *v = &FaceArray_current[f].v1;
+      int mid[4];
+      for (int j = 0; j < 4; j++) {
+        int a = v[j], b = v[(j + 1) % 4], code = faces[f].edges[j];
+        if (edgeMakes(code)) {
+          mid[j] = newVertex(a, b, next++);
+          if (edgeShared(code)) midpoints[edgeKey(a, b)] = mid[j];
+        } else {
+          auto it = midpoints.find(edgeKey(a, b)); // made by the other face, if it is kept (the region's always are)
+          mid[j] = it != midpoints.end() ? it->second : newVertex(b, a, -1);
+        }
+      }
+      int centre = newVertex(v[1], v[3], next++);
+      FaceArray_new.push_back({ v[0], mid[0], centre, mid[3] });
+      FaceArray_new.push_back({ mid[0], v[1], mid[1], centre });
+      FaceArray_new.push_back({ centre, mid[1], v[2], mid[2] });
+      FaceArray_new.push_back({ mid[3], centre, mid[2], v[3] });
+      unsigned char child[4][4];
+      childEdges(faces[f].edges, child);
+      for (int i = 0; i < 4; i++) {
+        struct_RegionFace face;
+        face.number = 4 * faces[f].number + i;
+        memcpy(face.edges, child[i], 4);
+        face.inside = faces[f].inside; // only the region's faces can be in it at the next level
+        faces_new.push_back(face);
+      }
+      for (int d = 0; d + 1 < depths; d++) {
+        long long sum = before[f * depths + d + 1];
+        for (int i = 0; i < 4; i++) {
+          before_new[(4 * f + i) * (depths - 1) + d] = sum;
+          sum += faceMakes(child[i], d);
+        }
+      }
+      progress.set(f + 1);
+    }
+    faces.swap(faces_new);
+    FaceArray_current.swap(FaceArray_new);
+    before.swap(before_new);
+  }
+  progressLevel.store(0, memory_order_relaxed);
+
+  // the vertices of the patch, in the full-globe order, with their heights
+  vector<int> local(VertexArray.size(), -1);
+  vector<int> used;
+  for (const struct_FaceArray &face : FaceArray_current)
+    for (int v : { face.v1, face.v2, face.v3, face.v4 })
+      if (local[v] == -1) { local[v] = 0; used.push_back(v); }
+  sort(used.begin(), used.end(), [&number](int a, int b) { return number[a] < number[b]; });
+  vector<struct_VertexArray> patch(used.size());
+  vector<long long> patchNumber(used.size());
+  progress.start(used.size());
+  for (size_t k = 0; k < used.size(); k++) {
+    local[used[k]] = k;
+    patch[k] = VertexArray[used[k]];
+    patch[k].v_Height = planetAt(ll_to_xyz(patch[k].v_Lat, patch[k].v_Long)).h * heightMod * radius;
+    patchNumber[k] = number[used[k]];
+    progress.set(k + 1);
+  }
+  for (struct_FaceArray &face : FaceArray_current) face = { local[face.v1], local[face.v2], local[face.v3], local[face.v4] };
+  VertexArray.swap(patch);
+  number.swap(patchNumber);
+  faceNumber.clear();
+  for (const struct_RegionFace &face : faces) faceNumber.push_back(face.number);
+}
+
+// Makes and writes the patch of -R. Returns main's exit status.
+int runRegion() {
+  vector<struct_VertexArray> VertexArray;
+  vector<struct_FaceArray> FaceArray_current;
+  vector<long long> number, faceNumber;
+  cout << "Is Triangles: " << triOrQuad << endl << endl;
+  {
+    struct_ProgressReporter reporter;
+    tessellateRegion(VertexArray, FaceArray_current, number, faceNumber);
   }
+  cout << endl << VertexArray.size() << " vertices and " << FaceArray_current.size() << " faces in the region." << endl;
+
+  ostringstream RFN;
+  RFN << "T" << Tessalation_Level << "_Tri" << triOrQuad << "_Region";
+  ofstream outFile(RFN.str() + ".OBJ"), numberFile(RFN.str() + ".txt");
+  if (!outFile.is_open() || !numberFile.is_open()) {
+    cerr << "Unable to open file for writing.\n";
+    return 1;
+  }
+  writeOBJ(outFile, VertexArray, FaceArray_current);
+  // the numbers of the .OBJ's vertices and faces (quads, or the first of their two triangles) in a full-globe .OBJ
+  for (long long n : number) numberFile << "v " << n + 1 << "\n";
+  for (long long n : faceNumber) numberFile << "f " << (triOrQuad ? 2 * n + 1 : n + 1) << "\n";
+  cout << RFN.str() << ".OBJ written successfully.\n";
+  return 0;
+}
+
+#ifdef TEST_PROFILE
+// Writes the phases and counters of each level as JSON and CSV. "other" is the time of a level outside
+// checkEdgeDivide, midpointCalc and planet: ll_to_xyz, the push_backs and the copy of the faces.
+void writeProfile() {
+  ostringstream PFN;
+  PFN << "T" << Tessalation_Level << "_S" << rseed << "_Profile";
+  ofstream json(PFN.str() + ".json"), csv(PFN.str() + ".csv");
+  if (!json.is_open() || !csv.is_open()) {
+    cerr << "Unable to open " << PFN.str() << ".json or .csv for writing.\n";
+    return;
+  }
+  json << setprecision(9) << "{\n  \"tessellation_level\": " << Tessalation_Level << ",\n  \"calc_level\": " << Calc_Level
+       << ",\n  \"seed\": " << rseed << ",\n  \"levels\": [";
+  csv << setprecision(9) << "level";
+  for (int p = 0; p < phaseCount; p++) csv << "," << phaseNames[p] << "_s";
+  csv << ",other_s";
+  for (int c = 0; c < counterCount; c++) csv << "," << counterNames[c];
+  csv << "\n";
+  bool first = true;
+  for (int l = 0; l < profileLevels; l++) {
+    bool used = false;
+    for (int p = 0; p < phaseCount; p++) used = used || profileSeconds[l][p] > 0.0;
+    for (int c = 0; c < counterCount; c++) used = used || profileCounts[l][c] != 0;
+    if (!used) continue;
+    double other = l == 0 ? 0.0 : max(0.0, profileSeconds[l][phaseLevel] - profileSeconds[l][phaseEdgeSearch]
+                                            - profileSeconds[l][phaseMidpoint] - profileSeconds[l][phasePlanet]);
+    json << (first ? "\n" : ",\n") << "    {\"level\": " << l << ", \"seconds\": {";
+    csv << l;
+    for (int p = 0; p < phaseCount; p++) {
+      json << (p ? ", " : "") << "\"" << phaseNames[p] << "\": " << profileSeconds[l][p];
+      csv << "," << profileSeconds[l][p];
+    }
+    json << ", \"other\": " << other << "}, \"counters\": {";
+    csv << "," << other;
+    for (int c = 0; c < counterCount; c++) {
+      json << (c ? ", " : "") << "\"" << counterNames[c] << "\": " << profileCounts[l][c];
+      csv << "," << profileCounts[l][c];
+    }
+    json << "}}";
+    csv << "\n";
+    first = false;
+  }
+  json << "\n  ]\n}\n";
+}
+#endif
+
+// **************************************************************************************
+
+#ifndef TEST_NO_MAIN // bench.cpp includes this file for its functions
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && strcmp(argv[i], "-p") == 0) { // progress as text (the default), json lines or none
+      string mode = argv[++i];
+      progressMode = mode == "json" ? progressJSON : mode == "none" ? progressNone : progressText;
+    } else if (strcmp(argv[i], "-k") == 0) { // keep the mesh in a height cache, and use it if it is there
+      useHeightCache = true;
+    } else if (strcmp(argv[i], "-P") == 0) { // make and write the last level in stages at once
+      pipelined = true;
+    } else if (i + 1 < argc && strcmp(argv[i], "-c") == 0) { // checkpoint after each level, and every so many seconds
+      checkpointInterval = max(0.0, atof(argv[++i]));
+    } else if (strcmp(argv[i], "-r") == 0) { // resume from the checkpoint
+      resumeRun = true;
+    } else if (i + 1 < argc && strcmp(argv[i], "-R") == 0) { // only the patch of a box or cap
+      if (!parseRegion(argv[++i])) {
+        cerr << "-R takes south,north,west,east or latitude,longitude,radius in degrees.\n";
+        return 1;
+      }
+    } else { // tessellation level, instead of Tessalation_Level's default
+      char *end;
+      long level = strtol(argv[i], &end, 10);
+      if (end == argv[i] || *end != '\0' || level < 1 || level > maxTessalationLevel) {
+        cerr << "Usage: " << argv[0] << " [-p text|json|none] [-k] [-P] [-c seconds] [-r] [-R region] [level]\n"
+             << "  level is the tessellation level, 1 to " << maxTessalationLevel
+             << " (default " << Tessalation_Level << ").\n";
+        return 1;
+      }
+      Tessalation_Level = static_cast<int>(level);
+      Calc_Level = Tessalation_Level + 15;
+    }
+  }
+  PROFILE_AT_EXIT();
+  chrono::steady_clock::time_point runStart = chrono::steady_clock::now();
+  initialize_vertices(); // Initialize the tetrahedron vertices and seed for planet generation
+  for (int t = 0; t < 4; t++) tetra[t].h = 0.0; // generate heights relative to sea level; M is applied at output
+  if (regionMode != regionNone) return runRegion();
+
+//  using namespace std;  // commented out until I can figure out what's going on.
+// Generate the inital 12 vertices and original 10 faces.  
+  vector<struct_VertexArray> VertexArray;
+  vector<struct_FaceArray> FaceArray_current;
+  bool cacheLoaded = useHeightCache && loadHeightCache(VertexArray, FaceArray_current);
+  struct_LevelState resumeState; // where the checkpoint left off
+  bool resumed = !cacheLoaded && resumeRun && loadCheckpoint(VertexArray, FaceArray_current, resumeState);
+  if (!cacheLoaded && !resumed) {
+    resumeState = struct_LevelState();
+    VertexArray = generate_initial_icosahedron_vertices(); // Generate initial vertices
+    FaceArray_current = associate_initial_faces(); // Associate initial faces
+  }  
+  cout << "Is Triangles: " << triOrQuad << endl << endl;
+  /*/ **************************    initialization testing
+  int vcount = 1;
+  int fcount = 1;
+  // Print the index, Lat, Long, and Height of each vertex
+  for (struct_VertexArray vertex_loop : VertexArray) {
+    cout << "v" << vcount << " " << vertex_loop.v_Index << " " << vertex_loop.v_Lat << " " << vertex_loop.v_Long << " " << vertex_loop.v_Height << endl;
+    vcount++;  };
+        
+  for (struct_FaceArray face_loop : FaceArray_current) { // int f_Index, v1, v2, v3, v4;
+      cout << "f" << fcount << " " << face_loop.f_Index << " " << face_loop.v1 << " " << face_loop.v2 << " " << face_loop.v3 << " " << face_loop.v4 << endl;
+      fcount++;  };
+  
+ // midpoint test.
+  cout << "Lat_1:0.0, Long_1:1.0, Lat_2:1.0, Long_2:2.0" << " : " << midpoint_Lat(0.0, 1.0, 1.0, 2.0) << endl;
+  cout << "Lat_1:0.0, Long_1:1.0, Lat_2:1.0, Long_2:2.0" << " : " << midpoint_Long(0.0, 1.0, 1.0, 2.0) << endl;
+  // End of initialization testing */ 
+ 
+if (cacheLoaded) {
+cout << "Loaded tessellation from " << heightCacheName() << "." << endl;
+} else if (resumed) {
+cout << "Resumed from " << checkpointName() << ": " << resumeState.levelsDone << " of " << Tessalation_Level << " levels made";
+if (resumeState.fcount > 0) cout << ", " << resumeState.fcount << " faces of the next split";
+cout << "." << endl;
+} else {
+cout << "Initialization of icosahedron complete." << endl;
+}
+cout << VertexArray.size() << " vertices calculated." << endl;
+cout << FaceArray_current.size() << " faces created." << endl << endl;
+
+  // ******************** Start of Tessalation *********************
+  struct_ProgressReporter reporter;
+  ostringstream OFN;
+  OFN << "T" << Tessalation_Level << "_Tri" << triOrQuad << "_Output.OBJ";
+  string OutputFileName = OFN.str();
+  ofstream outFile;
+  int firstLevel = cacheLoaded ? 0 : Tessalation_Level - resumeState.levelsDone;
+  bool pipelining = pipelined && firstLevel > 0 && !(firstLevel == 1 && resumeState.fcount > 0); // not a level begun before
+  if (pipelining) outFile.open(OutputFileName); // the .OBJ is written while the last level is made
+  pipelining = pipelining && outFile.is_open();
+  
+  for ( int Tessalation_Level_current = firstLevel; Tessalation_Level_current > (pipelining ? 1 : 0); Tessalation_Level_current--)
+    tessellateLevel(VertexArray, FaceArray_current, Tessalation_Level_current,
+                    resumed && Tessalation_Level_current == firstLevel ? &resumeState : nullptr);
+  if (pipelining) tessellateAndWrite(VertexArray, FaceArray_current, outFile);
+  progressLevel.store(0, memory_order_relaxed);
+  PROFILE_LEVEL(0);
+  if (useHeightCache && !cacheLoaded) saveHeightCache(VertexArray, FaceArray_current);
   
 /*
 // test vertex output
@@ -490,71 +1605,38 @@ Additional Notes:
 - Lines can be continued with a backslash `\` at the end.
 - vertices are indexed by the order they appear, starting at 1
 */
-ostringstream OFN;
-OFN << "T" << Tessalation_Level << "_Tri" << triOrQuad << "_Output.OBJ";
-string OutputFileName = OFN.str();
-ofstream outFile(OutputFileName); // Create and open a file named output.txt
+if (!pipelining) outFile.open(OutputFileName); // Create and open a file named output.txt
 
     if (outFile.is_open()) {
-        outFile << std::fixed << std::setprecision(12);
-        outFile << "# icosahedron test\n";
-        outFile << "# This is your first file output.\n";
-        int vcount = 0;
         cout << endl;
-
-        // add vertices to output file.
-        for (struct_VertexArray vertex_loop: VertexArray) {
-          /* commented out for bug fix
- //         double x = vertex_loop.v_Height * cos(vertex_loop.v_Lat) * cos(vertex_loop.v_Long);
- //         double y = vertex_loop.v_Height * cos(vertex_loop.v_Lat) * sin(vertex_loop.v_Long);
- //         double z = vertex_loop.v_Height * sin(vertex_loop.v_Lat);
- */
-            double unit_x = cos(vertex_loop.v_Lat) * cos(vertex_loop.v_Long);
-            double unit_y = cos(vertex_loop.v_Lat) * sin(vertex_loop.v_Long);
-            double unit_z = sin(vertex_loop.v_Lat);
-
-            double r = radius + vertex_loop.v_Height;
-
-            double x = r * unit_x;
-            double y = r * unit_y;
-            double z = r * unit_z;
-
-          // rounding error correction
-          if (abs(x) < 1e-10) x = 0.0;
-          if (abs(y) < 1e-10) y = 0.0;
-          if (abs(z) < 1e-10) z = 0.0;
-          
-          outFile << "v " << x << " " << y << " " << -z << endl;
-          vcount++;
-        }
-
-        // add faces to output file
-        int fcount = 0;
-        if (triOrQuad == true ) {
-        fcount = 0;
-        outFile << endl << "# Faces - Triangles" << endl;
-        for (struct_FaceArray face_loop : FaceArray_current) {
-          // 1,4,2
-          outFile << "f " << face_loop.v1+1 << " " << face_loop.v4+1 << " " << face_loop.v2+1 << endl;
-          // 4,3,2
-          outFile << "f " << face_loop.v4+1 << " " << face_loop.v3+1 << " " << face_loop.v2+1 << endl;
+        {
+          PROFILE_SCOPE(phaseWriteOBJ);
+          if (!pipelining) writeOBJ(outFile, VertexArray, FaceArray_current);
+          PROFILE_COUNT(counterBytesWritten, static_cast<long long>(outFile.tellp()));
         }
-        } else {
-        fcount = 0;
-        outFile << endl << "# Faces - Quads" << endl;
-        for (struct_FaceArray face_loop : FaceArray_current) {
-          outFile << "f " << face_loop.v1+1 << " " << face_loop.v4+1 << " " << face_loop.v3+1 << " " << face_loop.v2+1 << endl;
-          fcount++; };
-        }
-      
-
         outFile.close(); // Always close the file when done
+        reporter.stop();
         cout << "T" << Tessalation_Level << "_Tri" << triOrQuad << "_Output.OBJ" <<" written successfully.\n";
+        if (checkpointInterval >= 0.0 || resumed) remove(checkpointName().c_str()); // the run is done
     } else {
         cerr << "Unable to open file for writing.\n";
     }
+    if (checkpointInterval >= 0.0) { // what the checkpoints cost
+      double runSeconds = chrono::duration<double>(chrono::steady_clock::now() - runStart).count();
+      ostringstream out;
+      out << fixed << setprecision(3);
+      if (progressMode == progressJSON)
+        out << "{\"seconds\": " << runSeconds << ", \"event\": \"checkpoints\", \"count\": " << checkpointCount
+            << ", \"bytes\": " << checkpointBytes << ", \"checkpoint_seconds\": " << checkpointSeconds
+            << ", \"overhead\": " << checkpointSeconds / runSeconds << "}\n";
+      else
+        out << "Checkpoints: " << checkpointCount << " written, " << setprecision(1) << checkpointBytes / 1048576.0 << " MB in "
+            << setprecision(3) << checkpointSeconds << " s (" << setprecision(1) << 100.0 * checkpointSeconds / runSeconds
+            << "% of " << runSeconds << " s)\n";
+      cerr << out.str() << flush;
+    }
 
 
   return 0;
 }
-
+#endif